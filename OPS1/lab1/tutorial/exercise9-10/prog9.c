@@ -11,8 +11,8 @@
 #define FILETYPES_COUNT 8
 
 // the difference between prog9.c and prog10.c is that
-// prog9.c doesn't change current working directory, and allocates
-// memory for strings to new paths instead
+// prog9.c doesn't change current working directory, and builds
+// strings to new paths in a buffer instead
 // also prog10.c allows recursive scan
 
 // option flags
@@ -85,6 +85,13 @@ static void scan_dirpath(const char* dirpath, const char* program_name)
     if (be_verbose_flag)
         printf("Scanning directory \"%s\" ...\n", dirpath);
 
+    // container for the paths to the elements, it's reused for every
+    // element and grows only when a longer name comes, so there is no
+    // malloc() and free() per element
+    size_t dirpath_length = strlen(dirpath);
+    size_t elementpath_size = 0;
+    char* elementpath = NULL;
+
     int index = 1;
     do {
         errno = 0;
@@ -101,30 +108,35 @@ static void scan_dirpath(const char* dirpath, const char* program_name)
             if (be_verbose_flag)
                 printf("[%d]: %s", index, drnt->d_name);
 
-            // create container for the path to current element
             // one additinal memory cell for '\0'
             // and one for '/'
-            char* elementpath = 
-                (char*)malloc(strlen(dirpath) + strlen(drnt->d_name) + 2);
-            
-            // copy dirpath to the container
-            strcpy(elementpath, dirpath);
+            size_t needed = dirpath_length + strlen(drnt->d_name) + 2;
+            if (needed > elementpath_size)
+            {
+                // realloc keeps the dirpath written the first time
+                char* grown = (char*)realloc(elementpath, needed);
+                if (grown == NULL)
+                {
+                    perror("Unable to allocate memory for a path");
+                    free(elementpath);
+                    usage(program_name);
+                }
+                if (elementpath == NULL)
+                {
+                    // copy dirpath to the container and append '/' sign
+                    memcpy(grown, dirpath, dirpath_length);
+                    grown[dirpath_length] = '/';
+                }
+                elementpath = grown;
+                elementpath_size = needed;
+            }
 
-            // move terminating sign by one memory cell
-            elementpath[strlen(elementpath) + 1] = '\0'; 
-            
-            // append '/' sign
-            elementpath[strlen(elementpath)] = '/'; 
-            
-            // append name of the file
-            strcat(elementpath, drnt->d_name);
+            // append name of the file after the '/' sign
+            strcpy(elementpath + dirpath_length + 1, drnt->d_name);
 
             // find the status
             int lstat_result = lstat(elementpath, &statbuf);
 
-            // free the memory
-            free(elementpath);
-
             // try to get status of the current file
             if (lstat_result == -1)
             {
@@ -161,6 +173,9 @@ static void scan_dirpath(const char* dirpath, const char* program_name)
         index++;
     } while (drnt != NULL);
 
+    // free the memory
+    free(elementpath);
+
     // catch the reading error
     if (errno != 0)
     {
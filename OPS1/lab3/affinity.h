@@ -0,0 +1,222 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+// placement of the threads of a simulation on the cpus
+//
+// the topology of the cpus the process may run on (sched_getaffinity) is
+// read from /sys and turned into an order of cpus, the i-th thread pins
+// itself to the i-th cpu of that order (modulo their number):
+//   compact - hyperthreads of a core, then the cores of a package, then the
+//             next package, the threads share caches
+//   scatter - one thread per package in turn, then per core, siblings last
+//   cores   - one cpu of every physical core
+//
+// the policy is taken from the AFFINITY environment variable, e.g.
+//   AFFINITY=scatter ./prog 1000000 8
+// without it the threads aren't pinned
+//
+// a thread should allocate (and first touch) its own data after pinning,
+// so the pages come from the memory of its numa node
+//
+// the functions are static inline, so every program of the lab builds from
+// its one prog.c, as before
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AFFINITY_SYS_CPU "/sys/devices/system/cpu/cpu"
+
+typedef enum AffinityPolicy_
+{
+    AFFINITY_NONE,
+    AFFINITY_COMPACT,
+    AFFINITY_SCATTER,
+    AFFINITY_CORES
+} AffinityPolicy;
+
+typedef struct AffinityPlan_
+{
+    AffinityPolicy policy;
+    // cpus in the order of the policy
+    int *cpus;
+    int count;
+} AffinityPlan;
+
+typedef struct AffinityCpu_
+{
+    int cpu;
+    int package;
+    int core;
+    int node;
+    // position among the hyperthreads of its core
+    int sibling;
+    // position of its core in the package
+    int coreRank;
+} AffinityCpu;
+
+static inline void AffinityFail(const char *source)
+{
+    perror(source);
+    exit(EXIT_FAILURE);
+}
+
+// a missing file (no such topology on this machine) counts as 0
+static inline int AffinityReadTopology(int cpu, const char *name)
+{
+    char path[128];
+    int value = 0;
+
+    snprintf(path, sizeof(path), AFFINITY_SYS_CPU "%d/topology/%s", cpu, name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%d", &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
+
+// the cpu directory has a nodeN link on numa machines
+static inline int AffinityReadNode(int cpu)
+{
+    char path[128];
+    struct dirent *entry;
+    int node = 0;
+
+    snprintf(path, sizeof(path), AFFINITY_SYS_CPU "%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+        node = 0;
+    }
+    closedir(dir);
+    return node;
+}
+
+static inline int AffinityCompareCompact(const void *a, const void *b)
+{
+    const AffinityCpu *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static inline int AffinityCompareScatter(const void *a, const void *b)
+{
+    const AffinityCpu *x = a, *y = b;
+    if (x->sibling != y->sibling)
+        return x->sibling - y->sibling;
+    if (x->coreRank != y->coreRank)
+        return x->coreRank - y->coreRank;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->package - y->package;
+}
+
+// reads the policy from the environment and probes the topology
+static inline void AffinityInit(AffinityPlan *plan)
+{
+    static const char *names[] = { "none", "compact", "scatter", "cores" };
+    const char *name = getenv("AFFINITY");
+
+    memset(plan, 0, sizeof(AffinityPlan));
+    for (int i = 0; name != NULL && i < 4; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+            plan->policy = (AffinityPolicy)i;
+    }
+    if (plan->policy == AFFINITY_NONE)
+        return;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set))
+        AffinityFail("sched_getaffinity() failed");
+
+    int count = CPU_COUNT(&set);
+    AffinityCpu *info = (AffinityCpu*)calloc(count, sizeof(AffinityCpu));
+    plan->cpus = (int*)malloc(sizeof(int) * count);
+    if (info == NULL || plan->cpus == NULL)
+        AffinityFail("malloc() failed");
+
+    for (int cpu = 0, i = 0; i < count; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        info[i].cpu = cpu;
+        info[i].package = AffinityReadTopology(cpu, "physical_package_id");
+        info[i].core = AffinityReadTopology(cpu, "core_id");
+        info[i].node = AffinityReadNode(cpu);
+        i++;
+    }
+
+    // the cpus are in ascending order, so the lowest cpu of a core is its first sibling
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < i; j++)
+        {
+            if (info[j].package == info[i].package && info[j].core == info[i].core)
+                info[i].sibling++;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            if (info[j].package == info[i].package && info[j].core < info[i].core && info[j].sibling == 0)
+                info[i].coreRank++;
+        }
+    }
+
+    qsort(info, count, sizeof(AffinityCpu),
+          plan->policy == AFFINITY_SCATTER ? AffinityCompareScatter : AffinityCompareCompact);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (plan->policy == AFFINITY_CORES && info[i].sibling != 0)
+            continue;
+        plan->cpus[plan->count++] = info[i].cpu;
+    }
+
+    free(info);
+}
+
+static inline void AffinityDestroy(AffinityPlan *plan)
+{
+    free(plan->cpus);
+    plan->cpus = NULL;
+    plan->count = 0;
+}
+
+// pins the calling thread, returns its cpu (-1 if the threads aren't pinned)
+static inline int AffinityPinSelf(const AffinityPlan *plan, int index)
+{
+    if (plan->count == 0)
+        return -1;
+
+    cpu_set_t set;
+    int cpu = plan->cpus[index % plan->count];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    // pthread functions return the error instead of setting errno
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (err) {
+        errno = err;
+        AffinityFail("pthread_setaffinity_np() failed");
+    }
+    return cpu;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -11,6 +12,8 @@
 #include <memory.h>
 #include <signal.h>
 
+#include "../../affinity.h"
+
 #define MAXLINE 4096
 #define DEAFULT_THREAD_COUNT 10 
 #define DEAFULT_DURATION 3 
@@ -28,6 +31,9 @@ typedef struct PigArg_
     pthread_mutex_t *mtxHouse;
 } PigArg;
 
+// placement of the pigs, see affinity.h
+AffinityPlan affinity;
+
 UINT msleep(UINT miliseconds);
 void set_handler(int signal, void (*handler)(int));
 
@@ -57,6 +63,8 @@ int main(int argc, char **argv)
     // generate global seed
     srand(time(NULL));
 
+    AffinityInit(&affinity);
+
     // houses array
     int *housesArray = (int*)malloc(sizeof(int) * pigCount);
     if (housesArray == NULL)
@@ -181,6 +189,7 @@ int main(int argc, char **argv)
     free(pigsArgs);
     free(housesArray);
     free(mtxHousesArray);
+    AffinityDestroy(&affinity);
 
     return EXIT_SUCCESS;
 }
@@ -228,6 +237,8 @@ void *WorkerPig(void *rawPtr)
 {
     PigArg *args = (PigArg*)rawPtr;
 
+    AffinityPinSelf(&affinity, args->index);
+
     pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
     pthread_cleanup_push(PigsTestament, args);
     while (1)
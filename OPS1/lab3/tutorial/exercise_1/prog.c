@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -6,6 +7,8 @@
 #include <math.h>
 #include <errno.h>
 
+#include "../../affinity.h"
+
 #define ERR(source)                                                                                                    \
 	(fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
     perror(source), exit(EXIT_FAILURE))
@@ -21,10 +24,14 @@ void usage(char *name)
 typedef struct threadInfo
 {
     pthread_t tid;
+    int index;
     uint seed;
     int samplesCount;
 } threadInfo_t;
 
+// placement of the workers, see affinity.h
+AffinityPlan affinity;
+
 void* worker(void* args);
 
 int main(int argc, char **argv)
@@ -40,11 +47,14 @@ int main(int argc, char **argv)
     int n = atoi(argv[2]);
     if (n <= 0) usage(argv[0]);
 
-    threadInfo_t* info = (threadInfo_t*) malloc(sizeof(threadInfo_t) * n);
+    threadInfo_t* info = (threadInfo_t*) malloc(sizeof(threadInfo_t) * k);
     if (info == NULL) ERR("malloc() failed");
 
+    AffinityInit(&affinity);
+
     for (int i = 0; i < k; i++)
     {
+        info[i].index = i;
         info[i].seed = rand();
         info[i].samplesCount = n;
         pthread_create(&(info[i].tid), NULL, worker, &(info[i]));
@@ -67,6 +77,7 @@ int main(int argc, char **argv)
     printf("PI ~= %f\n", estimated);
 
     free(info);
+    AffinityDestroy(&affinity);
 
     return EXIT_SUCCESS;
 }
@@ -74,6 +85,14 @@ int main(int argc, char **argv)
 void* worker(void* args)
 {
     threadInfo_t* info = (threadInfo_t*)args;
+
+    // pinned before the result is allocated, so it's in the memory of its node
+    AffinityPinSelf(&affinity, info->index);
+
+    // the seed is copied to the stack, the neighbouring threadInfo_t
+    // structures share cache lines, so rand_r() on info->seed would keep
+    // bouncing them between the cpus
+    uint seed = info->seed;
     
     double* result = (double*)malloc(sizeof(double));
     if (result == NULL) ERR("malloc() failed");   
@@ -82,8 +101,8 @@ void* worker(void* args)
     for (int i = 0; i < info->samplesCount; i++)
     {
         // generating random normalized coords
-        double xCoord = (double)(rand_r(&info->seed)) / (double)RAND_MAX;
-        double yCoord = (double)(rand_r(&info->seed)) / (double)RAND_MAX;
+        double xCoord = (double)(rand_r(&seed)) / (double)RAND_MAX;
+        double yCoord = (double)(rand_r(&seed)) / (double)RAND_MAX;
         
         if (sqrt(xCoord * xCoord + yCoord * yCoord) <= 1.0)
             insideTheCircleCount++;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -6,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "../../affinity.h"
+
 #define MAXLINE 4096
 // deafult values
 #define DEFAULT_N 1000
@@ -23,6 +26,7 @@ typedef unsigned int UINT;
 // structure used to parse arguments to a thread function 
 typedef struct argsThrower {
 	pthread_t tid;
+	int index;
 	UINT seed;
 	int *pBallsThrown;
 	int *pBallsWaiting;
@@ -32,6 +36,9 @@ typedef struct argsThrower {
 	pthread_mutex_t *pmxBallsWaiting;
 } argsThrower_t;
 
+// placement of the throwers, see affinity.h
+AffinityPlan affinity;
+
 // reads arguments from the console, uses deafult values if nothing has been specified
 void ReadArguments(int argc, char **argv, int *ballsCount, int *throwersCount);
 
@@ -85,9 +92,12 @@ int main(int argc, char **argv)
     // setting up a seed
 	srand(time(NULL));
 
+	AffinityInit(&affinity);
+
     // initializng thread arguments, by giving the references to 
     // the shared values
 	for (int i = 0; i < throwersCount; i++) {
+		args[i].index = i;
 		args[i].seed = (UINT)rand();
 		args[i].pBallsThrown = &ballsThrown;
 		args[i].pBallsWaiting = &ballsWaiting;
@@ -182,6 +192,9 @@ void *Thrower(void *voidArgs)
     // casting a raw pointer 
 	argsThrower_t *args = voidArgs;
     uint count = 0;
+
+    // pinning the thread, its place in the policy order is its index
+	AffinityPinSelf(&affinity, args->index);
 	while (1) 
     {
         // checking if all balls has been thrown, if so break the loop
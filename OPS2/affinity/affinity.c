@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include "../mysocklib/mysocklib.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYS_CPU "/sys/devices/system/cpu/cpu"
+
+struct cpu_info {
+    int cpu;
+    int package;
+    int core;
+    int node;
+    // position among the hyperthreads of its core
+    int sibling;
+    // position of its core in the package
+    int core_rank;
+};
+
+static const char *policy_names[] = { "none", "compact", "scatter", "cores" };
+
+// a missing file (no such topology on this machine) counts as 0
+static int read_topology(int cpu, const char *name)
+{
+    char path[128];
+    int value = 0;
+
+    snprintf(path, sizeof(path), SYS_CPU "%d/topology/%s", cpu, name);
+    FILE *f = fopen(path, "r");
+    if (NULL == f)
+        return 0;
+    if (fscanf(f, "%d", &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
+
+// the cpu directory has a nodeN link on numa machines
+static int read_node(int cpu)
+{
+    char path[128];
+    struct dirent *entry;
+    int node = 0;
+
+    snprintf(path, sizeof(path), SYS_CPU "%d", cpu);
+    DIR *dir = opendir(path);
+    if (NULL == dir)
+        return 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+        node = 0;
+    }
+    closedir(dir);
+    return node;
+}
+
+static int compare_compact(const void *a, const void *b)
+{
+    const struct cpu_info *x = (const struct cpu_info *)a, *y = (const struct cpu_info *)b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+    const struct cpu_info *x = (const struct cpu_info *)a, *y = (const struct cpu_info *)b;
+    if (x->sibling != y->sibling)
+        return x->sibling - y->sibling;
+    if (x->core_rank != y->core_rank)
+        return x->core_rank - y->core_rank;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->package - y->package;
+}
+
+int aff_parse_policy(const char *name, enum aff_policy *policy)
+{
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy = (enum aff_policy)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void aff_plan_init(struct aff_plan *plan, enum aff_policy policy)
+{
+    cpu_set_t set;
+    struct cpu_info *info;
+
+    memset(plan, 0, sizeof(struct aff_plan));
+    plan->policy = policy;
+    if (AFF_NONE == policy)
+        return;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set))
+        ERR("sched_getaffinity() failed");
+
+    int count = CPU_COUNT(&set);
+    if ((info = (struct cpu_info *)calloc(count, sizeof(struct cpu_info))) == NULL)
+        ERR("calloc() failed");
+    if ((plan->cpus = (int *)malloc(count * sizeof(int))) == NULL)
+        ERR("malloc() failed");
+
+    for (int cpu = 0, i = 0; i < count; cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        info[i].cpu = cpu;
+        info[i].package = read_topology(cpu, "physical_package_id");
+        info[i].core = read_topology(cpu, "core_id");
+        info[i].node = read_node(cpu);
+        i++;
+    }
+
+    // the cpus are in ascending order, so the lowest cpu of a core is its first sibling
+    for (int i = 0; i < count; i++) {
+        int new_package = 1, new_node = 1;
+        for (int j = 0; j < i; j++) {
+            if (info[j].package == info[i].package) {
+                new_package = 0;
+                if (info[j].core == info[i].core)
+                    info[i].sibling++;
+            }
+            if (info[j].node == info[i].node)
+                new_node = 0;
+        }
+        plan->package_count += new_package;
+        plan->node_count += new_node;
+        if (0 == info[i].sibling)
+            plan->core_count++;
+    }
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < count; j++)
+            if (info[j].package == info[i].package && info[j].core < info[i].core && 0 == info[j].sibling)
+                info[i].core_rank++;
+    plan->cpu_count = count;
+
+    qsort(info, count, sizeof(struct cpu_info), AFF_SCATTER == policy ? compare_scatter : compare_compact);
+
+    for (int i = 0; i < count; i++) {
+        if (AFF_CORES == policy && info[i].sibling != 0)
+            continue;
+        plan->cpus[plan->count++] = info[i].cpu;
+    }
+
+    free(info);
+}
+
+void aff_plan_from_env(struct aff_plan *plan)
+{
+    enum aff_policy policy = AFF_NONE;
+    const char *name = getenv(AFFINITY_ENV);
+
+    if (name && aff_parse_policy(name, &policy))
+        fprintf(stderr, "[Affinity] unknown policy \"%s\" (none|compact|scatter|cores), threads aren't pinned\n", name);
+    aff_plan_init(plan, policy);
+}
+
+void aff_plan_destroy(struct aff_plan *plan)
+{
+    free(plan->cpus);
+    plan->cpus = NULL;
+    plan->count = 0;
+}
+
+int aff_pin_self(const struct aff_plan *plan, int index)
+{
+    cpu_set_t set;
+
+    if (0 == plan->count)
+        return -1;
+
+    int cpu = plan->cpus[index % plan->count];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (error) {
+        errno = error;
+        ERR("pthread_setaffinity_np() failed");
+    }
+    return cpu;
+}
+
+void aff_print_plan(FILE *f, const struct aff_plan *plan)
+{
+    if (AFF_NONE == plan->policy)
+        return;
+
+    fprintf(f, "[Affinity] %s: %d cpus, %d cores, %d packages, %d nodes, order:", policy_names[plan->policy],
+            plan->cpu_count, plan->core_count, plan->package_count, plan->node_count);
+    for (int i = 0; i < plan->count; i++)
+        fprintf(f, " %d", plan->cpus[i]);
+    fprintf(f, "\n");
+}
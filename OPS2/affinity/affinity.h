@@ -0,0 +1,61 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+#include <stdio.h>
+
+// placement of the threads of a pool on the cpus
+//
+// the topology (package, core and numa node of every cpu the process may
+// run on, see sched_getaffinity) is read from /sys, a policy turns it into
+// an order of cpus and the i-th thread of a pool is pinned to the i-th cpu
+// of that order (modulo their number):
+//   compact - hyperthreads of a core, then the cores of a package, then the
+//             next package, the threads share caches
+//   scatter - one thread per package in turn, then per core, siblings last,
+//             the threads get as much cache and memory bandwidth as possible
+//   cores   - one cpu of every physical core, in the compact order
+//
+// a thread should allocate (and first touch) its own data after pinning, so
+// the pages come from its numa node
+//
+// the pools take the policy from the AFFINITY environment variable, by
+// default (or with AFFINITY=none) the threads aren't pinned
+#define AFFINITY_ENV "AFFINITY"
+
+enum aff_policy {
+    AFF_NONE,
+    AFF_COMPACT,
+    AFF_SCATTER,
+    AFF_CORES
+};
+
+struct aff_plan {
+    enum aff_policy policy;
+    // cpus in the order of the policy
+    int *cpus;
+    int count;
+
+    // found by the probe
+    int cpu_count;
+    int core_count;
+    int package_count;
+    int node_count;
+};
+
+// returns -1 if the name isn't a policy
+int aff_parse_policy(const char *name, enum aff_policy *policy);
+
+// probes the topology, AFF_NONE makes an empty plan
+void aff_plan_init(struct aff_plan *plan, enum aff_policy policy);
+
+// the policy from AFFINITY_ENV, an unknown one is reported and ignored
+void aff_plan_from_env(struct aff_plan *plan);
+
+void aff_plan_destroy(struct aff_plan *plan);
+
+// pins the calling thread to the cpu of the index-th thread, returns the cpu
+// (-1 if the plan is empty)
+int aff_pin_self(const struct aff_plan *plan, int index);
+
+void aff_print_plan(FILE *f, const struct aff_plan *plan);
+
+#endif
@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+#include "coro.h"
+#include "../mysocklib/mysocklib.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+struct coro {
+    ucontext_t ctx;
+    // the mapping, the guard page first
+    char *stack;
+    void (*fn)(void *arg);
+    void *arg;
+    struct coro_sched *sched;
+
+    // run queue or inbox
+    struct coro *next;
+    // coroutines waiting for the same descriptor
+    struct coro *wait_prev;
+    struct coro *wait_next;
+    int waiting_fd;
+    uint32_t wait_events;
+
+    int64_t deadline;
+    // position in the timer heap, -1 if not sleeping
+    int heap_index;
+
+    int cancelled;
+    int finished;
+};
+
+struct coro_sched {
+    struct coro_runtime *rt;
+    pthread_t tid;
+    int epoll_fd;
+    int event_fd;
+    // the context of the scheduler loop
+    ucontext_t ctx;
+
+    struct coro *ready_head;
+    struct coro *ready_tail;
+    // coroutines waiting for every descriptor, indexed by it, the epoll
+    // registration of a descriptor asks for the events of all of them
+    struct coro **waiters;
+    int waiters_capacity;
+
+    // coroutines spawned from other threads, protected by the mutex
+    pthread_mutex_t mutex;
+    struct coro *inbox;
+    int stopping;
+    int cancel;
+    // the waiting calls of every coroutine fail from now on
+    int cancelled;
+
+    // sleeping coroutines, the nearest deadline first
+    struct coro **heap;
+    int heap_count;
+    int heap_capacity;
+
+    char *stack_pool[CORO_STACK_POOL];
+    int pool_count;
+
+    // coroutines of this scheduler which haven't finished
+    int live;
+} __attribute__((aligned(64)));
+
+static __thread struct coro_sched *current_sched;
+static __thread struct coro *current_coro;
+
+static size_t page_size;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime() failed");
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* STACKS */
+
+static char *stack_get(struct coro_sched *s)
+{
+    char *stack;
+
+    if (s->pool_count > 0)
+        return s->stack_pool[--s->pool_count];
+
+    // mapped by the scheduler thread, so the pages come from its node
+    if ((stack = (char *)mmap(NULL, page_size + CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0)) == MAP_FAILED)
+        ERR("mmap() failed");
+    if (mprotect(stack, page_size, PROT_NONE))
+        ERR("mprotect() failed");
+
+    return stack;
+}
+
+static void stack_put(struct coro_sched *s, char *stack)
+{
+    if (s->pool_count < CORO_STACK_POOL) {
+        s->stack_pool[s->pool_count++] = stack;
+        return;
+    }
+    if (munmap(stack, page_size + CORO_STACK_SIZE))
+        ERR("munmap() failed");
+}
+
+/* TIMER HEAP */
+
+static void heap_swap(struct coro_sched *s, int i, int j)
+{
+    struct coro *c = s->heap[i];
+    s->heap[i] = s->heap[j];
+    s->heap[j] = c;
+    s->heap[i]->heap_index = i;
+    s->heap[j]->heap_index = j;
+}
+
+static void heap_push(struct coro_sched *s, struct coro *c)
+{
+    if (s->heap_count == s->heap_capacity) {
+        s->heap_capacity = s->heap_capacity ? 2 * s->heap_capacity : 64;
+        if ((s->heap = (struct coro **)realloc(s->heap, s->heap_capacity * sizeof(struct coro *))) == NULL)
+            ERR("realloc() failed");
+    }
+
+    int i = s->heap_count++;
+    s->heap[i] = c;
+    c->heap_index = i;
+    while (i > 0 && s->heap[(i - 1) / 2]->deadline > s->heap[i]->deadline) {
+        heap_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static struct coro *heap_pop(struct coro_sched *s)
+{
+    struct coro *top = s->heap[0];
+    int i = 0;
+
+    heap_swap(s, 0, --s->heap_count);
+    top->heap_index = -1;
+
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < s->heap_count && s->heap[l]->deadline < s->heap[smallest]->deadline)
+            smallest = l;
+        if (r < s->heap_count && s->heap[r]->deadline < s->heap[smallest]->deadline)
+            smallest = r;
+        if (smallest == i)
+            break;
+        heap_swap(s, i, smallest);
+        i = smallest;
+    }
+
+    return top;
+}
+
+/* SCHEDULING */
+
+static void make_ready(struct coro_sched *s, struct coro *c)
+{
+    c->next = NULL;
+    if (s->ready_tail)
+        s->ready_tail->next = c;
+    else
+        s->ready_head = c;
+    s->ready_tail = c;
+}
+
+static void wait_unlink(struct coro_sched *s, struct coro *c)
+{
+    if (c->wait_prev)
+        c->wait_prev->wait_next = c->wait_next;
+    else
+        s->waiters[c->waiting_fd] = c->wait_next;
+    if (c->wait_next)
+        c->wait_next->wait_prev = c->wait_prev;
+    c->waiting_fd = -1;
+}
+
+// arms the one shot registration of the descriptor for everything its
+// waiters wait for, returns -1 if epoll refuses it
+static int wait_arm(struct coro_sched *s, int fd)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLONESHOT;
+    for (struct coro *c = s->waiters[fd]; c; c = c->wait_next)
+        event.events |= c->wait_events;
+    event.data.fd = fd;
+
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &event)) {
+        if (errno != ENOENT || epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+            return -1;
+    }
+    return 0;
+}
+
+// resumes the waiters of the descriptor the events are for, an error or
+// a hang-up wakes all of them, the others wait further
+static void wait_wake(struct coro_sched *s, int fd, uint32_t events)
+{
+    struct coro *c = s->waiters[fd], *next;
+
+    for (; c; c = next) {
+        next = c->wait_next;
+        if ((c->wait_events & events) || (events & (EPOLLERR | EPOLLHUP))) {
+            wait_unlink(s, c);
+            make_ready(s, c);
+        }
+    }
+
+    // their calls will find out what's wrong with the descriptor
+    if (s->waiters[fd] && wait_arm(s, fd)) {
+        while (s->waiters[fd]) {
+            c = s->waiters[fd];
+            wait_unlink(s, c);
+            make_ready(s, c);
+        }
+    }
+}
+
+static void trampoline(void)
+{
+    struct coro *c = current_coro;
+
+    c->fn(c->arg);
+
+    // the stack is released by the scheduler, it can't be done on it
+    c->finished = 1;
+    setcontext(&c->sched->ctx);
+    ERR("setcontext() failed");
+}
+
+static void coro_start(struct coro_sched *s, struct coro *c)
+{
+    c->sched = s;
+    c->stack = stack_get(s);
+    c->waiting_fd = -1;
+    c->heap_index = -1;
+
+    if (getcontext(&c->ctx))
+        ERR("getcontext() failed");
+    c->ctx.uc_stack.ss_sp = c->stack + page_size;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, trampoline, 0);
+
+    s->live++;
+    make_ready(s, c);
+}
+
+static void resume(struct coro_sched *s, struct coro *c)
+{
+    current_coro = c;
+    if (swapcontext(&s->ctx, &c->ctx))
+        ERR("swapcontext() failed");
+    current_coro = NULL;
+
+    if (c->finished) {
+        stack_put(s, c->stack);
+        free(c);
+        s->live--;
+    }
+}
+
+// switches from the current coroutine back to the scheduler
+static void suspend(void)
+{
+    struct coro *c = current_coro;
+    if (swapcontext(&c->ctx, &c->sched->ctx))
+        ERR("swapcontext() failed");
+}
+
+// wakes every waiting and sleeping coroutine, their calls fail
+static void cancel_all(struct coro_sched *s)
+{
+    for (int fd = 0; fd < s->waiters_capacity; fd++) {
+        if (NULL == s->waiters[fd])
+            continue;
+        // the registration must not fire for a coroutine which may be gone by then
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL) && errno != ENOENT && errno != EBADF)
+            ERR("epoll_ctl() failed");
+        while (s->waiters[fd]) {
+            struct coro *c = s->waiters[fd];
+            wait_unlink(s, c);
+            c->cancelled = 1;
+            make_ready(s, c);
+        }
+    }
+    while (s->heap_count > 0) {
+        struct coro *c = heap_pop(s);
+        c->cancelled = 1;
+        make_ready(s, c);
+    }
+}
+
+// takes the coroutines spawned from outside, returns 1 if the scheduler is stopping
+static int take_inbox(struct coro_sched *s, int *cancel)
+{
+    struct coro *c, *next;
+    int stopping;
+
+    if (pthread_mutex_lock(&s->mutex))
+        ERR("pthread_mutex_lock() failed");
+    c = s->inbox;
+    s->inbox = NULL;
+    stopping = s->stopping;
+    *cancel = s->cancel;
+    if (pthread_mutex_unlock(&s->mutex))
+        ERR("pthread_mutex_unlock() failed");
+
+    // the list is in the reverse order of spawning
+    struct coro *reversed = NULL;
+    for (; c; c = next) {
+        next = c->next;
+        c->next = reversed;
+        reversed = c;
+    }
+    for (c = reversed; c; c = next) {
+        next = c->next;
+        coro_start(s, c);
+    }
+
+    return stopping;
+}
+
+static void *sched_work(void *arg)
+{
+    struct coro_sched *s = (struct coro_sched *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int stopping = 0, cancel = 0;
+
+    current_sched = s;
+    aff_pin_self(&s->rt->affinity, (int)(s - s->rt->scheds));
+
+    while (1) {
+        if (cancel && !s->cancelled) {
+            s->cancelled = 1;
+            cancel_all(s);
+        }
+
+        // only the coroutines ready now, the ones they make ready (or which
+        // yield) wait for the next round, so the descriptors are polled meanwhile
+        struct coro *c = s->ready_head, *last = s->ready_tail;
+        while (c) {
+            struct coro *next = c->next;
+            s->ready_head = next;
+            if (NULL == next)
+                s->ready_tail = NULL;
+            int was_last = c == last;
+            resume(s, c);
+            if (was_last)
+                break;
+            c = s->ready_head;
+        }
+
+        if (stopping && 0 == s->live)
+            break;
+
+        int timeout = -1;
+        if (s->ready_head) {
+            timeout = 0;
+        } else if (s->heap_count > 0) {
+            int64_t left = s->heap[0]->deadline - now_ns();
+            // rounded up, so the coroutine doesn't wake up before its deadline
+            timeout = left <= 0 ? 0 : (int)((left + 999999) / 1000000);
+        }
+
+        int count;
+        if ((count = epoll_wait(s->epoll_fd, events, MAX_EVENTS, timeout)) < 0) {
+            if (errno != EINTR)
+                ERR("epoll_wait() failed");
+            count = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (s->event_fd == events[i].data.fd) {
+                uint64_t value;
+                if (read(s->event_fd, &value, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+                    ERR("read() failed");
+                stopping = take_inbox(s, &cancel);
+                continue;
+            }
+            wait_wake(s, events[i].data.fd, events[i].events);
+        }
+
+        int64_t now = now_ns();
+        while (s->heap_count > 0 && s->heap[0]->deadline <= now)
+            make_ready(s, heap_pop(s));
+    }
+
+    return NULL;
+}
+
+/* API */
+
+void coro_init(struct coro_runtime *rt, int thread_count)
+{
+    struct epoll_event event;
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    memset(rt, 0, sizeof(struct coro_runtime));
+    aff_plan_from_env(&rt->affinity);
+    if ((rt->scheds = (struct coro_sched *)aligned_alloc(64, thread_count * sizeof(struct coro_sched))) == NULL)
+        ERR("aligned_alloc() failed");
+    memset(rt->scheds, 0, thread_count * sizeof(struct coro_sched));
+    rt->sched_count = thread_count;
+
+    for (int i = 0; i < thread_count; i++) {
+        struct coro_sched *s = &rt->scheds[i];
+        s->rt = rt;
+        if (pthread_mutex_init(&s->mutex, NULL))
+            ERR("pthread_mutex_init() failed");
+        if ((s->epoll_fd = epoll_create1(0)) < 0)
+            ERR("epoll_create1() failed");
+        if ((s->event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            ERR("eventfd() failed");
+        event.events = EPOLLIN;
+        event.data.fd = s->event_fd;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->event_fd, &event))
+            ERR("epoll_ctl() failed");
+        if (pthread_create(&s->tid, NULL, sched_work, s))
+            ERR("pthread_create() failed");
+    }
+}
+
+static void notify(struct coro_sched *s)
+{
+    uint64_t one = 1;
+    if (write(s->event_fd, &one, sizeof(uint64_t)) < 0)
+        ERR("write() failed");
+}
+
+void coro_destroy(struct coro_runtime *rt, int cancel)
+{
+    for (int i = 0; i < rt->sched_count; i++) {
+        struct coro_sched *s = &rt->scheds[i];
+        if (pthread_mutex_lock(&s->mutex))
+            ERR("pthread_mutex_lock() failed");
+        s->stopping = 1;
+        s->cancel = cancel;
+        if (pthread_mutex_unlock(&s->mutex))
+            ERR("pthread_mutex_unlock() failed");
+        notify(s);
+    }
+
+    for (int i = 0; i < rt->sched_count; i++) {
+        struct coro_sched *s = &rt->scheds[i];
+        if (pthread_join(s->tid, NULL))
+            ERR("pthread_join() failed");
+
+        while (s->pool_count > 0)
+            if (munmap(s->stack_pool[--s->pool_count], page_size + CORO_STACK_SIZE))
+                ERR("munmap() failed");
+        free(s->heap);
+        free(s->waiters);
+        if (TEMP_FAILURE_RETRY(close(s->event_fd)) || TEMP_FAILURE_RETRY(close(s->epoll_fd)))
+            ERR("close() failed");
+        if (pthread_mutex_destroy(&s->mutex))
+            ERR("pthread_mutex_destroy() failed");
+    }
+
+    free(rt->scheds);
+    aff_plan_destroy(&rt->affinity);
+}
+
+void coro_spawn(struct coro_runtime *rt, void (*fn)(void *arg), void *arg)
+{
+    struct coro *c;
+
+    if ((c = (struct coro *)calloc(1, sizeof(struct coro))) == NULL)
+        ERR("calloc() failed");
+    c->fn = fn;
+    c->arg = arg;
+
+    // a coroutine's child stays on its thread, no lock and no wakeup needed
+    if (current_sched && current_sched->rt == rt) {
+        coro_start(current_sched, c);
+        return;
+    }
+
+    struct coro_sched *s = &rt->scheds[__atomic_fetch_add(&rt->next, 1, __ATOMIC_RELAXED) % rt->sched_count];
+    if (pthread_mutex_lock(&s->mutex))
+        ERR("pthread_mutex_lock() failed");
+    c->next = s->inbox;
+    s->inbox = c;
+    if (pthread_mutex_unlock(&s->mutex))
+        ERR("pthread_mutex_unlock() failed");
+    notify(s);
+}
+
+void coro_yield(void)
+{
+    if (NULL == current_coro) {
+        sched_yield();
+        return;
+    }
+    make_ready(current_sched, current_coro);
+    suspend();
+}
+
+int coro_running(void)
+{
+    return current_coro != NULL;
+}
+
+int coro_wait_fd(int fd, uint32_t events)
+{
+    struct coro *c = current_coro;
+
+    if (NULL == c) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = (events & EPOLLIN ? POLLIN : 0) | (events & EPOLLOUT ? POLLOUT : 0);
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0)
+            return -1;
+        return 0;
+    }
+
+    if (c->cancelled || c->sched->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    struct coro_sched *s = c->sched;
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fd >= s->waiters_capacity) {
+        int capacity = s->waiters_capacity ? s->waiters_capacity : 64;
+        while (capacity <= fd)
+            capacity *= 2;
+        if ((s->waiters = (struct coro **)realloc(s->waiters, capacity * sizeof(struct coro *))) == NULL)
+            ERR("realloc() failed");
+        memset(s->waiters + s->waiters_capacity, 0, (capacity - s->waiters_capacity) * sizeof(struct coro *));
+        s->waiters_capacity = capacity;
+    }
+
+    // a reader and a writer (or any number of them) may wait for the same
+    // descriptor, the registration asks for the events of all of them
+    c->waiting_fd = fd;
+    c->wait_events = events;
+    c->wait_prev = NULL;
+    c->wait_next = s->waiters[fd];
+    if (s->waiters[fd])
+        s->waiters[fd]->wait_prev = c;
+    s->waiters[fd] = c;
+
+    // one shot, so a descriptor nobody waits for never wakes the scheduler up,
+    // it stays registered (disarmed) until it's closed
+    if (wait_arm(s, fd)) {
+        int error = errno;
+        wait_unlink(s, c);
+        errno = error;
+        return -1;
+    }
+
+    suspend();
+
+    if (c->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t coro_bulk_read(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do {
+        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return c;
+            if (coro_wait_fd(fd, EPOLLIN))
+                return -1;
+            continue;
+        }
+        // eof
+        if (0 == c)
+            return len;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+ssize_t coro_bulk_write(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do {
+        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return c;
+            if (coro_wait_fd(fd, EPOLLOUT))
+                return -1;
+            continue;
+        }
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+int coro_accept(int server_fd)
+{
+    int client_fd;
+
+    while ((client_fd = TEMP_FAILURE_RETRY(accept4(server_fd, NULL, NULL, SOCK_NONBLOCK))) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (coro_wait_fd(server_fd, EPOLLIN))
+            return -1;
+    }
+
+    return client_fd;
+}
+
+void coro_bulk_nanosleep(int sec, int nsec)
+{
+    struct coro *c = current_coro;
+
+    if (NULL == c) {
+        bulk_nanosleep(sec, nsec);
+        return;
+    }
+    if (c->cancelled || c->sched->cancelled)
+        return;
+
+    c->deadline = now_ns() + (int64_t)sec * 1000000000LL + nsec;
+    heap_push(c->sched, c);
+    suspend();
+}
@@ -0,0 +1,76 @@
+#ifndef CORO_H_
+#define CORO_H_
+#include "../affinity/affinity.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <ucontext.h>
+
+// M:N coroutine runtime
+//
+// coroutines are spread over a few scheduler threads, every one has its own
+// run queue, epoll and timer heap, a coroutine stays on the thread it has
+// been given, the coroutine-aware calls below look like their mysocklib
+// counterparts, but instead of blocking they register the descriptor (or the
+// deadline) and switch back to the scheduler, which resumes the coroutine
+// when epoll says the descriptor is ready, so code written for a thread per
+// client keeps its straight-line style with one small stack per client
+//
+// stacks are mmapped with a guard page below, so an overflow is a SIGSEGV
+// instead of a silent corruption, and reused through a pool per scheduler,
+// a scheduler is pinned (see AFFINITY in affinity.h) before it maps any of
+// them, so they come from its numa node
+#define CORO_STACK_SIZE (64 * 1024)
+// stacks kept for reuse by every scheduler
+#define CORO_STACK_POOL 256
+
+struct coro;
+struct coro_sched;
+
+struct coro_runtime {
+    struct coro_sched *scheds;
+    int sched_count;
+    // the scheduler the next coroutine spawned from outside goes to
+    uint32_t next;
+    struct aff_plan affinity;
+};
+
+// starts thread_count scheduler threads
+void coro_init(struct coro_runtime *rt, int thread_count);
+
+// waits until every coroutine has finished, then stops the schedulers,
+// if cancel is set, the waiting calls fail with ECANCELED (and sleeps end)
+// from now on, so the coroutines can finish
+void coro_destroy(struct coro_runtime *rt, int cancel);
+
+// runs fn(arg) as a new coroutine, called by a coroutine it goes to the same
+// scheduler, otherwise to the schedulers in turn
+void coro_spawn(struct coro_runtime *rt, void (*fn)(void *arg), void *arg);
+
+// lets the other coroutines of the scheduler run
+void coro_yield(void);
+
+// 1 if the caller is a coroutine
+int coro_running(void);
+
+// the descriptors passed to the calls below have to be non-blocking, outside
+// a coroutine the calls fall back to blocking on poll
+
+// waits until the descriptor is ready for events (EPOLLIN or EPOLLOUT),
+// several coroutines of a scheduler may wait for the same descriptor, each
+// is resumed by its own events (all of them by an error or a hang-up),
+// returns -1 with errno ECANCELED if the runtime is being cancelled
+int coro_wait_fd(int fd, uint32_t events);
+
+// reads maximaly count bytes, less only at eof
+ssize_t coro_bulk_read(int fd, char *buf, size_t count);
+
+// writes count bytes
+ssize_t coro_bulk_write(int fd, char *buf, size_t count);
+
+// returns a non-blocking client descriptor, -1 on error
+int coro_accept(int server_fd);
+
+void coro_bulk_nanosleep(int sec, int nsec);
+
+#endif
@@ -0,0 +1,79 @@
+#include "hist.h"
+#include <string.h>
+
+#define BAR_WIDTH 40
+
+static int bucket_of(uint64_t value)
+{
+	if (value < HIST_SUB)
+		return (int)value;
+	int e = 63 - __builtin_clzll(value);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((value >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+static uint64_t bucket_low(int bucket)
+{
+	if (bucket < HIST_SUB)
+		return bucket;
+	int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static uint64_t bucket_high(int bucket)
+{
+	if (bucket < HIST_SUB)
+		return bucket;
+	int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return bucket_low(bucket) + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(struct hist));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	h->counts[bucket_of(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+uint64_t hist_percentile(const struct hist *h, double fraction)
+{
+	if (0 == h->count)
+		return 0;
+
+	uint64_t rank = (uint64_t)(fraction * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+	}
+	return h->max;
+}
+
+void hist_print(FILE *f, const struct hist *h)
+{
+	uint64_t top = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		if (h->counts[i] > top)
+			top = h->counts[i];
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (0 == h->counts[i])
+			continue;
+		int width = (int)(h->counts[i] * BAR_WIDTH / top);
+		fprintf(f, "    %10llu - %10llu ns %10llu |%.*s\n", (unsigned long long)bucket_low(i),
+			(unsigned long long)bucket_high(i), (unsigned long long)h->counts[i], width < 1 ? 1 : width,
+			"########################################");
+	}
+}
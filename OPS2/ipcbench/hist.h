@@ -0,0 +1,32 @@
+#ifndef HIST_H_
+#define HIST_H_
+#include <stdint.h>
+#include <stdio.h>
+
+// log-linear histogram of nanoseconds: values below HIST_SUB are counted
+// exactly, above that every power of two is split into HIST_SUB buckets, so
+// a reported value is off by at most 1/HIST_SUB (6%) whatever its magnitude,
+// and recording is a few instructions without any allocation
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB)
+
+struct hist {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+};
+
+void hist_init(struct hist *h);
+
+void hist_record(struct hist *h, uint64_t value);
+
+// the upper bound of the bucket holding the given fraction (0-1) of the values
+uint64_t hist_percentile(const struct hist *h, double fraction);
+
+// one line per non-empty bucket: its range, count and a bar
+void hist_print(FILE *f, const struct hist *h);
+
+#endif
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include "../affinity/affinity.h"
+#include "../mysocklib/mysocklib.h"
+#include "hist.h"
+#include "transport.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// benchmark of the local ipc mechanisms
+//
+// for every transport, message size and mode the benchmark forks a peer and
+// the two processes talk over a fresh channel:
+//   lat  - one-way latency, the sender puts the time in the message and the
+//          peer subtracts it from the time of arrival (both read the same
+//          CLOCK_MONOTONIC), the sender waits for a short ack before the
+//          next message, so the messages never wait in a queue
+//   rtt  - ping-pong, the peer sends every message back, the round trip is
+//          measured by the sender
+//   tput - the sender sends messages back to back, the peer acks the last
+//          one, the result is the rate of the whole run
+// the first tenth of the messages warms up the caches and the channel and
+// isn't measured, big messages get fewer iterations (BYTE_BUDGET per run)
+//
+// the benchmark runs on the cpu of thread 0 of the affinity plan and the
+// peer on the cpu of thread 1, so compact puts them on the hyperthreads of
+// one core (or on two cores of a package), scatter on separate packages
+#define MAX_SIZES 32
+#define MIN_SIZE 8
+#define MAX_SIZE (64 << 20)
+#define DEFAULT_SIZES "8,64,512,4k,32k,256k,1m"
+#define DEFAULT_ITERATIONS 10000
+#define MIN_ITERATIONS 20
+#define BYTE_BUDGET (256ULL << 20)
+#define ACK_SIZE 8
+
+enum mode { MODE_LAT, MODE_RTT, MODE_TPUT, MODE_COUNT };
+
+static const char *mode_names[] = { "lat", "rtt", "tput" };
+
+struct options {
+	const struct transport *transports[16];
+	int transport_count;
+	size_t sizes[MAX_SIZES];
+	int size_count;
+	int modes[MODE_COUNT];
+	uint64_t iterations;
+	int histogram;
+	struct aff_plan plan;
+};
+
+// filled by whichever process measures, so it lives in shared memory
+struct result {
+	struct hist hist;
+	uint64_t messages;
+	uint64_t elapsed_ns;
+};
+
+void usage(char *name);
+int parse_transports(struct options *o, char *list);
+int parse_sizes(struct options *o, char *list);
+int parse_modes(struct options *o, char *list);
+uint64_t now_ns(void);
+void run_sender(struct channel *ch, enum mode mode, char *buf, size_t size, uint64_t warmup, uint64_t n,
+		struct result *res);
+void run_peer(struct channel *ch, enum mode mode, char *buf, size_t size, uint64_t warmup, uint64_t n,
+	      struct result *res);
+int run_test(struct options *o, const struct transport *t, enum mode mode, size_t size, struct result *res);
+void print_header(void);
+void print_result(struct options *o, const struct transport *t, enum mode mode, size_t size, struct result *res);
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *policy = NULL;
+	struct options o;
+
+	memset(&o, 0, sizeof(o));
+	o.iterations = DEFAULT_ITERATIONS;
+
+	while ((opt = getopt(argc, argv, "t:s:m:n:a:H")) != -1) {
+		switch (opt) {
+		case 't':
+			if (parse_transports(&o, optarg)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (parse_sizes(&o, optarg)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			if (parse_modes(&o, optarg)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			if ((o.iterations = strtoull(optarg, NULL, 10)) < 1) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			policy = optarg;
+			break;
+		case 'H':
+			o.histogram = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (0 == o.transport_count)
+		for (int i = 0; i < transport_count; i++)
+			o.transports[o.transport_count++] = &transports[i];
+	if (0 == o.size_count) {
+		char sizes[] = DEFAULT_SIZES;
+		parse_sizes(&o, sizes);
+	}
+	if (!o.modes[MODE_LAT] && !o.modes[MODE_RTT] && !o.modes[MODE_TPUT])
+		o.modes[MODE_LAT] = o.modes[MODE_RTT] = o.modes[MODE_TPUT] = 1;
+
+	if (policy) {
+		enum aff_policy p;
+		if (aff_parse_policy(policy, &p)) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		aff_plan_init(&o.plan, p);
+	} else {
+		aff_plan_from_env(&o.plan);
+	}
+	aff_print_plan(stderr, &o.plan);
+	// the peers are forked by this thread, they start on its cpu and move to theirs
+	aff_pin_self(&o.plan, 0);
+
+	// a peer which died makes the write fail instead of killing the benchmark
+	if (sethandler(SIG_IGN, SIGPIPE))
+		ERR("Seting SIGPIPE:");
+
+	struct result *res;
+	if ((res = (struct result *)mmap(NULL, sizeof(struct result), PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		ERR("mmap");
+
+	print_header();
+	for (int t = 0; t < o.transport_count; t++)
+		for (int m = 0; m < MODE_COUNT; m++)
+			for (int s = 0; o.modes[m] && s < o.size_count; s++)
+				if (run_test(&o, o.transports[t], (enum mode)m, o.sizes[s], res) == 0)
+					print_result(&o, o.transports[t], (enum mode)m, o.sizes[s], res);
+
+	if (munmap(res, sizeof(struct result)))
+		ERR("munmap");
+	aff_plan_destroy(&o.plan);
+
+	return EXIT_SUCCESS;
+}
+
+int parse_transports(struct options *o, char *list)
+{
+	o->transport_count = 0;
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		const struct transport *t = transport_find(name);
+		if (NULL == t || o->transport_count == (int)(sizeof(o->transports) / sizeof(o->transports[0]))) {
+			fprintf(stderr, "Invalid transport: %s\n", name);
+			return -1;
+		}
+		o->transports[o->transport_count++] = t;
+	}
+	return 0;
+}
+
+// a size may end with k or m
+int parse_sizes(struct options *o, char *list)
+{
+	o->size_count = 0;
+	for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+		char *end;
+		unsigned long long size = strtoull(item, &end, 10);
+		if (*end == 'k' || *end == 'K')
+			size <<= 10, end++;
+		else if (*end == 'm' || *end == 'M')
+			size <<= 20, end++;
+		if (*end != '\0' || size < MIN_SIZE || size > MAX_SIZE || o->size_count == MAX_SIZES) {
+			fprintf(stderr, "Invalid size: %s (%d B - %d MB)\n", item, MIN_SIZE, MAX_SIZE >> 20);
+			return -1;
+		}
+		o->sizes[o->size_count++] = size;
+	}
+	return 0;
+}
+
+int parse_modes(struct options *o, char *list)
+{
+	memset(o->modes, 0, sizeof(o->modes));
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		int m;
+		for (m = 0; m < MODE_COUNT && strcmp(name, mode_names[m]) != 0; m++)
+			;
+		if (m == MODE_COUNT) {
+			fprintf(stderr, "Invalid mode: %s\n", name);
+			return -1;
+		}
+		o->modes[m] = 1;
+	}
+	return 0;
+}
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		ERR("clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void run_sender(struct channel *ch, enum mode mode, char *buf, size_t size, uint64_t warmup, uint64_t n,
+		struct result *res)
+{
+	const struct transport *t = ch->t;
+	char ack[ACK_SIZE];
+
+	if (MODE_TPUT == mode) {
+		for (uint64_t i = 0; i < warmup; i++)
+			t->send(ch, buf, size);
+		t->recv(ch, ack, ACK_SIZE);
+
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < n; i++)
+			t->send(ch, buf, size);
+		t->recv(ch, ack, ACK_SIZE);
+		res->elapsed_ns = now_ns() - start;
+		res->messages = n;
+		return;
+	}
+
+	for (uint64_t i = 0; i < warmup + n; i++) {
+		uint64_t start = now_ns();
+		memcpy(buf, &start, sizeof(start));
+		t->send(ch, buf, size);
+		if (MODE_LAT == mode) {
+			t->recv(ch, ack, ACK_SIZE);
+			continue;
+		}
+		t->recv(ch, buf, size);
+		if (i >= warmup)
+			hist_record(&res->hist, now_ns() - start);
+	}
+}
+
+void run_peer(struct channel *ch, enum mode mode, char *buf, size_t size, uint64_t warmup, uint64_t n,
+	      struct result *res)
+{
+	const struct transport *t = ch->t;
+	char ack[ACK_SIZE] = { 0 };
+
+	if (MODE_TPUT == mode) {
+		for (uint64_t i = 0; i < warmup; i++)
+			t->recv(ch, buf, size);
+		t->send(ch, ack, ACK_SIZE);
+		for (uint64_t i = 0; i < n; i++)
+			t->recv(ch, buf, size);
+		t->send(ch, ack, ACK_SIZE);
+		return;
+	}
+
+	for (uint64_t i = 0; i < warmup + n; i++) {
+		t->recv(ch, buf, size);
+		if (MODE_RTT == mode) {
+			t->send(ch, buf, size);
+			continue;
+		}
+		uint64_t arrival = now_ns(), start;
+		memcpy(&start, buf, sizeof(start));
+		if (i >= warmup)
+			hist_record(&res->hist, arrival - start);
+		t->send(ch, ack, ACK_SIZE);
+	}
+}
+
+// returns -1 if the transport isn't available
+int run_test(struct options *o, const struct transport *t, enum mode mode, size_t size, struct result *res)
+{
+	struct channel ch;
+	uint64_t n = BYTE_BUDGET / size;
+	if (n > o->iterations)
+		n = o->iterations;
+	if (n < MIN_ITERATIONS)
+		n = MIN_ITERATIONS;
+	uint64_t warmup = n / 10 + 1;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.t = t;
+	if (t->open(&ch, size)) {
+		fprintf(stderr, "%-5s %-4s %8zu unavailable: %s\n", t->name, mode_names[mode], size, strerror(errno));
+		return -1;
+	}
+
+	hist_init(&res->hist);
+	res->messages = n;
+	res->elapsed_ns = 0;
+
+	// the buffers are touched before the fork, so neither side measures page faults
+	char *buf;
+	if ((buf = (char *)malloc(size)) == NULL)
+		ERR("malloc");
+	memset(buf, 0xa5, size);
+
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid < 0)
+		ERR("fork");
+	if (0 == pid) {
+		t->attach(&ch, 1);
+		aff_pin_self(&o->plan, 1);
+		run_peer(&ch, mode, buf, size, warmup, n, res);
+		t->close(&ch);
+		free(buf);
+		exit(EXIT_SUCCESS);
+	}
+
+	t->attach(&ch, 0);
+	run_sender(&ch, mode, buf, size, warmup, n, res);
+
+	int status;
+	if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0)
+		ERR("waitpid");
+	t->close(&ch);
+	free(buf);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "%s %s %zu: the peer has failed\n", t->name, mode_names[mode], size);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+void print_header(void)
+{
+	printf("%-5s %-4s %8s %7s %9s %9s %9s %9s %9s %9s %10s %10s\n", "ipc", "mode", "size", "count", "min us",
+	       "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "MB/s", "msg/s");
+}
+
+void print_result(struct options *o, const struct transport *t, enum mode mode, size_t size, struct result *res)
+{
+	printf("%-5s %-4s %8zu %7llu ", t->name, mode_names[mode], size, (unsigned long long)res->messages);
+
+	if (MODE_TPUT == mode) {
+		double seconds = res->elapsed_ns / 1e9;
+		printf("%9s %9s %9s %9s %9s %9s %10.1f %10.0f\n", "-", "-", "-", "-", "-", "-",
+		       res->messages * size / seconds / (1 << 20), res->messages / seconds);
+		fflush(stdout);
+		return;
+	}
+
+	struct hist *h = &res->hist;
+	printf("%9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %10s %10s\n", h->min / 1e3, hist_percentile(h, 0.5) / 1e3,
+	       hist_percentile(h, 0.9) / 1e3, hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+	       h->max / 1e3, "-", "-");
+	if (o->histogram)
+		hist_print(stdout, h);
+	fflush(stdout);
+}
+
+void usage(char *name)
+{
+	fprintf(stderr, "USAGE: %s [-t transports] [-s sizes] [-m modes] [-n iterations] [-a policy] [-H]\n", name);
+	fprintf(stderr, "  -t transports  comma separated: pipe,fifo,mq,unix,shm (default all)\n");
+	fprintf(stderr, "  -s sizes       comma separated bytes, k and m suffixes (default %s)\n", DEFAULT_SIZES);
+	fprintf(stderr, "  -m modes       comma separated: lat (one-way), rtt (ping-pong), tput (default all)\n");
+	fprintf(stderr, "  -n iterations  messages per run (default %d, fewer for big messages)\n", DEFAULT_ITERATIONS);
+	fprintf(stderr, "  -a policy      none|compact|scatter|cores, the benchmark and the peer take the first\n");
+	fprintf(stderr, "                 two cpus of the plan (default: the %s environment variable)\n", AFFINITY_ENV);
+	fprintf(stderr, "  -H             print the latency histograms\n");
+}
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include "transport.h"
+#include "../mysocklib/mysocklib.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MQ_MAXMSG 10
+// defaults of linux, when /proc can't be read
+#define MQ_MSGSIZE_MAX 8192
+#define PIPE_SIZE_MAX (1 << 20)
+
+static size_t read_limit(const char *path, size_t fallback)
+{
+	unsigned long long value;
+	FILE *f = fopen(path, "r");
+	if (NULL == f)
+		return fallback;
+	if (fscanf(f, "%llu", &value) != 1)
+		value = fallback;
+	fclose(f);
+	return (size_t)value;
+}
+
+static void close_fd(int *fd)
+{
+	if (*fd >= 0 && TEMP_FAILURE_RETRY(close(*fd)) < 0)
+		ERR("close");
+	*fd = -1;
+}
+
+// a bigger pipe takes a big message in fewer wakeups of the reader, it's
+// only a hint, an unprivileged process can't go above pipe-max-size
+static void grow_pipe(int fd, size_t max_size)
+{
+	size_t limit = read_limit("/proc/sys/fs/pipe-max-size", PIPE_SIZE_MAX);
+	fcntl(fd, F_SETPIPE_SZ, (int)(max_size < limit ? max_size : limit));
+}
+
+static void stream_send(struct channel *ch, const char *buf, size_t len)
+{
+	if (bulk_write(ch->fds[ch->side][1], (char *)buf, len) != (ssize_t)len)
+		ERR("write");
+}
+
+static void stream_recv(struct channel *ch, char *buf, size_t len)
+{
+	if (bulk_read(ch->fds[1 - ch->side][0], buf, len) != (ssize_t)len)
+		ERR("read");
+}
+
+static void stream_close(struct channel *ch)
+{
+	for (int d = 0; d < 2; d++) {
+		close_fd(&ch->fds[d][0]);
+		close_fd(&ch->fds[d][1]);
+	}
+}
+
+/* PIPE */
+
+static int pipe_open(struct channel *ch, size_t max_size)
+{
+	for (int d = 0; d < 2; d++) {
+		if (pipe(ch->fds[d]))
+			return -1;
+		grow_pipe(ch->fds[d][1], max_size);
+	}
+	return 0;
+}
+
+// every process keeps the ends it uses, so the other one sees eof when it's gone
+static void pipe_attach(struct channel *ch, int side)
+{
+	ch->side = side;
+	close_fd(&ch->fds[side][0]);
+	close_fd(&ch->fds[1 - side][1]);
+}
+
+/* FIFO */
+
+static int fifo_open(struct channel *ch, size_t max_size)
+{
+	for (int d = 0; d < 2; d++) {
+		snprintf(ch->names[d], sizeof(ch->names[d]), "/tmp/ipcbench.%d.%d", (int)getpid(), d);
+		if (mkfifo(ch->names[d], 0600))
+			return -1;
+		ch->fds[d][0] = ch->fds[d][1] = -1;
+	}
+	// the size is set once both ends are open
+	ch->max_size = max_size;
+	return 0;
+}
+
+// the ends are opened in the same order on both sides, so neither open
+// blocks forever waiting for the other end
+static void fifo_attach(struct channel *ch, int side)
+{
+	ch->side = side;
+	for (int d = 0; d < 2; d++) {
+		int end = d == side ? 1 : 0;
+		if ((ch->fds[d][end] = TEMP_FAILURE_RETRY(open(ch->names[d], end ? O_WRONLY : O_RDONLY))) < 0)
+			ERR("open");
+		if (end)
+			grow_pipe(ch->fds[d][end], ch->max_size);
+	}
+}
+
+static void fifo_close(struct channel *ch)
+{
+	stream_close(ch);
+	for (int d = 0; ch->side == 0 && d < 2; d++)
+		if (unlink(ch->names[d]))
+			ERR("unlink");
+}
+
+/* MQ */
+
+static int mq_open_channel(struct channel *ch, size_t max_size)
+{
+	struct mq_attr attr;
+	size_t limit = read_limit("/proc/sys/fs/mqueue/msgsize_max", MQ_MSGSIZE_MAX);
+
+	ch->piece = max_size < limit ? max_size : limit;
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = MQ_MAXMSG;
+	attr.mq_msgsize = ch->piece;
+
+	for (int d = 0; d < 2; d++) {
+		snprintf(ch->names[d], sizeof(ch->names[d]), "/ipcbench.%d.%d", (int)getpid(), d);
+		if ((ch->queues[d] = mq_open(ch->names[d], O_RDWR | O_CREAT | O_EXCL, 0600, &attr)) == (mqd_t)-1) {
+			int error = errno;
+			if (d == 1) {
+				mq_close(ch->queues[0]);
+				mq_unlink(ch->names[0]);
+			}
+			errno = error;
+			return -1;
+		}
+	}
+	if ((ch->scratch = (char *)malloc(ch->piece)) == NULL)
+		ERR("malloc");
+	return 0;
+}
+
+static void mq_attach(struct channel *ch, int side)
+{
+	ch->side = side;
+}
+
+static void mq_send_channel(struct channel *ch, const char *buf, size_t len)
+{
+	for (size_t off = 0; off < len; off += ch->piece) {
+		size_t n = len - off < ch->piece ? len - off : ch->piece;
+		if (TEMP_FAILURE_RETRY(mq_send(ch->queues[ch->side], buf + off, n, 0)))
+			ERR("mq_send");
+	}
+}
+
+// mq_receive wants a buffer of a whole piece, the last one goes through scratch
+static void mq_recv_channel(struct channel *ch, char *buf, size_t len)
+{
+	size_t off = 0;
+	while (off < len) {
+		char *target = len - off >= ch->piece ? buf + off : ch->scratch;
+		ssize_t n = TEMP_FAILURE_RETRY(mq_receive(ch->queues[1 - ch->side], target, ch->piece, NULL));
+		if (n < 0)
+			ERR("mq_receive");
+		if (target == ch->scratch)
+			memcpy(buf + off, ch->scratch, n);
+		off += n;
+	}
+}
+
+static void mq_close_channel(struct channel *ch)
+{
+	for (int d = 0; d < 2; d++) {
+		if (mq_close(ch->queues[d]))
+			ERR("mq_close");
+		if (ch->side == 0 && mq_unlink(ch->names[d]))
+			ERR("mq_unlink");
+	}
+	free(ch->scratch);
+	ch->scratch = NULL;
+}
+
+/* UNIX */
+
+static int unix_open(struct channel *ch, size_t max_size)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	// a send buffer holding the biggest message lets the writer queue it at
+	// once, only a hint like grow_pipe, the kernel caps it at wmem_max; the
+	// default one is never shrunk
+	int size = (int)(max_size < INT_MAX ? max_size : INT_MAX), current;
+	socklen_t len = sizeof(current);
+	for (int i = 0; i < 2; i++)
+		if (getsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &current, &len) == 0 && current < size)
+			setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	// side d writes direction d and reads the other one through its socket
+	ch->fds[0][1] = ch->fds[1][0] = sv[0];
+	ch->fds[1][1] = ch->fds[0][0] = sv[1];
+	return 0;
+}
+
+static void unix_attach(struct channel *ch, int side)
+{
+	ch->side = side;
+	close_fd(&ch->fds[side][0]);
+	ch->fds[1 - side][1] = -1;
+}
+
+static void unix_close(struct channel *ch)
+{
+	close_fd(&ch->fds[ch->side][1]);
+	ch->fds[1 - ch->side][0] = -1;
+}
+
+/* SHM */
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// spins while the other side is likely running, then lets it have the cpu
+static inline void spin_wait(int *spins)
+{
+	if (++*spins < SHM_SPIN) {
+		cpu_relax();
+		return;
+	}
+	*spins = 0;
+	sched_yield();
+}
+
+static int shm_open_channel(struct channel *ch, size_t max_size)
+{
+	// messages of any size stream through the fixed rings
+	(void)max_size;
+	void *rings = mmap(NULL, 2 * sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == rings)
+		return -1;
+	ch->rings = (struct shm_ring *)rings;
+	return 0;
+}
+
+static void shm_attach(struct channel *ch, int side)
+{
+	ch->side = side;
+}
+
+static void shm_send(struct channel *ch, const char *buf, size_t len)
+{
+	struct shm_ring *r = &ch->rings[ch->side];
+	uint64_t tail = r->tail;
+	int spins = 0;
+
+	while (len > 0) {
+		uint64_t room = SHM_RING_SIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+		if (0 == room) {
+			spin_wait(&spins);
+			continue;
+		}
+		size_t at = tail % SHM_RING_SIZE;
+		size_t n = len < room ? len : room;
+		if (n > SHM_RING_SIZE - at)
+			n = SHM_RING_SIZE - at;
+		memcpy(r->data + at, buf, n);
+		tail += n;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		buf += n;
+		len -= n;
+		spins = 0;
+	}
+}
+
+static void shm_recv(struct channel *ch, char *buf, size_t len)
+{
+	struct shm_ring *r = &ch->rings[1 - ch->side];
+	uint64_t head = r->head;
+	int spins = 0;
+
+	while (len > 0) {
+		uint64_t ready = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+		if (0 == ready) {
+			spin_wait(&spins);
+			continue;
+		}
+		size_t at = head % SHM_RING_SIZE;
+		size_t n = len < ready ? len : ready;
+		if (n > SHM_RING_SIZE - at)
+			n = SHM_RING_SIZE - at;
+		memcpy(buf, r->data + at, n);
+		head += n;
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+		buf += n;
+		len -= n;
+		spins = 0;
+	}
+}
+
+static void shm_close(struct channel *ch)
+{
+	if (munmap(ch->rings, 2 * sizeof(struct shm_ring)))
+		ERR("munmap");
+	ch->rings = NULL;
+}
+
+const struct transport transports[] = {
+	{ "pipe", pipe_open, pipe_attach, stream_send, stream_recv, stream_close },
+	{ "fifo", fifo_open, fifo_attach, stream_send, stream_recv, fifo_close },
+	{ "mq", mq_open_channel, mq_attach, mq_send_channel, mq_recv_channel, mq_close_channel },
+	{ "unix", unix_open, unix_attach, stream_send, stream_recv, unix_close },
+	{ "shm", shm_open_channel, shm_attach, shm_send, shm_recv, shm_close },
+};
+
+const int transport_count = sizeof(transports) / sizeof(transports[0]);
+
+const struct transport *transport_find(const char *name)
+{
+	for (int i = 0; i < transport_count; i++)
+		if (strcmp(transports[i].name, name) == 0)
+			return &transports[i];
+	return NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+#include <mqueue.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// the local ipc mechanisms of the labs behind one interface
+//
+// a channel connects the benchmark (side 0) with the process it forks
+// (side 1) in both directions, direction d carries messages sent by side d,
+// a message of any size is sent and received whole, the transports which
+// can't carry it at once (a pipe, a mq message, the ring) move it in pieces
+//   pipe - two pipe(2)s
+//   fifo - two named pipes, opened after the fork
+//   mq   - two posix message queues, a message is split into pieces of the
+//          biggest mq message allowed (/proc/sys/fs/mqueue/msgsize_max)
+//   unix - AF_UNIX stream socketpair
+//   shm  - two single producer, single consumer byte rings in shared memory,
+//          the processes spin on them (and yield after SHM_SPIN tries), so
+//          it's the fastest when the sides run on separate cpus and the
+//          slowest when they share one
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_SPIN 4096
+#define CACHE_LINE 64
+
+struct shm_ring {
+	// written by the consumer
+	uint64_t head __attribute__((aligned(CACHE_LINE)));
+	// written by the producer
+	uint64_t tail __attribute__((aligned(CACHE_LINE)));
+	char data[SHM_RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct transport;
+
+struct channel {
+	const struct transport *t;
+	int side;
+	// the biggest message
+	size_t max_size;
+
+	// pipe, fifo, unix: fds[direction][0] is read, fds[direction][1] written
+	int fds[2][2];
+	// fifo and mq: names to unlink
+	char names[2][64];
+
+	mqd_t queues[2];
+	// mq: size of a piece and a buffer for the last, shorter one
+	size_t piece;
+	char *scratch;
+
+	struct shm_ring *rings;
+};
+
+struct transport {
+	const char *name;
+	// prepares both directions before the fork, max_size is the biggest
+	// message which will be sent, returns -1 (with errno) if the mechanism
+	// isn't available here
+	int (*open)(struct channel *ch, size_t max_size);
+	// after the fork, in both processes
+	void (*attach)(struct channel *ch, int side);
+	void (*send)(struct channel *ch, const char *buf, size_t len);
+	void (*recv)(struct channel *ch, char *buf, size_t len);
+	// in both processes, the side which opened the channel (0) also removes
+	// its names
+	void (*close)(struct channel *ch);
+};
+
+extern const struct transport transports[];
+extern const int transport_count;
+
+// NULL if there is no transport of that name
+const struct transport *transport_find(const char *name);
+
+#endif
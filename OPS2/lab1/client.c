@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -5,17 +6,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #define MSG_SIZE (PIPE_BUF - sizeof(pid_t))
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
+// splice mode: records are put together in a private pipe out of page
+// references (the pid and the zeros of the padding with vmsplice, the data
+// with splice straight from the page cache) and moved to the fifo with one
+// more splice, so the data is never copied by the client
+//
+// a write of PIPE_BUF bytes is atomic, but a splice into a pipe is atomic
+// only per pipe buffer and a record is made of up to four of them (the pid,
+// the data from two pages of the file, the padding), a splice into a fifo
+// without enough free buffers moves part of a record and a reader in the
+// record mode gets it as a short, garbled record, so the clients in splice
+// mode move their records under an exclusive flock of the fifo and only as
+// many at a time as surely fit in it (clients in the copy mode don't take
+// the lock, so they shouldn't share a busy fifo with them)
+#define SPLICE_RECORDS 16
+#define SPLICE_BUFFERS_PER_RECORD 4
+// how long a client with the fifo locked waits for the reader to make room
+#define SPLICE_WAIT_NS 100000
+
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s fifo_file file\n", name);
+    fprintf(stderr, "USAGE: %s fifo_file file [copy|splice]\n", name);
 	exit(EXIT_FAILURE);
 }
 
@@ -36,7 +59,7 @@ void write_to_fifo(int fifo_fd, int file_fd)
             ERR("client: read file failed");
         
         // if it's less than MSG_SIZE fill the rest of the buffer with zeros
-        if (real_size < MSG_SIZE)
+        if (real_size < (int64_t)MSG_SIZE)
             memset(buffer_data_pos + real_size, 0, MSG_SIZE - real_size);
 
         // pass the buffer to the fifo
@@ -46,15 +69,153 @@ void write_to_fifo(int fifo_fd, int file_fd)
                 ERR("client: write fifo failed");
         }
 
-    } while(real_size == MSG_SIZE);
+    } while(real_size == (int64_t)MSG_SIZE);
+}
+
+// moves count bytes from the pipe in_fd to out_fd
+void splice_all(int in_fd, int out_fd, size_t count)
+{
+    while (count > 0) {
+        ssize_t moved = TEMP_FAILURE_RETRY(splice(in_fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE));
+        if (moved <= 0)
+            ERR("client: splice to fifo failed");
+        count -= moved;
+    }
+}
+
+// how many whole records fit in the free buffers of the fifo, a pipe has
+// one buffer per page of its size and the queued bytes take up to
+// SPLICE_BUFFERS_PER_RECORD of them per record they touch (the reader may
+// have taken the beginning of the first one)
+int records_fitting(int fifo_fd)
+{
+    int size, queued;
+    if ((size = fcntl(fifo_fd, F_GETPIPE_SZ)) < 0)
+        ERR("client: fcntl failed");
+    if (ioctl(fifo_fd, FIONREAD, &queued) < 0)
+        ERR("client: ioctl failed");
+
+    int touched = queued > 0 ? (queued + PIPE_BUF - 1) / PIPE_BUF + 1 : 0;
+    int buffers = size / getpagesize();
+    if (buffers < SPLICE_BUFFERS_PER_RECORD) {
+        errno = EMSGSIZE;
+        ERR("client: fifo too small to splice a record");
+    }
+    return buffers / SPLICE_BUFFERS_PER_RECORD - touched;
+}
+
+// moves the records from the stage pipe to the fifo, which has to be locked
+void splice_records(int stage_fd, int fifo_fd, int records)
+{
+    struct timespec wait = { 0, SPLICE_WAIT_NS };
+
+    while (records > 0) {
+        int fitting = records_fitting(fifo_fd);
+        if (fitting < 1) {
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        if (fitting > records)
+            fitting = records;
+        splice_all(stage_fd, fifo_fd, fitting * PIPE_BUF);
+        records -= fitting;
+    }
+}
+
+// the pages stay referenced by the pipe till they are read, so the buffer mustn't change
+void vmsplice_all(int pipe_fd, const void *buffer, size_t count)
+{
+    struct iovec iov = { (void *)buffer, count };
+
+    while (iov.iov_len > 0) {
+        ssize_t moved = TEMP_FAILURE_RETRY(vmsplice(pipe_fd, &iov, 1, 0));
+        if (moved <= 0)
+            ERR("client: vmsplice failed");
+        iov.iov_base = (char *)iov.iov_base + moved;
+        iov.iov_len -= moved;
+    }
+}
+
+void splice_to_fifo(int fifo_fd, int file_fd)
+{
+    // never written after they are set, so they can be spliced by reference
+    static pid_t header;
+    // aligned, so the padding is a single pipe buffer
+    static const char zeros[MSG_SIZE] __attribute__((aligned(PIPE_BUF)));
+    header = getpid();
+
+    int stage[2];
+    if (pipe(stage) < 0)
+        ERR("client: pipe failed");
+    // a batch must fit in the pipe, or filling it would block for good,
+    // a pipe which can't grow holds fewer records
+    int batch;
+    fcntl(stage[1], F_SETPIPE_SZ, SPLICE_RECORDS * SPLICE_BUFFERS_PER_RECORD * PIPE_BUF);
+    if ((batch = fcntl(stage[1], F_GETPIPE_SZ)) < 0)
+        ERR("client: fcntl failed");
+    if ((batch /= SPLICE_BUFFERS_PER_RECORD * PIPE_BUF) < 1)
+        batch = 1;
+
+    int end_of_file = 0;
+    while (!end_of_file) {
+        int records = 0;
+        // the file has ended right after the previous record, the pid
+        // already in the pipe is taken back once the records before it are out
+        int header_left = 0;
+
+        for (; records < batch && !end_of_file; ++records) {
+            vmsplice_all(stage[1], &header, sizeof(pid_t));
+
+            size_t size = 0;
+            while (size < MSG_SIZE) {
+                ssize_t moved = TEMP_FAILURE_RETRY(splice(file_fd, NULL, stage[1], NULL, MSG_SIZE - size, SPLICE_F_MOVE));
+                if (moved < 0)
+                    ERR("client: splice file failed");
+                if (moved == 0) {
+                    end_of_file = 1;
+                    break;
+                }
+                size += moved;
+            }
+
+            if (size == 0) {
+                header_left = 1;
+                break;
+            }
+            if (size < MSG_SIZE)
+                vmsplice_all(stage[1], zeros, MSG_SIZE - size);
+        }
+
+        if (records > 0) {
+            if (flock(fifo_fd, LOCK_EX) < 0)
+                ERR("client: flock failed");
+            splice_records(stage[0], fifo_fd, records);
+            if (flock(fifo_fd, LOCK_UN) < 0)
+                ERR("client: flock failed");
+        }
+
+        pid_t unused;
+        if (header_left && read(stage[0], &unused, sizeof(pid_t)) != sizeof(pid_t))
+            ERR("client: read pipe failed");
+    }
+
+    if (close(stage[0]) < 0 || close(stage[1]) < 0)
+        ERR("client: close pipe failed");
 }
 
 int main(int argc, char **argv)
 {
     int fifo_fd, file_fd;
+    int splice_mode = 0;
 
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
         usage(argv[0]);
+    if (argc == 4) {
+        if (strcmp(argv[3], "splice") == 0)
+            splice_mode = 1;
+        else if (strcmp(argv[3], "copy") != 0)
+            usage(argv[0]);
+    }
 
     if (mkfifo(argv[1], S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0)
 		if (errno != EEXIST)
@@ -66,7 +227,10 @@ int main(int argc, char **argv)
     if ((file_fd = open(argv[2], O_RDONLY)) < 0)
         ERR("client: open file failed");
 
-    write_to_fifo(fifo_fd, file_fd);
+    if (splice_mode)
+        splice_to_fifo(fifo_fd, file_fd);
+    else
+        write_to_fifo(fifo_fd, file_fd);
 
     if (close(fifo_fd) < 0)
         ERR("client: close fifo failed");
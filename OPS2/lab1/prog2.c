@@ -16,6 +16,19 @@
 
 // MAX_BUFF must be in one byte range - [0, 255]
 #define MAX_BUFF 200
+// the parent reads the R pipe in chunks of this size, a chunk holds
+// hundreds of records of the children
+#define FRAMER_SIZE (64 * 1024)
+
+// records [size][size bytes] read from a pipe, many of them per read,
+// a record split between two reads waits in the buffer for the rest
+typedef struct framer {
+    int fd;
+    // unparsed bytes are buffer[start, end)
+    size_t start;
+    size_t end;
+    char buffer[FRAMER_SIZE];
+} framer_t;
 
 volatile sig_atomic_t last_signal = 0;
 
@@ -76,6 +89,8 @@ void sigchld_handler(int sigNo)
 void create_children_and_pipes(int count, int *pipe_R_out, int **pipes_P_in);
 void child_work_func(int pipe_in, int pipe_out);
 void parent_work_func(int children_count, int pipe_out, int *pipes_in);
+ssize_t framer_fill(framer_t *f);
+char *framer_next(framer_t *f, unsigned char *size);
 
 int main(int argc, char **argv)
 {
@@ -226,9 +241,43 @@ void child_work_func(int pipe_in, int pipe_out)
     }
 }
 
+// reads once, returns what read returned
+ssize_t framer_fill(framer_t *f)
+{
+    // the incomplete record goes to the front, it's shorter than a full one
+    if (f->start > 0) {
+        memmove(f->buffer, f->buffer + f->start, f->end - f->start);
+        f->end -= f->start;
+        f->start = 0;
+    }
+
+    ssize_t status = read(f->fd, f->buffer + f->end, FRAMER_SIZE - f->end);
+    if (status > 0)
+        f->end += status;
+    return status;
+}
+
+// returns the data of the next complete record, NULL if there is none in the buffer
+char *framer_next(framer_t *f, unsigned char *size)
+{
+    size_t available = f->end - f->start;
+    if (available < 1)
+        return NULL;
+
+    *size = (unsigned char)f->buffer[f->start];
+    if (available < 1 + (size_t)*size)
+        return NULL;
+
+    char *data = f->buffer + f->start + 1;
+    f->start += 1 + *size;
+    return data;
+}
+
 void parent_work_func(int children_count, int pipe_out, int *pipes_in)
 {
-    char buffer[MAX_BUFF];
+    static framer_t framer;
+    framer.fd = pipe_out;
+
     for (;;) {
 
         // writing
@@ -260,25 +309,25 @@ void parent_work_func(int children_count, int pipe_out, int *pipes_in)
             }
         }
 
-        // read size of the buffer
-        unsigned char size;
+        // one read takes whatever the children have written so far
         // by default the parent waits on blocked read for SIGINT
         // if SIGINT is delivered, this read is interrupted
         // and the loop continues 
-        int status = read(pipe_out, &size, 1);
+        ssize_t status = framer_fill(&framer);
         if (status < 0 && EINTR == errno) 
             continue;
         if (status < 0) // error during reading
             ERR("(parent) read failed");
-        if (0 == status) // EOF
+        if (0 == status) { // EOF
+            if (framer.end > framer.start)
+                fprintf(stderr, "incomplete record of %zu bytes at the end of R\n", framer.end - framer.start);
             break;
-        
-        // read buffer
-        if (TEMP_FAILURE_RETRY(read(pipe_out, buffer, size)) < size)
-            ERR("(parent) read data from R");
-
-        // set termination sign
-        buffer[(int)size] = 0;
-        printf("\n%s\n", buffer);
+        }
+
+        // print every complete record, the rest waits for the next read
+        unsigned char size;
+        char *data;
+        while ((data = framer_next(&framer, &size)) != NULL)
+            printf("\n%.*s\n", (int)size, data);
     }   
 }
\ No newline at end of file
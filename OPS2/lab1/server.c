@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -11,9 +14,21 @@
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
+// ingest mode: every client writes whole PIPE_BUF records (atomic, so the
+// records of many writers never interleave), the server takes up to
+// INGEST_RECORDS of them with a single read and prints all of them with a
+// single write
+#define INGEST_RECORDS 64
+// the fifo holds this much, so the writers rarely block on a full pipe
+// (it's only a hint, an unprivileged process can't go above pipe-max-size)
+#define INGEST_PIPE_SIZE (1 << 20)
+#define BANNER "\n===================================\n"
+// room for the text around the message of a record
+#define RECORD_FRAME 128
+
 void usage(char *name)
 {
-	fprintf(stderr, "USAGE: %s fifo_file\n", name);
+	fprintf(stderr, "USAGE: %s fifo_file [record|ingest]\n", name);
 	exit(EXIT_FAILURE);
 }
 
@@ -51,13 +66,95 @@ void read_from_fifo(int fifo_fd)
     } while(real_size > 0);
 }   
 
+void write_all(int fd, const char *buffer, size_t count)
+{
+    while (count > 0) {
+        ssize_t written = TEMP_FAILURE_RETRY(write(fd, buffer, count));
+        if (written < 0)
+            ERR("write error");
+        buffer += written;
+        count -= written;
+    }
+}
+
+// appends a record in the format of read_from_fifo, returns the new end of the output
+char *format_record(char *out, const char *record, const uint8_t keep[256])
+{
+    pid_t sender_pid;
+    memcpy(&sender_pid, record, sizeof(pid_t));
+
+    out += sprintf(out, BANNER "Sender pid: %d\nMessage: \n\"", sender_pid);
+
+    // every byte is stored and the end moves on only past the alphanumeric
+    // ones, there is no branch to mispredict on the mixed text
+    for (const char *c = record + sizeof(pid_t); c != record + PIPE_BUF; ++c) {
+        *out = *c;
+        out += keep[(uint8_t)*c];
+    }
+
+    memcpy(out, "\"" BANNER, sizeof(BANNER));
+    return out + sizeof(BANNER);
+}
+
+void ingest_from_fifo(int fifo_fd)
+{
+    // isalnum of the locale, looked up once instead of for every byte
+    uint8_t keep[256];
+    for (int c = 0; c < 256; ++c)
+        keep[c] = isalnum(c) ? 1 : 0;
+
+    fcntl(fifo_fd, F_SETPIPE_SZ, INGEST_PIPE_SIZE);
+
+    char *input, *output;
+    if ((input = malloc(INGEST_RECORDS * PIPE_BUF)) == NULL)
+        ERR("malloc error");
+    if ((output = malloc(INGEST_RECORDS * (PIPE_BUF + RECORD_FRAME))) == NULL)
+        ERR("malloc error");
+
+    // bytes of an incomplete record left from the previous read
+    size_t pending = 0;
+    uint64_t reads = 0, records = 0;
+    ssize_t real_size;
+
+    // the first read blocks till a writer opens the fifo, 0 means that all of them have closed it
+    while ((real_size = TEMP_FAILURE_RETRY(read(fifo_fd, input + pending, INGEST_RECORDS * PIPE_BUF - pending))) > 0) {
+        reads++;
+        size_t size = pending + real_size;
+        size_t whole = size / PIPE_BUF * PIPE_BUF;
+
+        char *out = output;
+        for (size_t offset = 0; offset < whole; offset += PIPE_BUF)
+            out = format_record(out, input + offset, keep);
+        records += whole / PIPE_BUF;
+        write_all(STDOUT_FILENO, output, out - output);
+
+        pending = size - whole;
+        memmove(input, input + whole, pending);
+    }
+    if (real_size < 0)
+        ERR("read error");
+    if (pending > 0)
+        fprintf(stderr, "Incomplete record of %zu bytes has been dropped\n", pending);
+
+    fprintf(stderr, "Ingested %lu records in %lu reads\n", records, reads);
+    free(input);
+    free(output);
+}
+
 int main(int argc, char** argv)
 {
     int fifo_fd;
+    int ingest = 0;
 
     // the path to the fifo file should be provided as an argument
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
         usage(argv[0]);
+    if (argc == 3) {
+        if (strcmp(argv[2], "ingest") == 0)
+            ingest = 1;
+        else if (strcmp(argv[2], "record") != 0)
+            usage(argv[0]);
+    }
 
     // make fifo with read ride for users and groups
     if (mkfifo(argv[1], S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0)
@@ -68,7 +165,10 @@ int main(int argc, char** argv)
     if ((fifo_fd = open(argv[1], O_RDONLY)) < 0)
         ERR("fifo open error");
 
-    read_from_fifo(fifo_fd);
+    if (ingest)
+        ingest_from_fifo(fifo_fd);
+    else
+        read_from_fifo(fifo_fd);
 
     if (close(fifo_fd) < 0)
         ERR("fifo close error");
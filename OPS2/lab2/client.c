@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <mqueue.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,7 +15,12 @@
 #include <limits.h>
 
 #define MAX_NAME_SIZE 16
-#define MSG_SIZE 100
+#define MSG_SIZE 128
+// numbers in one batch message
+#define BATCH_MAX 25
+// a message with this priority is a batch, the server answers with a bitmap
+#define BATCH_PRIORITY 2
+#define INPUT_SIZE 4096
 #define ERR(source)                                                                                                    \
 	(fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
@@ -24,6 +30,26 @@ void usage(void)
 	exit(EXIT_FAILURE);
 }
 
+typedef struct batch_request {
+    uint32_t count;
+    char q_name[MAX_NAME_SIZE];
+    uint32_t numbers[BATCH_MAX];
+} batch_request_t;
+
+// bit i is set if the i-th number of the batch is divisible
+typedef struct batch_reply {
+    uint32_t count;
+    uint8_t divisible[(BATCH_MAX + 7) / 8];
+} batch_reply_t;
+
+// stdin read by hand, so it's known whether more input is already waiting
+typedef struct input {
+    char buffer[INPUT_SIZE];
+    size_t start;
+    size_t end;
+    int eof;
+} input_t;
+
 void server_communication(mqd_t queue, mqd_t server_queue, char q_name[MAX_NAME_SIZE]);
 
 int main(int argc, char **argv)
@@ -75,37 +101,123 @@ int main(int argc, char **argv)
 }
 
 
-void server_communication(mqd_t queue, mqd_t server_queue, char q_name[MAX_NAME_SIZE])
+// returns the next line of stdin (without '\n'), NULL at the end
+char *next_line(input_t *in)
+{
+    for (;;) {
+        char *line = in->buffer + in->start;
+        char *newline = memchr(line, '\n', in->end - in->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            in->start = newline - in->buffer + 1;
+            return line;
+        }
+
+        // the last line without '\n', or a line longer than the buffer
+        if (in->eof || (in->start == 0 && in->end == INPUT_SIZE - 1)) {
+            if (in->start == in->end) {
+                return NULL;
+            }
+            in->buffer[in->end] = '\0';
+            in->start = in->end = 0;
+            return line;
+        }
+
+        memmove(in->buffer, line, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+
+        ssize_t size;
+        if ((size = TEMP_FAILURE_RETRY(read(STDIN_FILENO, in->buffer + in->end, INPUT_SIZE - 1 - in->end))) < 0) {
+            ERR("read failed");
+        }
+        if (size == 0) {
+            in->eof = 1;
+        }
+        in->end += size;
+    }
+}
+
+// 1 if the next line can be read without waiting
+int input_waiting(input_t *in)
+{
+    if (memchr(in->buffer + in->start, '\n', in->end - in->start) != NULL) {
+        return 1;
+    }
+    if (in->eof) {
+        return in->start < in->end;
+    }
+
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int ready;
+    if ((ready = TEMP_FAILURE_RETRY(poll(&pfd, 1, 0))) < 0) {
+        ERR("poll failed");
+    }
+    return ready;
+}
+
+void send_batch(mqd_t queue, mqd_t server_queue, batch_request_t *request)
 {
-    static char stdin_buff[MSG_SIZE];
     static char buff[MSG_SIZE];
 
-    while (fgets(stdin_buff, MSG_SIZE, stdin) != NULL) {
+    memset(buff, 0, MSG_SIZE);
+    memcpy(buff, request, sizeof(batch_request_t));
+    if (-1 == TEMP_FAILURE_RETRY(mq_send(server_queue, buff, MSG_SIZE, BATCH_PRIORITY))) {
+        ERR("send failed");
+    }
+
+    if (-1 == TEMP_FAILURE_RETRY(mq_receive(queue, buff, MSG_SIZE, NULL))) {
+        ERR("receive failed");
+    }
+
+    batch_reply_t reply;
+    memcpy(&reply, buff, sizeof(batch_reply_t));
+    if (reply.count != request->count) {
+        fprintf(stderr, "[Client] Server answered %u numbers instead of %u\n", reply.count, request->count);
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < reply.count; ++i) {
+        int divisible = (reply.divisible[i / 8] >> (i % 8)) & 1;
+        printf("[Client] Server response: %s (%u)\n", divisible ? "DIVISIBLE" : "NON-DIVISIBLE", request->numbers[i]);
+    }
+
+    request->count = 0;
+}
+
+// the numbers go in batches of up to BATCH_MAX, a batch is sent when it's
+// full or when there is no more input waiting, so numbers typed by hand are
+// still answered one by one, while a file is sent BATCH_MAX at a time
+void server_communication(mqd_t queue, mqd_t server_queue, char q_name[MAX_NAME_SIZE])
+{
+    static input_t in;
+    batch_request_t request;
+    char *line;
+
+    memset(&request, 0, sizeof(batch_request_t));
+    memcpy(request.q_name, q_name, MAX_NAME_SIZE);
+
+    while ((line = next_line(&in)) != NULL) {
 
         char* endptr;
         errno = 0;
-        uint32_t msg = strtol(stdin_buff, &endptr, 10);
+        uint32_t msg = strtol(line, &endptr, 10);
         if (errno != 0) {
             perror("strtol");
             exit(EXIT_FAILURE);
         }
 
-        if (endptr == stdin_buff) { // it is not a number
-            continue;
+        if (endptr != line) { // it is a number
+            printf("[Client] Input: %d\n", msg);
+            request.numbers[request.count++] = msg;
         }
 
-		printf("[Client] Input: %d\n", msg);
-
-        *((uint32_t *)buff) = msg;
-        memcpy(buff + sizeof(uint32_t), q_name, MAX_NAME_SIZE);
-
-        if (-1 == TEMP_FAILURE_RETRY(mq_send(server_queue, buff, MSG_SIZE, 1))) {
-            ERR("send failed");
+        if (request.count == BATCH_MAX || (request.count > 0 && !input_waiting(&in))) {
+            send_batch(queue, server_queue, &request);
         }
+    }
 
-        if (-1 == TEMP_FAILURE_RETRY(mq_receive(queue, buff, MSG_SIZE, NULL))) {
-            ERR("receive failed");
-        } 
-        printf("[Client] Server response: %s\n", buff);
+    if (request.count > 0) {
+        send_batch(queue, server_queue, &request);
     }
-}
\ No newline at end of file
+}
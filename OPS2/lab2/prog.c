@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -19,6 +20,8 @@
 
 #define MAX_NUM 10
 #define LIFE_SPAN 10
+// messages of the children taken at once, then the parent looks at the clock
+#define DRAIN_LIMIT 16
 
 volatile sig_atomic_t children_left = 0;
 
@@ -44,9 +47,9 @@ void set_handler(void (*f)(int, siginfo_t *, void *), int sigNo)
 }
 
 void sigchld_handler(int sig, siginfo_t *s, void *p);
-void mq_handler(int sig, siginfo_t *info, void *p);
+int drain_messages(mqd_t pin, int limit);
 void create_children(int children_count, mqd_t pin, mqd_t pout);
-void parent_work(mqd_t pout);
+void parent_work(mqd_t pin, mqd_t pout);
 void child_work(int id, mqd_t pin, mqd_t pout);
 
 int main(int argc, char **argv)
@@ -75,19 +78,10 @@ int main(int argc, char **argv)
 
     // set handlers
     set_handler(sigchld_handler, SIGCHLD);
-    set_handler(mq_handler, SIGRTMIN);
     
     create_children(children_count, pin, pout);
 
-    // notification api
-    static struct sigevent notify;
-    notify.sigev_notify = SIGEV_SIGNAL;
-    notify.sigev_signo = SIGRTMIN;
-    notify.sigev_value.sival_ptr = &pin;
-    if (mq_notify(pin, &notify) < 0)
-        ERR("mq_notify - setting a notification failed");
-
-    parent_work(pout);
+    parent_work(pin, pout);
     
     mq_close(pin);
     mq_close(pout);
@@ -117,30 +111,20 @@ void sigchld_handler(int sig, siginfo_t *s, void *p)
 	}
 }
 
-void mq_handler(int sig, siginfo_t *info, void *p)
+// returns the number of messages taken, at most limit
+int drain_messages(mqd_t pin, int limit)
 {
-    // get info
-    mqd_t *pin = (mqd_t *) info->si_value.sival_ptr;
-
-    // set notification again
-    static struct sigevent notify;
-    notify.sigev_notify = SIGEV_SIGNAL;
-    notify.sigev_signo = SIGRTMIN;
-    notify.sigev_value.sival_ptr = pin;
-    if (mq_notify(*pin, &notify)) {
-        ERR("mq_notify");
-    }
+    int taken;
 
-    // empty the message queue
-    for (;;) {
+    for (taken = 0; taken < limit; ++taken) {
         uint8_t msg;
         unsigned int priority;
-        if (mq_receive(*pin, (char *)&msg, 1, &priority) < 1) {
+        if (mq_receive(pin, (char *)&msg, 1, &priority) < 1) {
             if (errno == EAGAIN) {
                 // if the queue is empty
                 break;
             } else {
-                ERR("(mq_handler) mq_receive failed");
+                ERR("(parent) mq_receive failed");
             }
         }
         if (0 == priority) { // the child lost the game
@@ -149,7 +133,8 @@ void mq_handler(int sig, siginfo_t *info, void *p)
             printf("MQ:%d is a bingo number!\n", msg);
         }
     }
-    
+
+    return taken;
 }
 
 void create_children(int children_count, mqd_t pin, mqd_t pout)
@@ -170,19 +155,59 @@ void create_children(int children_count, mqd_t pin, mqd_t pout)
     }
 }
 
-void parent_work(mqd_t pout)
+// the parent waits for the messages of the children in epoll (a mqd_t is a
+// descriptor on linux) instead of getting a signal for them, the timeout is
+// the time left to the next number, so the numbers are still sent every second
+void parent_work(mqd_t pin, mqd_t pout)
 {
     srand(getpid());
+
+    int epoll_fd;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        ERR("epoll_create1 failed");
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = pin;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pin, &event)) {
+        ERR("epoll_ctl failed");
+    }
+
+    struct timespec now, next;
+    if (clock_gettime(CLOCK_MONOTONIC, &next)) {
+        ERR("clock_gettime failed");
+    }
+
     while (children_left > 0) {
+        if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+            ERR("clock_gettime failed");
+        }
+        long timeout = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
 
-        uint8_t msg = rand() % MAX_NUM;
+        if (timeout <= 0) {
+            uint8_t msg = rand() % MAX_NUM;
 
-        if (-1 == TEMP_FAILURE_RETRY(mq_send(pout, (const char*)&msg, 1, 1))) {
-            ERR("mq_send failed");
+            if (-1 == TEMP_FAILURE_RETRY(mq_send(pout, (const char*)&msg, 1, 1))) {
+                ERR("mq_send failed");
+            }
+            next.tv_sec += 1;
+            continue;
         }
 
-        sleep(1);
+        // SIGCHLD interrupts the wait, the loop checks children_left again
+        if (epoll_wait(epoll_fd, &event, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR("epoll_wait failed");
+        }
+        drain_messages(pin, DRAIN_LIMIT);
     }
+
+    // the last children might have sent something before they were gone
+    while (drain_messages(pin, DRAIN_LIMIT) == DRAIN_LIMIT)
+        ;
+    close(epoll_fd);
     printf("[Parent] Terminates\n");
 }
 
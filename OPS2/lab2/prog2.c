@@ -2,6 +2,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,16 +23,78 @@
 #define STDIN_MAX 128
 #define MAX_NAME_SIZE 16
 
+// mq mode: one dispatcher thread waits for all the queues in a single epoll
+// and takes at most DRAIN_LIMIT numbers from a queue before the others get
+// their turn
+#define DRAIN_LIMIT 16
+
+// ring mode: the stages are threads which pass the numbers through shared
+// memory rings, one ring per producer and consumer (the loader to every
+// stage, every stage to the next one), so each has a single producer and a
+// single consumer and needs no lock, the head and the tail are on separate
+// cache lines and the producer publishes its tail once per RING_BATCH
+// numbers (or when it runs out of work), the message queue of a stage
+// carries only control tokens: a wakeup, sent only if the stage has gone to
+// sleep on its queue, and the end of a producer
+#define RING_SIZE 4096
+#define RING_BATCH 64
+#define CACHE_LINE 64
+#define TOKEN_WAKEUP 0
+#define TOKEN_DONE 1
+
 typedef struct queue_info {
     mqd_t descriptor;
     int index;
     struct queue_info *all_queues;
     int all_queues_count;
+    // eventfd of the end of the loading, only in the first one
+    int done_fd;
 } queue_info_t;
 
+typedef struct ring {
+    // written by the consumer
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    // written by the producer
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+    uint32_t slots[RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+} ring_t;
+
+struct stage;
+
+// the producer's own view of a ring
+typedef struct producer {
+    ring_t *ring;
+    struct stage *consumer;
+    // next free slot, the ring sees it when it's published
+    uint64_t tail;
+    uint64_t published;
+    // the last head read, the ring is certainly not fuller than this says
+    uint64_t head_cache;
+} producer_t;
+
+typedef struct stage {
+    pthread_t tid;
+    int index;
+    int count;
+    mqd_t descriptor;
+
+    ring_t *from_loader;
+    // NULL for the first stage
+    ring_t *from_previous;
+    // to the next stage, unused by the last one
+    producer_t to_next;
+
+    // set when the stage is about to block on its queue
+    int sleeping __attribute__((aligned(CACHE_LINE)));
+    int producers;
+
+    uint64_t received;
+    uint64_t dropped;
+} stage_t;
+
 void usage(void)
 {
-	fprintf(stderr, "USAGE: \n");
+	fprintf(stderr, "USAGE: n [mq|ring]\n");
 	fprintf(stderr, "1<=n<=100\n");
 	exit(EXIT_FAILURE);
 }
@@ -35,11 +102,13 @@ void usage(void)
 void open_queues(queue_info_t queues[MAX_QUEUES_COUNT], int count);
 void close_and_unlink_queues(queue_info_t queues[MAX_QUEUES_COUNT], int count);
 void load_numbers(queue_info_t queues[MAX_QUEUES_COUNT], int count);
-void tfunc(union sigval sv);
+void *dispatch(void *arg);
+int drain_queue(queue_info_t *info, int limit);
+void run_ring_pipeline(queue_info_t queues[MAX_QUEUES_COUNT], int count);
 int main(int argc, char **argv)
 {
     srand(time(NULL));
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
         usage();
     
     int q_count = atoi(argv[1]);
@@ -47,23 +116,46 @@ int main(int argc, char **argv)
     if (q_count < 1 || q_count > MAX_QUEUES_COUNT)
         usage();
 
+    int ring_mode = 0;
+    if (argc == 3) {
+        if (strcmp(argv[2], "ring") == 0)
+            ring_mode = 1;
+        else if (strcmp(argv[2], "mq") != 0)
+            usage();
+    }
+
     queue_info_t queues[MAX_QUEUES_COUNT];
 
     open_queues(queues, q_count);
 
-    for (int i = 0; i < q_count; ++i) {
-        struct sigevent not;
-        not.sigev_notify = SIGEV_THREAD;
-        not.sigev_notify_function = tfunc; 
-        not.sigev_notify_attributes = NULL;
-        not.sigev_value.sival_ptr = &queues[i];
-        if (mq_notify(queues[i].descriptor, &not)) {
-            ERR("mq_notify failed");
-        }
+    if (ring_mode) {
+        run_ring_pipeline(queues, q_count);
+        close_and_unlink_queues(queues, q_count);
+        return EXIT_SUCCESS;
+    }
+
+    // the dispatcher learns through it that the loading has finished
+    int done_fd;
+    if ((done_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        ERR("eventfd failed");
+    }
+    queues[0].done_fd = done_fd;
+
+    pthread_t dispatcher;
+    if (pthread_create(&dispatcher, NULL, dispatch, queues)) {
+        ERR("pthread_create failed");
     }
 
     load_numbers(queues, q_count);
-    sleep(2);
+
+    uint64_t one = 1;
+    if (TEMP_FAILURE_RETRY(write(done_fd, &one, sizeof(one))) != sizeof(one)) {
+        ERR("write failed");
+    }
+    if (pthread_join(dispatcher, NULL)) {
+        ERR("pthread_join failed");
+    }
+    close(done_fd);
     close_and_unlink_queues(queues, q_count);
 
     return EXIT_SUCCESS;
@@ -137,30 +229,83 @@ void load_numbers(queue_info_t queues[MAX_QUEUES_COUNT], int count)
 
 		printf("Input: %d has been send to the queue with fd=%d and id=%d\n", msg, queues[index].descriptor, queues[index].index);
 
-        if (TEMP_FAILURE_RETRY(mq_send(queues[rand() % count].descriptor, (const char*)&msg, 4, 1))) {
-            ERR("send failed");
+        // the queue is full, the dispatcher is emptying it
+        while (TEMP_FAILURE_RETRY(mq_send(queues[index].descriptor, (const char*)&msg, 4, 1))) {
+            if (errno != EAGAIN) {
+                ERR("send failed");
+            }
+            sched_yield();
         }
     }
 
     printf("Loading has been finished!\n");
 }
 
-void tfunc(union sigval sv)
+// a mqd_t is a descriptor on linux, so the queues are polled instead of
+// starting a thread for every notification, the epoll is level triggered:
+// a queue left with numbers after DRAIN_LIMIT of them is reported again
+void *dispatch(void *arg)
 {
-    queue_info_t *info = (queue_info_t *) sv.sival_ptr;
+    queue_info_t *queues = (queue_info_t *)arg;
+    int count = queues[0].all_queues_count;
+    int epoll_fd;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        ERR("epoll_create1 failed");
+    }
 
-    // set notification again
-    static struct sigevent not;
-    not.sigev_notify = SIGEV_THREAD;
-    not.sigev_notify_function = tfunc; 
-    not.sigev_notify_attributes = NULL;
-    not.sigev_value.sival_ptr = info;
-    if (mq_notify(info->descriptor, &not)) {
-        ERR("mq_notify failed");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, queues[0].done_fd, &event)) {
+        ERR("epoll_ctl failed");
+    }
+    for (int i = 0; i < count; ++i) {
+        event.events = EPOLLIN;
+        event.data.ptr = &queues[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, queues[i].descriptor, &event)) {
+            ERR("epoll_ctl failed");
+        }
     }
 
-    // empty the message queue
+    struct epoll_event events[MAX_QUEUES_COUNT + 1];
+    int done = 0;
     for (;;) {
+        // all the numbers are in the queues once the loading has finished,
+        // so the work is over when none of them is ready
+        int ready;
+        if ((ready = epoll_wait(epoll_fd, events, count + 1, done ? 0 : -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR("epoll_wait failed");
+        }
+        if (ready == 0) {
+            break;
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.ptr == NULL) {
+                done = 1;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, queues[0].done_fd, NULL)) {
+                    ERR("epoll_ctl failed");
+                }
+                continue;
+            }
+            drain_queue((queue_info_t *)events[i].data.ptr, DRAIN_LIMIT);
+        }
+    }
+
+    close(epoll_fd);
+    return NULL;
+}
+
+// returns the number of messages taken, at most limit
+int drain_queue(queue_info_t *info, int limit)
+{
+    int taken;
+
+    for (taken = 0; taken < limit; ++taken) {
         uint32_t msg;
         unsigned int priority;
         if (mq_receive(info->descriptor, (char *)&msg, 4, &priority) < 1) {
@@ -182,8 +327,221 @@ void tfunc(union sigval sv)
             continue;
         }
 
-        if (mq_send(info->all_queues[info->index + 1].descriptor, (char *)&msg, 4, 0) < 0) {
-            ERR("mq_send failed");
+        // the dispatcher is the only reader, so a full next queue has to be
+        // emptied a bit right here, the last queue never forwards anything
+        queue_info_t *next = &info->all_queues[info->index + 1];
+        while (mq_send(next->descriptor, (char *)&msg, 4, 0) < 0) {
+            if (errno != EAGAIN) {
+                ERR("mq_send failed");
+            }
+            drain_queue(next, DRAIN_LIMIT);
+        }
+    }
+
+    return taken;
+}
+/* RING MODE */
+
+void send_token(stage_t *stage, uint32_t token)
+{
+    if (TEMP_FAILURE_RETRY(mq_send(stage->descriptor, (const char *)&token, 4, token))) {
+        ERR("mq_send failed");
+    }
+}
+
+// makes the written numbers visible to the consumer and wakes it up if it sleeps
+void publish(producer_t *p)
+{
+    if (p->tail == p->published)
+        return;
+
+    __atomic_store_n(&p->ring->tail, p->tail, __ATOMIC_RELEASE);
+    p->published = p->tail;
+
+    // the consumer sets sleeping before its last look at the ring, we read
+    // it after the tail is published, so one of us sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&p->consumer->sleeping, 0, __ATOMIC_SEQ_CST))
+        send_token(p->consumer, TOKEN_WAKEUP);
+}
+
+void produce(producer_t *p, uint32_t number)
+{
+    while (p->tail - p->head_cache == RING_SIZE) {
+        p->head_cache = __atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE);
+        if (p->tail - p->head_cache < RING_SIZE)
+            break;
+        // the ring is full, the consumer has to see what's there
+        publish(p);
+        sched_yield();
+    }
+
+    p->ring->slots[p->tail % RING_SIZE] = number;
+    if (++p->tail - p->published == RING_BATCH)
+        publish(p);
+}
+
+// processes every published number of the ring, returns how many there were
+uint64_t drain(stage_t *s, ring_t *ring)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    for (uint64_t i = head; i < tail; ++i) {
+        uint32_t msg = ring->slots[i % RING_SIZE];
+
+        if (s->index + 1 >= s->count) {
+            printf("Output: %d\n", msg);
+        } else if (msg % (s->index + 1) == 0) {
+            s->dropped++;
+        } else {
+            produce(&s->to_next, msg);
+        }
+    }
+
+    __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+    s->received += tail - head;
+    return tail - head;
+}
+
+int rings_empty(stage_t *s)
+{
+    if (__atomic_load_n(&s->from_loader->tail, __ATOMIC_ACQUIRE) != s->from_loader->head)
+        return 0;
+    return s->from_previous == NULL ||
+           __atomic_load_n(&s->from_previous->tail, __ATOMIC_ACQUIRE) == s->from_previous->head;
+}
+
+void *stage_work(void *arg)
+{
+    stage_t *s = (stage_t *)arg;
+    int done = 0;
+
+    for (;;) {
+        uint64_t count = drain(s, s->from_loader);
+        if (s->from_previous)
+            count += drain(s, s->from_previous);
+
+        if (count > 0) {
+            // the next stage gets what we have before we look for more
+            publish(&s->to_next);
+            continue;
+        }
+
+        // the producers publish everything before they are done
+        if (done == s->producers)
+            break;
+
+        __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!rings_empty(s)) {
+            // a wakeup sent in the meantime is taken by the next sleep
+            __atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        uint32_t token;
+        if (TEMP_FAILURE_RETRY(mq_receive(s->descriptor, (char *)&token, 4, NULL)) < 0) {
+            ERR("mq_receive failed");
+        }
+        __atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (token == TOKEN_DONE)
+            done++;
+    }
+
+    if (s->index + 1 < s->count) {
+        publish(&s->to_next);
+        send_token(s->to_next.consumer, TOKEN_DONE);
+    }
+
+    return NULL;
+}
+
+void run_ring_pipeline(queue_info_t queues[MAX_QUEUES_COUNT], int count)
+{
+    static stage_t stages[MAX_QUEUES_COUNT];
+    static producer_t loader[MAX_QUEUES_COUNT];
+    static char buff[STDIN_MAX + 2];
+
+    // the rings live in shared memory, the stages might as well be processes
+    size_t rings_size = 2 * count * sizeof(ring_t);
+    ring_t *rings;
+    if ((rings = (ring_t *)mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        ERR("mmap failed");
+    }
+
+    memset(stages, 0, sizeof(stages));
+    memset(loader, 0, sizeof(loader));
+    for (int i = 0; i < count; ++i) {
+        stage_t *s = &stages[i];
+        s->index = i;
+        s->count = count;
+        s->from_loader = &rings[2 * i];
+        s->from_previous = i > 0 ? &rings[2 * i + 1] : NULL;
+        s->producers = i > 0 ? 2 : 1;
+
+        // the queue is waited on now
+        struct mq_attr attr;
+        if (mq_getattr(queues[i].descriptor, &attr)) {
+            ERR("mq_getattr failed");
+        }
+        attr.mq_flags = 0;
+        if (mq_setattr(queues[i].descriptor, &attr, NULL)) {
+            ERR("mq_setattr failed");
+        }
+        s->descriptor = queues[i].descriptor;
+
+        loader[i].ring = s->from_loader;
+        loader[i].consumer = s;
+    }
+    for (int i = 0; i + 1 < count; ++i) {
+        stages[i].to_next.ring = stages[i + 1].from_previous;
+        stages[i].to_next.consumer = &stages[i + 1];
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&stages[i].tid, NULL, stage_work, &stages[i])) {
+            ERR("pthread_create failed");
+        }
+    }
+
+    // typed numbers are published one by one, a file in batches
+    int interactive = isatty(STDIN_FILENO);
+    uint64_t loaded = 0;
+
+	while (fgets(buff, STDIN_MAX + 2, stdin) != NULL) {
+        char* endptr;
+        errno = 0;
+        uint32_t msg = strtol(buff, &endptr, 10);
+        if (errno != 0) {
+            perror("strtol");
+            exit(EXIT_FAILURE);
+        }
+
+        if (endptr == buff) { // it is not a number
+            continue;
+        }
+
+        uint32_t index = rand() % count;
+        produce(&loader[index], msg);
+        if (interactive)
+            publish(&loader[index]);
+        loaded++;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        publish(&loader[i]);
+        send_token(&stages[i], TOKEN_DONE);
+    }
+    printf("Loading has been finished! (%lu numbers)\n", loaded);
+
+    for (int i = 0; i < count; ++i) {
+        if (pthread_join(stages[i].tid, NULL)) {
+            ERR("pthread_join failed");
         }
+        printf("Stage [%d]: received %lu, dropped %lu\n", i, stages[i].received, stages[i].dropped);
     }
-}
\ No newline at end of file
+
+    if (munmap(rings, rings_size)) {
+        ERR("munmap failed");
+    }
+}
@@ -2,10 +2,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <mqueue.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -15,8 +19,21 @@
 	(fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
 #define QUEUES_COUNT 4
-#define MSG_SIZE 100
+#define MSG_SIZE 128
 #define MAX_NAME_SIZE 16
+// numbers in one batch message
+#define BATCH_MAX 25
+// BATCH_MAX rounded up to whole vectors
+#define BATCH_LANES 32
+// a message with this priority is a batch, a single number comes with 1
+#define BATCH_PRIORITY 2
+// messages taken from one queue before the others get their turn
+#define DRAIN_LIMIT 16
+// client queues kept open between the replies
+#define CLIENT_CACHE_SIZE 32
+// send_reply results besides 0
+#define REPLY_GONE -1
+#define REPLY_FULL -2
 
 void usage(void)
 {
@@ -25,15 +42,66 @@ void usage(void)
 	exit(EXIT_FAILURE);
 }
 
+// descriptors of the client queues, so a reply to a client which has
+// already been answered is a single mq_send instead of mq_open, mq_send and
+// mq_close, the least recently used one is closed when the cache is full
+typedef struct client_entry {
+    char name[MAX_NAME_SIZE];
+    mqd_t descriptor;
+    uint64_t last_used;
+} client_entry_t;
+
+typedef struct client_cache {
+    client_entry_t entries[CLIENT_CACHE_SIZE];
+    int count;
+    uint64_t clock;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} client_cache_t;
+
+// divisibility test without a division (Granlund, Montgomery): the divisor
+// is odd << shift, n is divisible iff n * (the inverse of odd modulo 2^32)
+// rotated right by shift is at most UINT32_MAX / divisor, the loop over a
+// batch has no branches, so the compiler turns it into simd multiplies,
+// shifts and compares
+typedef struct divisor_test {
+    uint32_t inverse;
+    uint32_t shift;
+    uint32_t limit;
+} divisor_test_t;
+
+typedef struct batch_request {
+    uint32_t count;
+    char q_name[MAX_NAME_SIZE];
+    uint32_t numbers[BATCH_MAX];
+} batch_request_t;
+
+// bit i is set if the i-th number of the batch is divisible
+typedef struct batch_reply {
+    uint32_t count;
+    uint8_t divisible[(BATCH_MAX + 7) / 8];
+} batch_reply_t;
+
 typedef struct queue_info {
     mqd_t descriptor;
     int divisor;
+    divisor_test_t test;
     char name[MAX_NAME_SIZE];
+    client_cache_t *clients;
 } queue_info_t;
 
 void initialize_server(queue_info_t queues[QUEUES_COUNT]);
 void close_server(queue_info_t queues[QUEUES_COUNT]);
-void thread_notification_handler(union sigval sv);
+void serve(queue_info_t queues[QUEUES_COUNT]);
+int drain_queue(queue_info_t *info, int limit);
+void prepare_divisor_test(divisor_test_t *test, uint32_t divisor);
+void test_divisibility(const divisor_test_t *test, const uint32_t *numbers, uint32_t count, uint8_t *bitmap);
+void handle_batch(queue_info_t *info, char buffer[MSG_SIZE], ssize_t size);
+int send_reply(client_cache_t *cache, const char *client_q_name, char buffer[MSG_SIZE]);
+void close_clients(client_cache_t *cache);
 
 int main(int argc, char **argv)
 {
@@ -41,28 +109,24 @@ int main(int argc, char **argv)
     if (argc != QUEUES_COUNT + 1)
         usage();
     
+    client_cache_t clients;
+    memset(&clients, 0, sizeof(client_cache_t));
+
     queue_info_t queues[QUEUES_COUNT];
     for (int i = 0; i < QUEUES_COUNT; ++i) {
         if ((queues[i].divisor = atoi(argv[i + 1])) < 1)
             usage();
+        prepare_divisor_test(&queues[i].test, queues[i].divisor);
+        queues[i].clients = &clients;
     }
     
     initialize_server(queues);
 
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGINT);
-    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
-        perror("sigprocmask");
-        exit(EXIT_FAILURE);
-    }
-    // Wait for SIGINT signal
-    int sig;
-    sigwait(&set, &sig);
+    serve(queues);
     printf("[Server] Received SIGINT signal.\n");
 
-
     close_server(queues);
+    close_clients(&clients);
 
     return EXIT_SUCCESS;
 }
@@ -84,18 +148,6 @@ struct mq_attr attr;
 
         printf("[Server] Queue (mqd=%d, divisor=%d, name=%s) has been created.\n", queues[i].descriptor, queues[i].divisor, queues[i].name);
     }
-
-    // set notifications
-    for(int i = 0; i < QUEUES_COUNT; ++i) {  
-        struct sigevent not;
-        not.sigev_notify = SIGEV_THREAD;
-        not.sigev_notify_function = thread_notification_handler; 
-        not.sigev_notify_attributes = NULL;
-        not.sigev_value.sival_ptr = (void*)&queues[i];
-        if (mq_notify(queues[i].descriptor, &not)) {
-            ERR("mq_notify failed");
-        }
-    }
 }
 
 void close_server(queue_info_t queues[QUEUES_COUNT])
@@ -118,24 +170,73 @@ void close_server(queue_info_t queues[QUEUES_COUNT])
     }
 }
 
-void thread_notification_handler(union sigval sv)
+// on linux a mqd_t is a descriptor, so one thread waits for all the queues
+// (and SIGINT, through a signalfd) in a single epoll, there is no thread
+// started per notification and nothing to re-arm, a busy queue is served
+// DRAIN_LIMIT messages at a time, it stays ready (the epoll is level
+// triggered), so it's served again after the others
+void serve(queue_info_t queues[QUEUES_COUNT])
 {
-    queue_info_t *info = (queue_info_t *) sv.sival_ptr;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
+        ERR("sigprocmask failed");
+    }
+
+    int signal_fd, epoll_fd;
+    if ((signal_fd = signalfd(-1, &set, SFD_CLOEXEC)) < 0) {
+        ERR("signalfd failed");
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        ERR("epoll_create1 failed");
+    }
 
-    // set notification again
-    struct sigevent not;
-    not.sigev_notify = SIGEV_THREAD;
-    not.sigev_notify_function = thread_notification_handler; 
-    not.sigev_notify_attributes = NULL;
-    not.sigev_value.sival_ptr = info;
-    if (mq_notify(info->descriptor, &not)) {
-        ERR("mq_notify failed");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event)) {
+        ERR("epoll_ctl failed");
+    }
+    for (int i = 0; i < QUEUES_COUNT; ++i) {
+        event.events = EPOLLIN;
+        event.data.ptr = &queues[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, queues[i].descriptor, &event)) {
+            ERR("epoll_ctl failed");
+        }
     }
 
-     // empty the message queue
+    struct epoll_event events[QUEUES_COUNT + 1];
     for (;;) {
+        int count;
+        if ((count = epoll_wait(epoll_fd, events, QUEUES_COUNT + 1, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR("epoll_wait failed");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                close(epoll_fd);
+                close(signal_fd);
+                return;
+            }
+            drain_queue((queue_info_t *)events[i].data.ptr, DRAIN_LIMIT);
+        }
+    }
+}
+
+// returns the number of messages taken, at most limit
+int drain_queue(queue_info_t *info, int limit)
+{
+    int taken;
+
+    for (taken = 0; taken < limit; ++taken) {
         char buffer[MSG_SIZE];
-        if (mq_receive(info->descriptor, buffer, MSG_SIZE, NULL) < 1) {
+        unsigned int priority;
+        ssize_t size;
+        if ((size = mq_receive(info->descriptor, buffer, MSG_SIZE, &priority)) < 1) {
             if (errno == EAGAIN) {
                 // if the queue is empty
                 break;
@@ -143,31 +244,205 @@ void thread_notification_handler(union sigval sv)
                 ERR("mq_receive failed");
             }
         }
-        uint32_t number = *((uint32_t *)buffer);
-        char* client_q_name = buffer + sizeof(uint32_t);
-        printf("[Server] Received: %d, from client %s on queue with divisor %d\n", number, client_q_name, info->divisor);
-
 
-        mqd_t client_des;
-        struct mq_attr attr;
-        attr.mq_maxmsg = 10;
-        attr.mq_msgsize = MSG_SIZE;
-        if ((client_des= TEMP_FAILURE_RETRY(mq_open(client_q_name, O_RDWR | O_NONBLOCK, 0600, &attr))) == (mqd_t)-1) {
-            ERR("mq_open failed");
+        if (priority == BATCH_PRIORITY) {
+            handle_batch(info, buffer, size);
+            continue;
         }
 
+        uint32_t number = *((uint32_t *)buffer);
+        // the name is copied, the buffer is reused for the reply
+        char client_q_name[MAX_NAME_SIZE];
+        strncpy(client_q_name, buffer + sizeof(uint32_t), MAX_NAME_SIZE - 1);
+        client_q_name[MAX_NAME_SIZE - 1] = '\0';
+        printf("[Server] Received: %d, from client %s on queue with divisor %d\n", number, client_q_name, info->divisor);
+
         if (number % info->divisor == 0) {
             strcpy(buffer, "DIVISIBLE");
         } else {
             strcpy(buffer, "NON-DIVISIBLE");
         }
 
-        if (-1 == TEMP_FAILURE_RETRY(mq_send(client_des, buffer, MSG_SIZE, 1))) {
+        switch (send_reply(info->clients, client_q_name, buffer)) {
+            case REPLY_GONE:
+                printf("[Server] Client %s is gone, the reply has been dropped.\n", client_q_name);
+                break;
+            case REPLY_FULL:
+                printf("[Server] Client %s doesn't read its replies, the reply has been dropped.\n", client_q_name);
+                break;
+        }
+    }
+
+    return taken;
+}
+
+void prepare_divisor_test(divisor_test_t *test, uint32_t divisor)
+{
+    test->shift = __builtin_ctz(divisor);
+    uint32_t odd = divisor >> test->shift;
+
+    // newton's iteration, every step doubles the number of correct bits
+    // (an odd number is its own inverse modulo 8)
+    uint32_t inverse = odd;
+    for (int i = 0; i < 4; ++i) {
+        inverse *= 2 - odd * inverse;
+    }
+
+    test->inverse = inverse;
+    test->limit = UINT32_MAX / divisor;
+}
+
+void test_divisibility(const divisor_test_t *test, const uint32_t *numbers, uint32_t count, uint8_t *bitmap)
+{
+    // the whole padded batch is tested, a loop of a constant length is
+    // vectorized even without -O3
+    uint32_t lanes[BATCH_LANES] = { 0 };
+    uint8_t divisible[BATCH_LANES];
+    const uint32_t inverse = test->inverse, shift = test->shift, limit = test->limit;
+
+    memcpy(lanes, numbers, count * sizeof(uint32_t));
+    for (int i = 0; i < BATCH_LANES; ++i) {
+        uint32_t x = lanes[i] * inverse;
+        x = (x >> shift) | (x << ((32 - shift) & 31));
+        divisible[i] = x <= limit;
+    }
+
+    memset(bitmap, 0, (count + 7) / 8);
+    for (uint32_t i = 0; i < count; ++i) {
+        bitmap[i / 8] |= divisible[i] << (i % 8);
+    }
+}
+
+void handle_batch(queue_info_t *info, char buffer[MSG_SIZE], ssize_t size)
+{
+    batch_request_t request;
+    batch_reply_t reply;
+
+    memcpy(&request, buffer, size < (ssize_t)sizeof(batch_request_t) ? size : (ssize_t)sizeof(batch_request_t));
+    if (size < (ssize_t)offsetof(batch_request_t, numbers) || request.count > BATCH_MAX ||
+        size < (ssize_t)(offsetof(batch_request_t, numbers) + request.count * sizeof(uint32_t))) {
+        printf("[Server] Malformed batch on queue with divisor %d has been dropped.\n", info->divisor);
+        return;
+    }
+    request.q_name[MAX_NAME_SIZE - 1] = '\0';
+
+    reply.count = request.count;
+    test_divisibility(&info->test, request.numbers, request.count, reply.divisible);
+
+    int divisible = 0;
+    for (uint32_t i = 0; i < request.count; ++i) {
+        divisible += (reply.divisible[i / 8] >> (i % 8)) & 1;
+    }
+    printf("[Server] Received %u numbers (%d divisible), from client %s on queue with divisor %d\n", request.count,
+           divisible, request.q_name, info->divisor);
+
+    memset(buffer, 0, MSG_SIZE);
+    memcpy(buffer, &reply, sizeof(batch_reply_t));
+    switch (send_reply(info->clients, request.q_name, buffer)) {
+        case REPLY_GONE:
+            printf("[Server] Client %s is gone, the reply has been dropped.\n", request.q_name);
+            break;
+        case REPLY_FULL:
+            printf("[Server] Client %s doesn't read its replies, the reply has been dropped.\n", request.q_name);
+            break;
+    }
+}
+
+// returns -1 if there is no such queue
+mqd_t open_client(client_cache_t *cache, const char *client_q_name)
+{
+    client_entry_t *entry = NULL;
+
+    for (int i = 0; i < cache->count; ++i) {
+        if (strcmp(cache->entries[i].name, client_q_name) == 0) {
+            cache->hits++;
+            cache->entries[i].last_used = ++cache->clock;
+            return cache->entries[i].descriptor;
+        }
+    }
+    cache->misses++;
+
+    mqd_t client_des;
+    if ((client_des = TEMP_FAILURE_RETRY(mq_open(client_q_name, O_WRONLY | O_NONBLOCK))) == (mqd_t)-1) {
+        if (errno == ENOENT) {
+            return (mqd_t)-1;
+        }
+        ERR("mq_open failed");
+    }
+
+    if (cache->count < CLIENT_CACHE_SIZE) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        // evict the least recently used client
+        entry = &cache->entries[0];
+        for (int i = 1; i < cache->count; ++i) {
+            if (cache->entries[i].last_used < entry->last_used) {
+                entry = &cache->entries[i];
+            }
+        }
+        if (-1 == TEMP_FAILURE_RETRY(mq_close(entry->descriptor))) {
+            ERR("mq_close failed");
+        }
+        cache->evictions++;
+    }
+
+    strcpy(entry->name, client_q_name);
+    entry->descriptor = client_des;
+    entry->last_used = ++cache->clock;
+    return client_des;
+}
+
+void forget_client(client_cache_t *cache, const char *client_q_name)
+{
+    for (int i = 0; i < cache->count; ++i) {
+        if (strcmp(cache->entries[i].name, client_q_name) == 0) {
+            // closing a descriptor which is already bad can only fail
+            mq_close(cache->entries[i].descriptor);
+            cache->entries[i] = cache->entries[--cache->count];
+            cache->invalidations++;
+            return;
+        }
+    }
+}
+
+// returns REPLY_GONE if the client's queue doesn't exist any more and
+// REPLY_FULL if it stays full, the reply is dropped in both cases
+int send_reply(client_cache_t *cache, const char *client_q_name, char buffer[MSG_SIZE])
+{
+    // a cached descriptor may have been closed behind our back (EBADF) or
+    // refer to a queue the client has unlinked, nobody reads that one, so
+    // it fills up (EAGAIN) while a new client with the same name (its pid)
+    // waits on a new queue, then the queue is opened again by its name,
+    // once, but a full queue is usually just a live client which doesn't
+    // keep up with its replies, it's full again after the reopen and the
+    // server doesn't wait for it
+    for (int attempt = 0;; ++attempt) {
+        mqd_t client_des = open_client(cache, client_q_name);
+        if (client_des == (mqd_t)-1) {
+            return REPLY_GONE;
+        }
+
+        if (TEMP_FAILURE_RETRY(mq_send(client_des, buffer, MSG_SIZE, 1)) == 0) {
+            return 0;
+        }
+        if (errno == EAGAIN && attempt > 0) {
+            return REPLY_FULL;
+        }
+        if ((errno != EAGAIN && errno != EBADF) || attempt > 0) {
             ERR("mq_send failed");
         }
+        forget_client(cache, client_q_name);
+    }
+}
 
-        if (-1 == TEMP_FAILURE_RETRY(mq_close(client_des))) {
+void close_clients(client_cache_t *cache)
+{
+    for (int i = 0; i < cache->count; ++i) {
+        if (-1 == TEMP_FAILURE_RETRY(mq_close(cache->entries[i].descriptor))) {
             ERR("mq_close failed");
         }
     }
+
+    printf("[Server] Client queues: hits %lu, misses %lu, evictions %lu, invalidations %lu.\n",
+           cache->hits, cache->misses, cache->evictions, cache->invalidations);
 }
\ No newline at end of file
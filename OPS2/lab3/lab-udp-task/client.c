@@ -20,6 +20,11 @@
 #define RANGE_LEFT 1000000
 #define RANGE_RIGHT 10000000
 
+// the first timeout, its upper bound and number of attempts
+#define INITIAL_RTO_US 500000
+#define MAX_RTO_US 8000000
+#define MAX_ATTEMPTS 5
+
 volatile sig_atomic_t last_signal = 0;
 
 void usage(char *name)
@@ -32,31 +37,17 @@ void sigalrm_handler(int sig)
 	last_signal = sig;
 }
 
-void send_and_confirm(int clientfd, struct sockaddr_in server_addr)
+// receives the confirmation datagram, returns 0 if it hasn't arrived
+// in timeout microseconds
+int wait_for_confirmation(int clientfd, char *buff, int64_t timeout)
 {
-    // prepare data
-    uint32_t rand_num = RANGE_LEFT + rand() % (RANGE_RIGHT - RANGE_LEFT);
-    fprintf(stderr, "[Client] Generated number: %d\n", rand_num);
-
-    // pack the data
-    char buff[BUFF_SIZE];
-    ((uint32_t *)buff)[0] = htonl(rand_num);
-
-    // UDP send is atomic, so we don't n`eed bulk_write
-    // EINTR  A signal interrupted sendto() BEFORE any data was transmitted. (man 3p sendto)
-    // EPIPE is critical error here
-    if (TEMP_FAILURE_RETRY(sendto(clientfd, buff, BUFF_SIZE, 0,
-               &server_addr, sizeof(struct sockaddr_in))) < 0) {
-        ERR("sendto");
-    }
-
     // set SIGALRM
 	struct itimerval ts;
 	memset(&ts, 0, sizeof(struct itimerval));
-	ts.it_value.tv_usec = 500000;
-    ts.it_value.tv_sec = 1;
-	setitimer(ITIMER_REAL, &ts, NULL);
+	ts.it_value.tv_sec = timeout / 1000000;
+	ts.it_value.tv_usec = timeout % 1000000;
 	last_signal = 0;
+	setitimer(ITIMER_REAL, &ts, NULL);
 
 	// recv the confirmation datagram from the server
 	while (recv(clientfd, buff, BUFF_SIZE, 0) < 0) {
@@ -65,13 +56,53 @@ void send_and_confirm(int clientfd, struct sockaddr_in server_addr)
 			ERR("recv:");
 
 		// if time expired, exit the function -> sending failed
-		if (SIGALRM == last_signal){
-            fprintf(stderr, "[Client] Time expired: no answer was received\n");
+		if (SIGALRM == last_signal)
+            return 0;
+	}
+
+    // cancel the timer, so it won't interrupt the next attempt
+	memset(&ts, 0, sizeof(struct itimerval));
+	setitimer(ITIMER_REAL, &ts, NULL);
+
+    return 1;
+}
+
+void send_and_confirm(int clientfd, struct sockaddr_in server_addr)
+{
+    // prepare data
+    uint32_t rand_num = RANGE_LEFT + rand() % (RANGE_RIGHT - RANGE_LEFT);
+    fprintf(stderr, "[Client] Generated number: %d\n", rand_num);
+
+    // the timeout starts from INITIAL_RTO_US and is doubled after every
+    // attempt which wasn't confirmed, a single exchange gives nothing to
+    // estimate it from
+    int64_t rto = INITIAL_RTO_US;
+
+    for (int attempt = 1; attempt <= MAX_ATTEMPTS; attempt++) {
+        // pack the data
+        char buff[BUFF_SIZE];
+        ((uint32_t *)buff)[0] = htonl(rand_num);
+
+        // UDP send is atomic, so we don't n`eed bulk_write
+        // EINTR  A signal interrupted sendto() BEFORE any data was transmitted. (man 3p sendto)
+        // EPIPE is critical error here
+        int64_t sent = monotonic_us();
+        if (TEMP_FAILURE_RETRY(sendto(clientfd, buff, BUFF_SIZE, 0,
+                   &server_addr, sizeof(struct sockaddr_in))) < 0) {
+            ERR("sendto");
+        }
+
+        if (wait_for_confirmation(clientfd, buff, rto)) {
+            fprintf(stderr, "[Client] Received confirmation frame (attempts=%d, rtt_us=%lld)\n",
+                    attempt, (long long)(monotonic_us() - sent));
             return;
         }
-	}
 
-    fprintf(stderr, "[Client] Received confirmation frame\n");
+        fprintf(stderr, "[Client] No answer after %lld us\n", (long long)rto);
+        rto = 2 * rto < MAX_RTO_US ? 2 * rto : MAX_RTO_US;
+    }
+
+    fprintf(stderr, "[Client] Time expired: no answer was received\n");
 }
 
 int main(int argc, char **argv)
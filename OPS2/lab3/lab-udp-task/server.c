@@ -25,7 +25,7 @@ void usage(char *name)
 void server_recv(int serverfd, int internal_key, int internal_prob)
 {
     struct sockaddr_in client_addr;
-    socklen_t len;
+    socklen_t len = sizeof(client_addr);
     char buff[BUFF_SIZE];
     if (TEMP_FAILURE_RETRY(recvfrom(serverfd, buff, BUFF_SIZE, 0,
                                  &client_addr, &len)) < 0) {
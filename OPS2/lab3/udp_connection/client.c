@@ -1,5 +1,8 @@
 #define _GNU_SOURCE
-#include "../../library/mysocklib.h"
+#include "../library/mysocklib.h"
+#include "crc32c.h"
+#include "fec.h"
+#include "transfer.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -8,46 +11,117 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/random.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
-#define MAXBUF 576
-volatile sig_atomic_t last_signal = 0;
+// one frame of the sending window
+struct window_slot {
+	char buf[MAXBUF];
+	uint32_t seq;
+	int acked;
+	int attempts;
+	// the frame has already been retransmitted because of later acknowledgements
+	int fast_retransmitted;
+	// time of the last transmission
+	int64_t sent_us;
+};
+
+// state of the selective-repeat sender
+struct sender {
+	int fd;
+	struct sockaddr_in addr;
+	// the largest window allowed by the user, the number of slots
+	int window;
+	// the oldest frame that is not acknowledged yet
+	uint32_t base;
+	// sequence number of the next frame read from the file
+	uint32_t next_seq;
+	// the highest frame acknowledged selectively
+	uint32_t highest_acked;
+	// the first frame the receiver can't accept yet, cum + 1 + rwnd of the
+	// latest acknowledgement
+	uint32_t rwnd_edge;
+	// the frame with FRAME_LAST flag has been read
+	int eof;
+	// id of the transfer, sent in every frame
+	uint32_t xid;
+	struct rto_estimator rto;
+	struct congestion cc;
+	struct transfer_stats stats;
+	// indexed by seq % window
+	struct window_slot *slots;
+
+	// forward error correction, every fec_n data frames are followed by
+	// fec_k repair frames (0 means no correction)
+	int fec_n;
+	int fec_k;
+	// the block being encoded - its first frame and the number of its frames
+	uint32_t fec_start;
+	int fec_count;
+	char repair[FEC_MAX_K][REPAIR_SIZE];
+};
 
-void sigalrm_handler(int sig);
 void usage(char *name);
-void send_and_confirm(int fd, struct sockaddr_in addr, char *buf1, char *buf2, ssize_t size);
-void do_client(int fd, struct sockaddr_in addr, int file);
+void send_frame(struct sender *s, struct window_slot *slot);
+void send_new_frames(struct sender *s, uint32_t first, int count);
+void fec_add_frame(struct sender *s, struct window_slot *slot);
+void fec_send_repair(struct sender *s);
+int fill_window(struct sender *s, int file);
+int mark_acked(struct sender *s, uint32_t seq, int64_t *newest_sent);
+void handle_ack(struct sender *s, char *buf, size_t size);
+int retransmit_expired(struct sender *s);
+int64_t next_timeout(struct sender *s);
+void do_client(int fd, struct sockaddr_in addr, int file, int window, int fec_n, int fec_k);
 
 int main(int argc, char **argv)
 {
-	int fd, file;
+	int fd, file, window = DEFAULT_WINDOW, fec_n = 0, fec_k = 0;
 
 	struct sockaddr_in addr;
 
-	if (argc != 4) {
+	if (argc != 4 && argc != 5 && argc != 7) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	if (argc >= 5) {
+		window = atoi(argv[4]);
+		if (window < 1 || window > MAX_WINDOW) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc == 7) {
+		fec_n = atoi(argv[5]);
+		fec_k = atoi(argv[6]);
+		if (fec_n < 1 || fec_n > FEC_MAX_N || fec_k < 1 || fec_k > FEC_MAX_K) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		fec_init();
+	}
+
+	crc32c_init();
+
 	if (sethandler(SIG_IGN, SIGPIPE))
 		ERR("Seting SIGPIPE:");
 
-	if (sethandler(sigalrm_handler, SIGALRM))
-		ERR("Seting SIGALRM:");
-
 	if ((file = TEMP_FAILURE_RETRY(open(argv[3], O_RDONLY))) < 0)
 		ERR("open:");
 
 	fd = UDP_IPv4_make_socket();
 	addr = IPv4_make_address(argv[1], argv[2]);
 
-	do_client(fd, addr, file);
+	do_client(fd, addr, file, window, fec_n, fec_k);
 
 	if (TEMP_FAILURE_RETRY(close(fd)) < 0)
 		ERR("close");
@@ -58,81 +132,355 @@ int main(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
-void send_and_confirm(int fd, struct sockaddr_in addr, char *buf1, char *buf2, ssize_t size)
+void send_frame(struct sender *s, struct window_slot *slot)
 {
-	if (TEMP_FAILURE_RETRY(sendto(fd, buf1, size, 0, &addr, sizeof(addr))) < 0)
+	if (TEMP_FAILURE_RETRY(sendto(s->fd, slot->buf, MAXBUF, 0, &s->addr, sizeof(s->addr))) < 0)
 		ERR("sendto:");
 
-	// set signal sending after 0.5s
-	struct itimerval ts;
-	memset(&ts, 0, sizeof(struct itimerval));
-	ts.it_value.tv_usec = 500000;
-	setitimer(ITIMER_REAL, &ts, NULL);
-	last_signal = 0;
-
-	// recv the confirm datagram from the server
-	while (recv(fd, buf2, size, 0) < 0) {
-		// if interrupted - try again
-		if (EINTR != errno)
-			ERR("recv:");
-
-		// if time expired, exit the function -> sending failed
-		if (SIGALRM == last_signal)
-			break;
+	if (slot->attempts > 0)
+		s->stats.retransmits++;
+
+	slot->attempts++;
+	slot->sent_us = monotonic_us();
+}
+
+// sends count frames read from the file, starting from the first one, they
+// all have the same size, so they go to the kernel as one GSO buffer
+void send_new_frames(struct sender *s, uint32_t first, int count)
+{
+	struct iovec iov[UDP_MAX_SEGMENTS];
+
+	// a big window is passed to the kernel in pieces of the largest GSO send
+	while (count > 0) {
+		int piece = count < UDP_MAX_SEGMENTS ? count : UDP_MAX_SEGMENTS;
+
+		for (int i = 0; i < piece; i++) {
+			iov[i].iov_base = s->slots[(first + i) % s->window].buf;
+			iov[i].iov_len = MAXBUF;
+		}
+
+		if (UDP_send_segments(s->fd, &s->addr, iov, piece) < piece)
+			ERR("sendto:");
+
+		int64_t now = monotonic_us();
+		for (int i = 0; i < piece; i++) {
+			struct window_slot *slot = &s->slots[(first + i) % s->window];
+			slot->attempts = 1;
+			slot->sent_us = now;
+		}
+
+		first += piece;
+		count -= piece;
 	}
 }
 
+// adds the newly read frame to the repair frames of the current block
+void fec_add_frame(struct sender *s, struct window_slot *slot)
+{
+	if (0 == s->fec_count)
+		s->fec_start = slot->seq;
+
+	for (int j = 0; j < s->fec_k; j++)
+		fec_encode(s->repair[j] + FRAME_HEADER_SIZE, j, s->fec_count, s->fec_k, slot->buf + 4);
+
+	s->fec_count++;
+}
 
-void do_client(int fd, struct sockaddr_in addr, int file)
+// sends the repair frames of the current block and starts the next one,
+// they are sent only once and don't take place in the window - a lost
+// repair frame is simply not needed if the data frames arrive
+void fec_send_repair(struct sender *s)
 {
-	char buf[MAXBUF];
-	char buf2[MAXBUF];
-	int offset = 2 * sizeof(int32_t);
+	struct iovec iov[FEC_MAX_K];
+
+	for (int j = 0; j < s->fec_k; j++) {
+		char *buf = s->repair[j];
+
+		frame_pack(buf, s->fec_start, FRAME_REPAIR | (s->fec_n << 8), 0, s->xid);
+		buf[6] = (char)s->fec_count;
+		buf[7] = (char)((s->fec_k << 4) | j);
+		frame_seal(buf, REPAIR_SIZE);
+
+		iov[j].iov_base = buf;
+		iov[j].iov_len = REPAIR_SIZE;
+	}
+
+	if (UDP_send_segments(s->fd, &s->addr, iov, s->fec_k) < s->fec_k)
+		ERR("sendto:");
+
+	for (int j = 0; j < s->fec_k; j++)
+		memset(s->repair[j] + FRAME_HEADER_SIZE, 0, FEC_SYMBOL_SIZE);
+
+	s->stats.repair_frames += s->fec_k;
+	s->fec_count = 0;
+}
 
-	int32_t chunkNo = 0;
-	int32_t last = 0;
+// reads new frames from the file and sends them as long as there is a free
+// place in the congestion window, returns number of sent frames
+int fill_window(struct sender *s, int file)
+{
+	int sent = 0, batch = 0;
+	uint32_t first = s->next_seq;
 	ssize_t size;
 
-	int counter;
-	do {
+	while (!s->eof && s->next_seq < s->base + cc_window(&s->cc, s->window) && s->next_seq < s->rwnd_edge) {
+		struct window_slot *slot = &s->slots[s->next_seq % s->window];
+		uint16_t flags = 0;
+
 		// read data to send in the current datagram
-		if ((size = bulk_read(file, buf + offset, MAXBUF - offset)) < 0)
+		if ((size = bulk_read(file, slot->buf + FRAME_HEADER_SIZE, FRAME_PAYLOAD_SIZE)) < 0)
 			ERR("read from file:");
 
-		// set datagram index
-		*((int32_t *)buf) = htonl(++chunkNo);
+		// the file has ended, this is the last frame (it may be empty)
+		if (size < FRAME_PAYLOAD_SIZE) {
+			flags |= FRAME_LAST;
+			memset(slot->buf + FRAME_HEADER_SIZE + size, 0, FRAME_PAYLOAD_SIZE - size);
+			s->eof = 1;
+		}
+
+		// the receiver has to know the block size to find the block of the frame
+		if (s->fec_k)
+			flags |= FRAME_FEC | (s->fec_n << 8);
+
+		frame_pack(slot->buf, s->next_seq, flags, (uint16_t)size, s->xid);
+		frame_seal(slot->buf, MAXBUF);
+		slot->seq = s->next_seq;
+		slot->acked = 0;
+		slot->attempts = 0;
+		slot->fast_retransmitted = 0;
+		s->next_seq++;
+
+		s->stats.frames++;
+		s->stats.bytes += size;
+		batch++;
+		sent++;
+
+		if (s->fec_k) {
+			fec_add_frame(s, slot);
+			// repair frames have to follow the data frames of their block
+			if (s->fec_count == s->fec_n || s->eof) {
+				send_new_frames(s, first, batch);
+				fec_send_repair(s);
+				first = s->next_seq;
+				batch = 0;
+			}
+		}
+	}
+
+	send_new_frames(s, first, batch);
+
+	return sent;
+}
+
+// marks the frame as acknowledged, returns 1 if it wasn't acknowledged before
+int mark_acked(struct sender *s, uint32_t seq, int64_t *newest_sent)
+{
+	if (seq < s->base || seq >= s->next_seq)
+		return 0;
+
+	struct window_slot *slot = &s->slots[seq % s->window];
+	if (slot->acked)
+		return 0;
+
+	slot->acked = 1;
 
-		// set last frame bool value
-		if (size < MAXBUF - offset) {
-			last = 1;
-			memset(buf + offset + size, 0, MAXBUF - offset - size);
+	// Karn's rule - the ack of a retransmitted frame may refer to any of
+	// its copies, so only frames sent once can be measured
+	if (1 == slot->attempts && slot->sent_us > *newest_sent)
+		*newest_sent = slot->sent_us;
+
+	return 1;
+}
+
+void handle_ack(struct sender *s, char *buf, size_t size)
+{
+	struct ack_frame ack;
+	int newly_acked = 0;
+	int64_t now = monotonic_us(), newest_sent = 0;
+
+	// a damaged acknowledgement is the same as a lost one
+	if (ack_unpack(buf, size, &ack) < 0) {
+		s->stats.corrupted++;
+		return;
+	}
+	// a late one of an earlier transfer from the same port
+	if (ack.xid != s->xid)
+		return;
+
+	// cumulative ack, everything up to cum has been delivered
+	for (uint32_t i = s->base; i <= ack.cum && i < s->next_seq; i++)
+		newly_acked += mark_acked(s, i, &newest_sent);
+
+	// selective ack, only the frames in flight are looked at
+	for (int i = 0; i < ack.blocks; i++) {
+		uint32_t start = ack.sack[i].start > s->base ? ack.sack[i].start : s->base;
+		uint32_t end = ack.sack[i].end < s->next_seq ? ack.sack[i].end : s->next_seq;
+
+		for (uint32_t seq = start; seq < end; seq++)
+			newly_acked += mark_acked(s, seq, &newest_sent);
+		if (start < end && end - 1 > s->highest_acked)
+			s->highest_acked = end - 1;
+	}
+
+	// the acknowledgement may be delayed, so the most recently sent frame
+	// gives the closest estimation of the round-trip time
+	if (newest_sent > 0) {
+		int64_t rtt = now - newest_sent;
+		rto_sample(&s->rto, rtt);
+		if (s->stats.min_rtt_us == 0 || rtt < s->stats.min_rtt_us)
+			s->stats.min_rtt_us = rtt;
+	}
+
+	// the receiver limits the window too (0 means it has everything)
+	if (ack.rwnd > 0)
+		s->rwnd_edge = ack.cum + 1 + ack.rwnd;
+
+	cc_on_ack(&s->cc, newly_acked, s->window);
+
+	// slide the window
+	while (s->base < s->next_seq && s->slots[s->base % s->window].acked)
+		s->base++;
+
+	// frames left behind by DUPACK_THRESHOLD acknowledged ones are most
+	// likely lost, they are retransmitted at once (once per frame)
+	for (uint32_t i = s->base; i + DUPACK_THRESHOLD <= s->highest_acked; i++) {
+		struct window_slot *slot = &s->slots[i % s->window];
+		if (slot->acked || slot->fast_retransmitted)
+			continue;
+
+		cc_on_loss(&s->cc, i, s->next_seq, 0);
+		slot->fast_retransmitted = 1;
+		s->stats.fast_retransmits++;
+		send_frame(s, slot);
+	}
+}
+
+// retransmits frames whose timeout has expired, returns -1 if some frame
+// has been sent MAX_ATTEMPTS times without the confirmation
+int retransmit_expired(struct sender *s)
+{
+	int64_t now = monotonic_us();
+	int expired = 0;
+
+	for (uint32_t i = s->base; i < s->next_seq; i++) {
+		struct window_slot *slot = &s->slots[i % s->window];
+		if (slot->acked || now - slot->sent_us < s->rto.rto)
+			continue;
+
+		if (slot->attempts >= MAX_ATTEMPTS)
+			return -1;
+
+		cc_on_loss(&s->cc, i, s->next_seq, 1);
+		s->stats.timeouts++;
+		send_frame(s, slot);
+		expired++;
+	}
+
+	// one backoff per expiration, not per frame
+	if (expired)
+		rto_backoff(&s->rto);
+
+	return 0;
+}
+
+// returns time (in microseconds) until the earliest retransmission
+int64_t next_timeout(struct sender *s)
+{
+	int64_t now = monotonic_us(), timeout = s->rto.rto;
+
+	for (uint32_t i = s->base; i < s->next_seq; i++) {
+		struct window_slot *slot = &s->slots[i % s->window];
+		if (slot->acked)
+			continue;
+
+		int64_t left = slot->sent_us + s->rto.rto - now;
+		if (left < timeout)
+			timeout = left;
+	}
+
+	return timeout < 0 ? 0 : timeout;
+}
+
+void do_client(int fd, struct sockaddr_in addr, int file, int window, int fec_n, int fec_k)
+{
+	char buf[MAXBUF];
+	struct sender *s;
+
+	// the window is too big to be kept on the stack comfortably
+	if ((s = (struct sender *)calloc(1, sizeof(struct sender))) == NULL)
+		ERR("calloc:");
+	if ((s->slots = (struct window_slot *)calloc(window, sizeof(struct window_slot))) == NULL)
+		ERR("calloc:");
+
+	s->fd = fd;
+	s->addr = addr;
+	s->window = window;
+	// until the first acknowledgement the receiver is assumed to take the whole window
+	s->rwnd_edge = 1 + window;
+	s->base = 1;
+	s->next_seq = 1;
+	s->fec_n = fec_n;
+	s->fec_k = fec_k;
+	if (getrandom(&s->xid, sizeof(uint32_t), 0) != sizeof(uint32_t))
+		ERR("getrandom:");
+	rto_init(&s->rto, INITIAL_RTO_US, MIN_RTO_US, MAX_RTO_US);
+	cc_init(&s->cc, window);
+	s->stats.start_us = monotonic_us();
+
+	fd_set base_rfds;
+	FD_ZERO(&base_rfds);
+	FD_SET(fd, &base_rfds);
+
+	// the transfer ends when the last frame has been read and every frame is acknowledged
+	while (!s->eof || s->base < s->next_seq) {
+		fill_window(s, file);
+
+		if (s->base == s->next_seq)
+			continue;
+
+		// wait for the acknowledgement or the earliest timeout
+		int64_t timeout = next_timeout(s);
+		struct timeval tv;
+		tv.tv_sec = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+
+		fd_set rfds = base_rfds;
+		int ready = select(fd + 1, &rfds, NULL, NULL, &tv);
+		if (ready < 0 && EINTR != errno)
+			ERR("select:");
+
+		if (ready > 0) {
+			// drain every acknowledgement that is already waiting
+			ssize_t size;
+			while ((size = recv(fd, buf, MAXBUF, MSG_DONTWAIT)) >= 0)
+				handle_ack(s, buf, size);
+
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+				ERR("recv:");
 		}
-		*(((int32_t *)buf) + 1) = htonl(last);
-
-		// prepare buf2 for confirming frame
-		memset(buf2, 0, MAXBUF);
-		counter = 0;
-		
-		// five attempts to send and get confirmation frame
-		do {
-			counter++;
-			send_and_confirm(fd, addr, buf, buf2, MAXBUF);
-		} while (*((int32_t *)buf2) != htonl(chunkNo) && counter <= 5);
-
-		// if after 5 tries confirmation frame wasn't received - break
-		if (*((int32_t *)buf2) != htonl(chunkNo) && counter > 5) {
-			printf("[CLIENT] After five attempts I didn't receive a confirmation frame\n");
+
+		if (retransmit_expired(s) < 0) {
+			printf("[CLIENT] After %d attempts I didn't receive a confirmation frame\n", MAX_ATTEMPTS);
 			break;
 		}
-	} while (size == MAXBUF - offset);
+	}
+
+	s->stats.end_us = monotonic_us();
+	s->stats.srtt_us = s->rto.srtt;
+	s->stats.rttvar_us = s->rto.rttvar;
+	s->stats.rto_us = s->rto.rto;
+
+	fprintf(stderr, "[CLIENT] ");
+	stats_print(stderr, &s->stats);
+
+	free(s->slots);
+	free(s);
 }
 
 void usage(char *name)
 {
-	fprintf(stderr, "USAGE: %s domain port file \n", name);
+	fprintf(stderr, "USAGE: %s domain port file [window [n k]]\n", name);
+	fprintf(stderr, "1 <= window <= %d, default %d\n", MAX_WINDOW, DEFAULT_WINDOW);
+	fprintf(stderr, "n k - send k repair frames after every n data frames, 1 <= n <= %d, 1 <= k <= %d\n",
+			FEC_MAX_N, FEC_MAX_K);
 }
-
-void sigalrm_handler(int sig)
-{
-	last_signal = sig;
-}
\ No newline at end of file
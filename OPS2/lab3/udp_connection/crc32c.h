@@ -0,0 +1,16 @@
+#ifndef CRC32C_H_
+#define CRC32C_H_
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli, reflected polynomial 0x82f63b78), the same checksum
+// as computed by the crc32 instruction of SSE 4.2, the instruction is used
+// when the CPU has it, slice-by-8 tables otherwise
+
+// prepares the tables and checks the CPU, has to be called before crc32c
+void crc32c_init(void);
+
+// continues the crc over len bytes of buf, start with crc = 0
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
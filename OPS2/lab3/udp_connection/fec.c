@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include "fec.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86 1
+#endif
+
+// GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and the generator 2,
+// exp table is doubled so the sum of two logarithms never has to be reduced
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+// pshufb is checked at runtime, so the program runs on every x86 CPU
+// and doesn't need any -m flags
+static int use_ssse3 = 0;
+
+void fec_init(void)
+{
+	int x = 1;
+
+	for (int i = 0; i < 255; i++) {
+		gf_exp[i] = (uint8_t)x;
+		gf_log[x] = (uint8_t)i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	for (int i = 255; i < 512; i++)
+		gf_exp[i] = gf_exp[i - 255];
+
+#ifdef FEC_X86
+	use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (0 == a || 0 == b)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+uint8_t fec_coef(int j, int i, int k)
+{
+	if (1 == k)
+		return 1;
+
+	// Cauchy matrix 1 / (x_j + y_i) with x_j = j and y_i = FEC_MAX_K + i,
+	// both sets are disjoint, so the sum (xor) is never 0
+	return gf_inv((uint8_t)(j ^ (FEC_MAX_K + i)));
+}
+
+static void xor_region(char *dst, const char *src, int len)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+	}
+#endif
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, dst + i, sizeof(uint64_t));
+		memcpy(&b, src + i, sizeof(uint64_t));
+		a ^= b;
+		memcpy(dst + i, &a, sizeof(uint64_t));
+	}
+
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+#ifdef FEC_X86
+// c * s = c * (s & 0x0f) + c * (s & 0xf0), both products are looked up in
+// 16-byte tables with pshufb, 16 bytes at once, returns the number of done bytes
+__attribute__((target("ssse3")))
+static int mul_add_ssse3(char *dst, const char *src, uint8_t c, int len)
+{
+	uint8_t lo[16], hi[16];
+	int i = 0;
+
+	for (int x = 0; x < 16; x++) {
+		lo[x] = gf_mul(c, (uint8_t)x);
+		hi[x] = gf_mul(c, (uint8_t)(x << 4));
+	}
+
+	__m128i table_lo = _mm_loadu_si128((const __m128i *)lo);
+	__m128i table_hi = _mm_loadu_si128((const __m128i *)hi);
+	__m128i mask = _mm_set1_epi8(0x0f);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+	}
+
+	return i;
+}
+#endif
+
+void fec_mul_add(char *dst, const char *src, uint8_t c, int len)
+{
+	int i = 0;
+
+	if (0 == c)
+		return;
+
+	if (1 == c) {
+		xor_region(dst, src, len);
+		return;
+	}
+
+#ifdef FEC_X86
+	if (use_ssse3)
+		i = mul_add_ssse3(dst, src, c, len);
+#endif
+
+	// scalar version (and the tail of the vector one)
+	int log_c = gf_log[c];
+	for (; i < len; i++) {
+		uint8_t s = (uint8_t)src[i];
+		if (s)
+			dst[i] ^= gf_exp[log_c + gf_log[s]];
+	}
+}
+
+void fec_encode(char *repair, int j, int i, int k, const char *symbol)
+{
+	fec_mul_add(repair, symbol, fec_coef(j, i, k), FEC_SYMBOL_SIZE);
+}
+
+void fec_block_reset(struct fec_block *b, uint32_t start, int n)
+{
+	b->start = start;
+	b->n = n;
+	b->k = 0;
+	b->complete = 0;
+	b->have = 0;
+	b->repair_have = 0;
+}
+
+void fec_block_add_data(struct fec_block *b, int i, const char *symbol)
+{
+	if (b->complete || i >= FEC_MAX_N || (b->have & (1U << i)))
+		return;
+
+	memcpy(b->data[i], symbol, FEC_SYMBOL_SIZE);
+	b->have |= 1U << i;
+}
+
+void fec_block_add_repair(struct fec_block *b, int j, int k, int n, const char *symbol)
+{
+	if (b->complete || j >= k || k > FEC_MAX_K || n < 1 || n > FEC_MAX_N || (b->repair_have & (1U << j)))
+		return;
+
+	// the repair frame knows the real size of the last (shorter) block
+	b->n = n;
+	b->k = k;
+	memcpy(b->repair[j], symbol, FEC_SYMBOL_SIZE);
+	b->repair_have |= 1U << j;
+}
+
+// inverts the r x r matrix in place with Gauss-Jordan elimination,
+// returns -1 if it is singular
+static int invert(uint8_t m[FEC_MAX_K][FEC_MAX_K], int r)
+{
+	uint8_t aug[FEC_MAX_K][2 * FEC_MAX_K];
+
+	for (int a = 0; a < r; a++) {
+		for (int b = 0; b < r; b++) {
+			aug[a][b] = m[a][b];
+			aug[a][r + b] = a == b;
+		}
+	}
+
+	for (int col = 0; col < r; col++) {
+		int pivot = col;
+		while (pivot < r && 0 == aug[pivot][col])
+			pivot++;
+		if (pivot == r)
+			return -1;
+
+		if (pivot != col) {
+			for (int b = 0; b < 2 * r; b++) {
+				uint8_t t = aug[col][b];
+				aug[col][b] = aug[pivot][b];
+				aug[pivot][b] = t;
+			}
+		}
+
+		uint8_t inv = gf_inv(aug[col][col]);
+		for (int b = 0; b < 2 * r; b++)
+			aug[col][b] = gf_mul(aug[col][b], inv);
+
+		for (int a = 0; a < r; a++) {
+			if (a == col || 0 == aug[a][col])
+				continue;
+			uint8_t f = aug[a][col];
+			for (int b = 0; b < 2 * r; b++)
+				aug[a][b] ^= gf_mul(f, aug[col][b]);
+		}
+	}
+
+	for (int a = 0; a < r; a++)
+		for (int b = 0; b < r; b++)
+			m[a][b] = aug[a][r + b];
+
+	return 0;
+}
+
+uint32_t fec_block_decode(struct fec_block *b)
+{
+	int missing[FEC_MAX_K], rows[FEC_MAX_K];
+	int r = 0, available = 0;
+	char syndrome[FEC_MAX_K][FEC_SYMBOL_SIZE];
+	uint8_t m[FEC_MAX_K][FEC_MAX_K];
+
+	if (b->complete || 0 == b->k)
+		return 0;
+
+	for (int i = 0; i < b->n; i++) {
+		if (b->have & (1U << i))
+			continue;
+		// more frames are lost than the code can recover
+		if (r == b->k)
+			return 0;
+		missing[r++] = i;
+	}
+
+	if (0 == r) {
+		b->complete = 1;
+		return 0;
+	}
+
+	for (int j = 0; j < b->k && available < r; j++)
+		if (b->repair_have & (1U << j))
+			rows[available++] = j;
+
+	// not enough repair frames yet
+	if (available < r)
+		return 0;
+
+	// remove known data frames from the repair symbols,
+	// what is left depends only on the missing ones
+	for (int a = 0; a < r; a++) {
+		memcpy(syndrome[a], b->repair[rows[a]], FEC_SYMBOL_SIZE);
+		for (int i = 0; i < b->n; i++)
+			if (b->have & (1U << i))
+				fec_mul_add(syndrome[a], b->data[i], fec_coef(rows[a], i, b->k), FEC_SYMBOL_SIZE);
+
+		for (int c = 0; c < r; c++)
+			m[a][c] = fec_coef(rows[a], missing[c], b->k);
+	}
+
+	if (invert(m, r) < 0)
+		return 0;
+
+	uint32_t recovered = 0;
+	for (int c = 0; c < r; c++) {
+		char *dst = b->data[missing[c]];
+		memset(dst, 0, FEC_SYMBOL_SIZE);
+		for (int a = 0; a < r; a++)
+			fec_mul_add(dst, syndrome[a], m[c][a], FEC_SYMBOL_SIZE);
+
+		b->have |= 1U << missing[c];
+		recovered |= 1U << missing[c];
+	}
+
+	b->complete = 1;
+	return recovered;
+}
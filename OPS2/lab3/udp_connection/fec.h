@@ -0,0 +1,67 @@
+#ifndef FEC_H_
+#define FEC_H_
+#include "transfer.h"
+#include <stdint.h>
+
+// forward error correction over GF(256)
+//
+// every block of n data frames is followed by k repair frames, repair j is
+// sum over i of c(j, i) * D_i where D_i is everything after the seq field of
+// the i-th data frame of the block (FEC_SYMBOL_SIZE bytes), so any k lost
+// frames of the block can be recovered without a round trip
+//
+// for k = 1 every coefficient is 1 and the repair frame is a plain XOR of the
+// data frames, for k > 1 coefficients form a Cauchy matrix, every square
+// submatrix of which is invertible
+
+#define FEC_MAX_N 32
+#define FEC_MAX_K 8
+
+// number of blocks the receiver decodes at the same time - a window of
+// frames may touch every block it covers and a partial one at each end
+#define FEC_BLOCKS(window, n) ((window) / (n) + 2)
+// a decoder takes about 23 KB, so a big window doesn't get one per block,
+// the decoder of an older block is taken over by a newer one
+#define FEC_MAX_BLOCKS 66
+
+// decoding state of one block
+struct fec_block {
+	// the first frame of the block, 0 means the block is unused
+	uint32_t start;
+	// number of data frames, the last block of the file may be shorter
+	int n;
+	// number of repair frames (0 until the first of them arrives)
+	int k;
+	// every data frame of the block is known
+	int complete;
+	// received data and repair symbols
+	uint32_t have;
+	uint32_t repair_have;
+	char data[FEC_MAX_N][FEC_SYMBOL_SIZE];
+	char repair[FEC_MAX_K][FEC_SYMBOL_SIZE];
+};
+
+// prepares GF(256) tables, has to be called before any other function
+void fec_init(void);
+
+uint8_t fec_coef(int j, int i, int k);
+
+// dst ^= c * src on len bytes, the hot loop of both coding and decoding
+void fec_mul_add(char *dst, const char *src, uint8_t c, int len);
+
+// adds the i-th data symbol to the j-th repair symbol of the block being encoded
+void fec_encode(char *repair, int j, int i, int k, const char *symbol);
+
+void fec_block_reset(struct fec_block *b, uint32_t start, int n);
+
+// stores the symbol of data frame i (if it isn't known yet)
+void fec_block_add_data(struct fec_block *b, int i, const char *symbol);
+
+// stores the repair symbol j, n and k come from the repair frame
+void fec_block_add_repair(struct fec_block *b, int j, int k, int n, const char *symbol);
+
+// recovers missing data symbols if enough repair symbols have been received,
+// returns the bitmap of recovered data frames (0 if nothing could be done)
+uint32_t fec_block_decode(struct fec_block *b);
+
+#endif
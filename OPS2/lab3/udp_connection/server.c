@@ -1,5 +1,10 @@
 #define _GNU_SOURCE
 #include "../library/mysocklib.h"
+#include "crc32c.h"
+#include "fec.h"
+#include "session.h"
+#include "transfer.h"
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -8,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -15,32 +21,90 @@
 #include <unistd.h>
 
 #define BACKLOG 3
-#define MAXBUF 576
-#define MAXADDR 5
+// number of transfers served at the same time
+#define MAX_SESSIONS 131072
+// size of the receive buffer, the largest group of datagrams coalesced by GRO
+#define GRO_BUF_SIZE 65536
+// sessions without any datagram for that long are evicted
+#define IDLE_TIMEOUT_US (30 * 1000000LL)
+// receive buffer asked for per frame of the window, the kernel charges a
+// datagram with its bookkeeping too, so it's more than MAXBUF
+#define RCVBUF_PER_FRAME 2048
+
+// results of receive_frame
+#define FRAME_DROP 0
+#define FRAME_ACK_LATER 1
+#define FRAME_ACK_NOW 2
 
 volatile sig_atomic_t do_work = 1;
 
-// represents connection data with one client
-struct connections {
-	// indicates if the place for the client is free
-	int free;
-	int32_t chunkNo;
-	struct sockaddr_in addr;
+// session waiting for the delayed acknowledgement
+struct pending_ack {
+	int32_t id;
+	int64_t deadline_us;
+};
+
+struct server {
+	int fd;
+	struct session_table table;
+
+	// the delay is the same for every session, so the queue is ordered by deadlines
+	struct pending_ack *pending;
+	int32_t pending_head;
+	int32_t pending_count;
+
+	int ack_every;
+	int64_t ack_delay_us;
+	// slots of the reassembly buffer of a session
+	int window;
+
+	// statistics printed at the end
+	uint64_t frames;
+	uint64_t acks;
+	uint64_t recovered;
+	uint64_t corrupted;
 };
 
 void usage(char *name);
 void sigint_handler(int sig);
-int find_index(struct sockaddr_in addr, struct connections con[MAXADDR]);
-void do_server(int fd);
+void deliver(uint32_t seq, uint16_t flags, uint16_t len, char *payload);
+int receive_frame(struct session *s, char *buf, int window);
+int send_ack(struct server *srv, struct session *s);
+void schedule_ack(struct server *srv, struct session *s, int64_t now);
+void flush_acks(struct server *srv, int64_t now);
+int accept_frame(struct server *srv, struct session *s, char *buf, int64_t now);
+struct fec_block *fec_find_block(struct session *s, uint32_t start, int n, int window);
+void fec_receive(struct server *srv, struct session *s, char *buf, int64_t now);
+void serve_datagram(struct server *srv, char *buf, ssize_t size, struct sockaddr_in *addr, int64_t now);
+void do_server(int fd, int ack_every, int64_t ack_delay_us, int window);
 
 int main(int argc, char** argv)
 {
-	int fd;
-	if (argc != 2) {
+	int fd, ack_every = ACK_EVERY, window = DEFAULT_RECV_WINDOW;
+	int64_t ack_delay_us = ACK_DELAY_US;
+
+	if (argc != 2 && argc != 4 && argc != 5) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	if (argc >= 4) {
+		ack_every = atoi(argv[2]);
+		ack_delay_us = atoll(argv[3]);
+		if (ack_every < 1 || ack_delay_us < 0) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc == 5) {
+		window = atoi(argv[4]);
+		if (window < 1 || window > MAX_WINDOW) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (sethandler(SIG_IGN, SIGPIPE))
 		ERR("Seting SIGPIPE:");
 	
@@ -48,9 +112,11 @@ int main(int argc, char** argv)
 		ERR("Seting SIGINT:");
 
 	fd = UDP_IPv4_bind_socket(atoi(argv[1]));
+	fec_init();
+	crc32c_init();
 
 	do_work = 1;
-	do_server(fd);
+	do_server(fd, ack_every, ack_delay_us, window);
 
 	if (TEMP_FAILURE_RETRY(close(fd)) < 0)
 		ERR("close");
@@ -60,91 +126,399 @@ int main(int argc, char** argv)
 	return EXIT_SUCCESS;
 }
 
-int find_index(struct sockaddr_in addr, struct connections con[MAXADDR])
+void deliver(uint32_t seq, uint16_t flags, uint16_t len, char *payload)
+{
+	if (flags & FRAME_LAST)
+		printf("Last Part %u\n%.*s\n", seq, (int)len, payload);
+	else
+		printf("Part %u\n%.*s\n", seq, (int)len, payload);
+}
+
+// delivers the frame or stores it in the reassembly buffer and delivers every
+// frame that is now in order, returns FRAME_DROP if the frame should be
+// dropped, FRAME_ACK_LATER if the acknowledgement may be delayed and
+// FRAME_ACK_NOW otherwise
+int receive_frame(struct session *s, char *buf, int window)
+{
+	struct frame_header hdr;
+	frame_unpack(buf, &hdr);
+
+	// a duplicate of already delivered frame - the ack was probably lost
+	if (hdr.seq < s->expected)
+		return FRAME_ACK_NOW;
+
+	// the frame does not fit in the window - skip
+	if (s->done || hdr.seq >= s->expected + window || hdr.len > FRAME_PAYLOAD_SIZE)
+		return FRAME_DROP;
+
+	// the frame is in order and nothing waits in the buffer - deliver it directly
+	if (hdr.seq == s->expected && NULL == s->slots) {
+		deliver(hdr.seq, hdr.flags, hdr.len, buf + FRAME_HEADER_SIZE);
+		s->expected++;
+		s->done = hdr.flags & FRAME_LAST;
+		return s->done ? FRAME_ACK_NOW : FRAME_ACK_LATER;
+	}
+
+	// the buffer is allocated only for sessions which actually receive
+	// frames out of order
+	if (NULL == s->slots && (s->slots = (struct reorder_slot *)calloc(window, sizeof(struct reorder_slot))) == NULL)
+		ERR("calloc:");
+
+	struct reorder_slot *slot = &s->slots[hdr.seq % window];
+	if (!slot->used) {
+		slot->used = 1;
+		slot->seq = hdr.seq;
+		slot->flags = hdr.flags;
+		slot->len = hdr.len;
+		memcpy(slot->payload, buf + FRAME_HEADER_SIZE, hdr.len);
+		s->buffered++;
+		if (hdr.seq > s->highest)
+			s->highest = hdr.seq;
+	}
+
+	// deliver contiguous frames starting from the expected one
+	slot = &s->slots[s->expected % window];
+	while (slot->used && slot->seq == s->expected) {
+		deliver(slot->seq, slot->flags, slot->len, slot->payload);
+		slot->used = 0;
+		s->buffered--;
+		s->expected++;
+
+		if (slot->flags & FRAME_LAST) {
+			// the session stays in the table until it is idle, so duplicates
+			// of the last frame are still acknowledged
+			s->done = 1;
+			free(s->slots);
+			s->slots = NULL;
+			s->buffered = 0;
+			break;
+		}
+		slot = &s->slots[s->expected % window];
+	}
+
+	// the sender has to learn about the gap (or its filling) immediately
+	return FRAME_ACK_NOW;
+}
+
+// acknowledges every frame received by the session so far,
+// returns -1 if the session has been removed
+int send_ack(struct server *srv, struct session *s)
+{
+	struct ack_frame ack;
+	char buf[ACK_MAX_SIZE];
+
+	ack.cum = s->expected - 1;
+	// the frames waiting for a gap take places of the window
+	ack.rwnd = s->done ? 0 : srv->window - s->buffered;
+	ack.xid = s->xid;
+	ack.flags = 0;
+	ack.blocks = 0;
+
+	// runs of received frames between the expected one and the highest one
+	// buffered, the lowest ones tell the sender about the oldest gaps
+	if (s->slots) {
+		struct sack_block *block = NULL;
+		for (uint32_t seq = s->expected + 1; seq <= s->highest; seq++) {
+			struct reorder_slot *slot = &s->slots[seq % srv->window];
+			if (!(slot->used && slot->seq == seq)) {
+				block = NULL;
+				continue;
+			}
+			if (NULL == block) {
+				if (ACK_MAX_BLOCKS == ack.blocks)
+					break;
+				block = &ack.sack[ack.blocks++];
+				block->start = seq;
+			}
+			block->end = seq + 1;
+		}
+	}
+
+	s->unacked = 0;
+	size_t size = ack_pack(buf, &ack);
+
+	if (TEMP_FAILURE_RETRY(sendto(srv->fd, buf, size, 0, &s->addr, sizeof(s->addr))) < 0) {
+		// if the client is no longer active EPIPE will be received,
+		// the server will free the session occupied by this client
+		if (EPIPE != errno)
+			ERR("send:");
+
+		session_remove(&srv->table, s);
+		return -1;
+	}
+
+	srv->acks++;
+	return 0;
+}
+
+// the acknowledgement of the first frame after the last one sent is delayed,
+// the next frames will be acknowledged together with it
+void schedule_ack(struct server *srv, struct session *s, int64_t now)
+{
+	// the queue is full - don't delay
+	if (srv->pending_count == MAX_SESSIONS) {
+		send_ack(srv, s);
+		return;
+	}
+
+	s->ack_deadline_us = now + srv->ack_delay_us;
+
+	struct pending_ack *p = &srv->pending[(srv->pending_head + srv->pending_count) % MAX_SESSIONS];
+	p->id = (int32_t)(s - srv->table.pool);
+	p->deadline_us = s->ack_deadline_us;
+	srv->pending_count++;
+}
+
+// sends the delayed acknowledgements whose deadline has passed
+void flush_acks(struct server *srv, int64_t now)
 {
-	int empty = -1, pos = -1;
-	for (int i = 0; i < MAXADDR; i++) {
-		if (con[i].free) {
-			empty = i;
-		} else if (0 == memcmp(&addr, &(con[i].addr), sizeof(struct sockaddr_in))) {
-			pos = i;
+	while (srv->pending_count > 0) {
+		struct pending_ack *p = &srv->pending[srv->pending_head];
+		if (p->deadline_us > now)
 			break;
+
+		srv->pending_head = (srv->pending_head + 1) % MAX_SESSIONS;
+		srv->pending_count--;
+
+		// the session might have been acknowledged (or removed) in the meantime
+		struct session *s = &srv->table.pool[p->id];
+		if (s->unacked > 0 && s->ack_deadline_us == p->deadline_us)
+			send_ack(srv, s);
+	}
+}
+
+// passes the data frame to the session and acknowledges it when it's time,
+// returns -1 if the session has been removed
+int accept_frame(struct server *srv, struct session *s, char *buf, int64_t now)
+{
+	int result = receive_frame(s, buf, srv->window);
+	if (FRAME_DROP == result)
+		return 0;
+
+	s->unacked++;
+	if (FRAME_ACK_NOW == result || s->unacked >= srv->ack_every)
+		return send_ack(srv, s);
+
+	if (1 == s->unacked)
+		schedule_ack(srv, s, now);
+
+	return 0;
+}
+
+// returns the decoder of the block, the place used by an older block is
+// taken over, NULL means the block is older than the ones being decoded
+struct fec_block *fec_find_block(struct session *s, uint32_t start, int n, int window)
+{
+	// the server accepts up to window frames ahead, so the number of blocks
+	// being decoded depends on their size, up to FEC_MAX_BLOCKS of them
+	if (NULL == s->fec) {
+		s->fec_blocks = FEC_BLOCKS(window, n);
+		if (s->fec_blocks > FEC_MAX_BLOCKS)
+			s->fec_blocks = FEC_MAX_BLOCKS;
+		if ((s->fec = (struct fec_block *)malloc(s->fec_blocks * sizeof(struct fec_block))) == NULL)
+			ERR("malloc:");
+		for (int i = 0; i < s->fec_blocks; i++)
+			s->fec[i].start = 0;
+	}
+
+	struct fec_block *b = &s->fec[((start - 1) / n) % s->fec_blocks];
+	if (b->start != start) {
+		if (b->start > start)
+			return NULL;
+		fec_block_reset(b, start, n);
+	}
+
+	return b;
+}
+
+// keeps the protected (data or repair) frame in the decoder of its block and
+// delivers frames which could be recovered thanks to it
+void fec_receive(struct server *srv, struct session *s, char *buf, int64_t now)
+{
+	struct frame_header hdr;
+	frame_unpack(buf, &hdr);
+
+	int n = FRAME_FEC_N(hdr.flags);
+	if (n < 1 || n > FEC_MAX_N)
+		return;
+
+	uint32_t start = (hdr.flags & FRAME_REPAIR) ? hdr.seq : hdr.seq - (hdr.seq - 1) % n;
+
+	// the whole block has already been delivered
+	if (s->done || start + n <= s->expected)
+		return;
+
+	struct fec_block *b = fec_find_block(s, start, n, srv->window);
+	if (NULL == b)
+		return;
+
+	if (hdr.flags & FRAME_REPAIR) {
+		uint8_t kj = (uint8_t)buf[7];
+		fec_block_add_repair(b, kj & 0x0f, kj >> 4, (uint8_t)buf[6], buf + FRAME_HEADER_SIZE);
+	} else {
+		fec_block_add_data(b, (int)(hdr.seq - start), buf + 4);
+	}
+
+	uint32_t recovered = fec_block_decode(b);
+	for (int i = 0; i < b->n && recovered; i++) {
+		if (!(recovered & (1U << i)))
+			continue;
+
+		// rebuild the whole data frame, seq is the only part that isn't coded
+		char frame[MAXBUF];
+		uint32_t nseq = htonl(start + i);
+		memcpy(frame, &nseq, sizeof(uint32_t));
+		memcpy(frame + 4, b->data[i], FEC_SYMBOL_SIZE);
+
+		// the crc of the original frame is recovered too, so a wrong
+		// decoding (damaged frame in the block) is caught here
+		if (frame_verify(frame, MAXBUF) < 0) {
+			srv->corrupted++;
+			continue;
 		}
+
+		srv->recovered++;
+		if (accept_frame(srv, s, frame, now) < 0)
+			return;
+	}
+}
+
+void serve_datagram(struct server *srv, char *buf, ssize_t size, struct sockaddr_in *addr, int64_t now)
+{
+	struct session *s;
+	struct frame_header hdr;
+
+	if (size < FRAME_HEADER_SIZE)
+		return;
+
+	frame_unpack(buf, &hdr);
+
+	// protected frames have to be complete, otherwise they would break decoding
+	if ((hdr.flags & FRAME_REPAIR) && size != REPAIR_SIZE)
+		return;
+	// so do data frames
+	if (!(hdr.flags & FRAME_REPAIR) && size != MAXBUF)
+		return;
+
+	// a damaged frame is treated as lost - it is neither delivered nor
+	// acknowledged, so the client will send it again
+	if (frame_verify(buf, size) < 0) {
+		srv->corrupted++;
+		return;
 	}
 
-	if (-1 == pos && -1 != empty) {
-		con[empty].free = 0;
-		con[empty].chunkNo = 0;
-		con[empty].addr = addr;
-		pos = empty;
+	// if the table is full, the datagram is ignored and the client will retransmit it
+	if ((s = session_get(&srv->table, addr, hdr.xid, now)) == NULL)
+		return;
+
+	srv->frames++;
+
+	// repair frames are never acknowledged, they only help to recover data frames
+	if (hdr.flags & FRAME_REPAIR) {
+		fec_receive(srv, s, buf, now);
+		return;
 	}
 
-	return pos;
+	if (accept_frame(srv, s, buf, now) < 0)
+		return;
+
+	if (hdr.flags & FRAME_FEC)
+		fec_receive(srv, s, buf, now);
 }
 
-void do_server(int fd)
+void do_server(int fd, int ack_every, int64_t ack_delay_us, int window)
 {
 	struct sockaddr_in addr;
-	struct connections con[MAXADDR];
-	char buf[MAXBUF];
+	struct server srv;
+	char *buf;
+	ssize_t received;
+	int segment_size;
+
+	memset(&srv, 0, sizeof(struct server));
+	srv.fd = fd;
+	srv.ack_every = ack_every;
+	srv.ack_delay_us = ack_delay_us;
+	srv.window = window;
+	session_table_init(&srv.table, MAX_SESSIONS, IDLE_TIMEOUT_US);
 
-	socklen_t size = sizeof(addr);
-	int32_t chunkNo, last;
+	if ((srv.pending = (struct pending_ack *)malloc(MAX_SESSIONS * sizeof(struct pending_ack))) == NULL)
+		ERR("malloc:");
 
-	// initialize
-	for (int i = 0; i < MAXADDR; i++)
-		con[i].free = 1;
+	// with GRO a single read returns many datagrams of one client, so the
+	// buffer has to fit the largest group, without it nothing changes
+	if (UDP_enable_gro(fd) < 0)
+		fprintf(stderr, "UDP_GRO is not supported, datagrams are received one by one\n");
+	if ((buf = (char *)malloc(GRO_BUF_SIZE)) == NULL)
+		ERR("malloc:");
+
+	// a sender may send the whole window at once, the datagrams which don't
+	// fit in the receive buffer are lost, the kernel caps the size at
+	// net.core.rmem_max
+	int rcvbuf = window * RCVBUF_PER_FRAME;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		ERR("setsockopt:");
+
+	fd_set base_rfds;
+	FD_ZERO(&base_rfds);
+	FD_SET(fd, &base_rfds);
 
 	while(do_work) {
-		// get data from the client
-		if (TEMP_FAILURE_RETRY(recvfrom(fd, buf, MAXBUF, 0, &addr, &size) < 0))
-			ERR("read:");
-		
-		int index;
-		// find index of the client in the con array
-		if ((index = find_index(addr, con)) >= 0) {
-
-			// get datagram number and last frame bool 
-			chunkNo = ntohl(*((int32_t *)buf));
-			last = ntohl(*(((int32_t *)buf) + 1));
- 
-			// we expect frames to be received in contiguous maneer 
-			// if currently received frame number is larger than the expected -> skip
-			if (chunkNo > con[index].chunkNo + 1) {
-				continue;
-			} else if (chunkNo == con[index].chunkNo + 1) {
-				// the frame is correct
-
-				if (last) {
-					// if it's the last frame, free the connection container on "index" 
-					printf("Last Part %d\n%s\n", chunkNo, buf + 2 * sizeof(int32_t));
-					con[index].free = 1;
-				} else {
-					// if it's not the last frame, increment the chunkNo
-					printf("Part %d\n%s\n", chunkNo, buf + 2 * sizeof(int32_t));
-					con[index].chunkNo++;
+		// wake up at least once per tick (so idle sessions are evicted even if
+		// no datagram arrives) and for the earliest delayed acknowledgement
+		int64_t now = monotonic_us();
+		int64_t timeout = WHEEL_TICK_US;
+		if (srv.pending_count > 0) {
+			int64_t left = srv.pending[srv.pending_head].deadline_us - now;
+			timeout = left < 0 ? 0 : (left < timeout ? left : timeout);
+		}
+
+		struct timeval tv;
+		tv.tv_sec = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+
+		fd_set rfds = base_rfds;
+		int ready = select(fd + 1, &rfds, NULL, NULL, &tv);
+		// SIGINT interrupts the server
+		if (ready < 0 && EINTR != errno)
+			ERR("select:");
+
+		if (ready > 0) {
+			// get every datagram that is already waiting, a coalesced group
+			// is split back into datagrams of segment_size bytes
+			while ((received = UDP_recv_segments(fd, buf, GRO_BUF_SIZE, MSG_DONTWAIT, &addr, &segment_size)) >= 0) {
+				int64_t now = monotonic_us();
+				for (ssize_t offset = 0; offset < received; offset += segment_size) {
+					ssize_t left = received - offset;
+					serve_datagram(&srv, buf + offset, left < segment_size ? left : segment_size, &addr, now);
 				}
 			}
 
-			// send confirmation frame (confirmation frame is the same as the received one)
-			if (TEMP_FAILURE_RETRY(sendto(fd, buf, MAXBUF, 0, &addr, size)) < 0) {
-				// if the client is no longer active EPIPE will be received, 
-				// the server will free the container occupied by this client
-				if (EPIPE == errno)
-					con[index].free = 1;
-			 	else
-					ERR("send:");
-			}
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+				ERR("read:");
 		}
+
+		now = monotonic_us();
+		flush_acks(&srv, now);
+		session_expire(&srv.table, now);
 	}
+
+	fprintf(stderr, "Frames received: %llu, acknowledgements sent: %llu, frames recovered: %llu, frames corrupted: %llu\n",
+			(unsigned long long)srv.frames, (unsigned long long)srv.acks, (unsigned long long)srv.recovered,
+			(unsigned long long)srv.corrupted);
+
+	free(buf);
+	free(srv.pending);
+	session_table_destroy(&srv.table);
 }
 
 void usage(char *name)
 {
-	fprintf(stderr, "USAGE: %s port\n", name);
+	fprintf(stderr, "USAGE: %s port [ack_every ack_delay_us [window]]\n", name);
+	fprintf(stderr, "defaults: ack_every=%d, ack_delay_us=%d, window=%d (1 <= window <= %d)\n", ACK_EVERY,
+			ACK_DELAY_US, DEFAULT_RECV_WINDOW, MAX_WINDOW);
 }
 
 void sigint_handler(int sig)
 {
 	do_work = 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include "session.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+
+// fibonacci hashing of (address, port), the upper bits are the best mixed ones
+static uint32_t session_hash(struct sockaddr_in *addr)
+{
+	uint64_t key = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static int same_client(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void wheel_link(struct session_table *t, int32_t id)
+{
+	struct session *s = &t->pool[id];
+	int64_t deadline = s->last_active_us + t->idle_timeout_us;
+	int32_t slot = (int32_t)((deadline / WHEEL_TICK_US) % WHEEL_SLOTS);
+
+	s->wheel_slot = slot;
+	s->prev = -1;
+	s->next = t->wheel[slot];
+	if (s->next != -1)
+		t->pool[s->next].prev = id;
+	t->wheel[slot] = id;
+}
+
+static void wheel_unlink(struct session_table *t, int32_t id)
+{
+	struct session *s = &t->pool[id];
+
+	if (s->prev != -1)
+		t->pool[s->prev].next = s->next;
+	else
+		t->wheel[s->wheel_slot] = s->next;
+
+	if (s->next != -1)
+		t->pool[s->next].prev = s->prev;
+}
+
+void session_table_init(struct session_table *t, int32_t capacity, int64_t idle_timeout_us)
+{
+	uint32_t size = 1;
+
+	// keep the load factor of the index at most 0.5
+	while (size < 2 * (uint32_t)capacity)
+		size <<= 1;
+
+	if ((t->pool = (struct session *)malloc(capacity * sizeof(struct session))) == NULL)
+		ERR("malloc:");
+
+	if ((t->index = (int32_t *)malloc(size * sizeof(int32_t))) == NULL)
+		ERR("malloc:");
+
+	t->capacity = capacity;
+	t->count = 0;
+	t->mask = size - 1;
+	t->idle_timeout_us = idle_timeout_us;
+	t->wheel_tick = -1;
+
+	for (uint32_t i = 0; i < size; i++)
+		t->index[i] = -1;
+
+	for (int i = 0; i < WHEEL_SLOTS; i++)
+		t->wheel[i] = -1;
+
+	// every session is free at the beginning
+	for (int32_t i = 0; i < capacity; i++) {
+		t->pool[i].slots = NULL;
+		t->pool[i].fec = NULL;
+		t->pool[i].next = i + 1 < capacity ? i + 1 : -1;
+	}
+	t->free_head = 0;
+}
+
+void session_table_destroy(struct session_table *t)
+{
+	for (int32_t i = 0; i < t->capacity; i++) {
+		free(t->pool[i].slots);
+		free(t->pool[i].fec);
+	}
+
+	free(t->pool);
+	free(t->index);
+}
+
+struct session *session_get(struct session_table *t, struct sockaddr_in *addr, uint32_t xid, int64_t now)
+{
+	uint32_t pos = session_hash(addr) & t->mask;
+	struct session *s;
+
+	while (t->index[pos] != -1) {
+		s = &t->pool[t->index[pos]];
+		if (same_client(addr, &s->addr)) {
+			if (xid != s->xid) {
+				if (xid == s->prev_xid)
+					return NULL;
+				// the client has started a new transfer from the same port,
+				// otherwise its frames would be acknowledged as duplicates
+				session_reset(s);
+				s->prev_xid = s->xid;
+				s->xid = xid;
+			}
+			// the wheel is not updated here, the session will be moved
+			// when its current slot is checked
+			s->last_active_us = now;
+			return s;
+		}
+		pos = (pos + 1) & t->mask;
+	}
+
+	if (t->free_head == -1)
+		return NULL;
+
+	int32_t id = t->free_head;
+	s = &t->pool[id];
+	t->free_head = s->next;
+
+	s->addr = *addr;
+	s->xid = xid;
+	s->prev_xid = xid;
+	s->expected = 1;
+	s->done = 0;
+	s->slots = NULL;
+	s->buffered = 0;
+	s->highest = 0;
+	s->last_active_us = now;
+	s->unacked = 0;
+	s->ack_deadline_us = 0;
+	s->fec = NULL;
+	s->pos = pos;
+	t->index[pos] = id;
+	t->count++;
+
+	wheel_link(t, id);
+
+	return s;
+}
+
+void session_reset(struct session *s)
+{
+	free(s->slots);
+	s->slots = NULL;
+	s->buffered = 0;
+	s->highest = 0;
+	free(s->fec);
+	s->fec = NULL;
+	s->expected = 1;
+	s->done = 0;
+	// a delayed acknowledgement still in the queue is skipped
+	s->unacked = 0;
+}
+
+// removes the session from the index and returns it to the free list,
+// the session has to be already unlinked from the wheel
+static void session_release(struct session_table *t, struct session *s)
+{
+	int32_t id = (int32_t)(s - t->pool);
+	uint32_t hole = s->pos, j = s->pos;
+
+	// backward shift deletion - entries placed after the removed one are
+	// moved back, so probing never stops at the hole too early
+	t->index[hole] = -1;
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (t->index[j] == -1)
+			break;
+
+		uint32_t home = session_hash(&t->pool[t->index[j]].addr) & t->mask;
+
+		// the entry can stay if its home position lies cyclically in (hole, j]
+		if (((j - home) & t->mask) < ((j - hole) & t->mask))
+			continue;
+
+		t->index[hole] = t->index[j];
+		t->pool[t->index[hole]].pos = hole;
+		t->index[j] = -1;
+		hole = j;
+	}
+
+	free(s->slots);
+	s->slots = NULL;
+	free(s->fec);
+	s->fec = NULL;
+	s->unacked = 0;
+
+	s->next = t->free_head;
+	t->free_head = id;
+	t->count--;
+}
+
+void session_remove(struct session_table *t, struct session *s)
+{
+	wheel_unlink(t, (int32_t)(s - t->pool));
+	session_release(t, s);
+}
+
+int session_expire(struct session_table *t, int64_t now)
+{
+	int64_t tick_now = now / WHEEL_TICK_US;
+	int evicted = 0;
+
+	if (t->wheel_tick < 0)
+		t->wheel_tick = tick_now;
+
+	// after a long break every slot is checked only once
+	if (tick_now - t->wheel_tick > WHEEL_SLOTS)
+		t->wheel_tick = tick_now - WHEEL_SLOTS;
+
+	// only ticks which have already passed are processed, so a session
+	// which is still active is always moved to a different slot
+	for (; t->wheel_tick < tick_now; t->wheel_tick++) {
+		int32_t slot = (int32_t)(t->wheel_tick % WHEEL_SLOTS);
+		int32_t id = t->wheel[slot];
+
+		// detach the whole list, active sessions are linked again
+		t->wheel[slot] = -1;
+		while (id != -1) {
+			struct session *s = &t->pool[id];
+			int32_t next = s->next;
+
+			if (s->last_active_us + t->idle_timeout_us <= now) {
+				session_release(t, s);
+				evicted++;
+			} else {
+				wheel_link(t, id);
+			}
+
+			id = next;
+		}
+	}
+
+	return evicted;
+}
@@ -0,0 +1,96 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+#include "fec.h"
+#include "transfer.h"
+#include <netinet/in.h>
+#include <stdint.h>
+
+// number of slots of the timer wheel and the length of one slot,
+// the idle timeout has to be shorter than WHEEL_SLOTS * WHEEL_TICK_US
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_US 1000000
+
+// one place in the reassembly buffer
+struct reorder_slot {
+	int used;
+	uint32_t seq;
+	uint16_t flags;
+	uint16_t len;
+	char payload[FRAME_PAYLOAD_SIZE];
+};
+
+// transfer state of one client, identified by (address, port), a frame with
+// a new transfer id from the same client starts the session again
+struct session {
+	struct sockaddr_in addr;
+	// id of the current transfer and of the one it has replaced, late
+	// frames of that one are ignored instead of starting it again
+	uint32_t xid;
+	uint32_t prev_xid;
+	// the next frame expected in order, every frame before it has been delivered
+	uint32_t expected;
+	// the last frame has been delivered, the session only answers duplicates
+	int done;
+	// frames received out of order, indexed by seq % window of the server,
+	// allocated when the first frame arrives out of order
+	struct reorder_slot *slots;
+	// number of frames in the slots and the highest of them
+	int buffered;
+	uint32_t highest;
+	int64_t last_active_us;
+	// frames received since the last acknowledgement and the time
+	// the delayed acknowledgement has to be sent
+	int unacked;
+	int64_t ack_deadline_us;
+	// decoders of the forward error correction (fec_blocks of them),
+	// allocated when the first protected frame arrives
+	struct fec_block *fec;
+	int fec_blocks;
+	// links of the timer wheel list (or the free list), -1 means none
+	int32_t prev;
+	int32_t next;
+	// slot of the timer wheel the session is linked in
+	int32_t wheel_slot;
+	// position in the hash index
+	uint32_t pos;
+};
+
+struct session_table {
+	// sessions are kept in the pool, the index refers to them by number,
+	// so they never move when the index is reorganized
+	struct session *pool;
+	int32_t capacity;
+	int32_t count;
+	int32_t free_head;
+
+	// open addressing (linear probing) hash index, -1 means empty place
+	int32_t *index;
+	uint32_t mask;
+
+	// hashed timer wheel, every list holds sessions which should be checked
+	// in the given tick, the check is lazy - sessions active in the meantime
+	// are moved further instead of being evicted
+	int32_t wheel[WHEEL_SLOTS];
+	int64_t wheel_tick;
+	int64_t idle_timeout_us;
+};
+
+// allocates the table for up to capacity concurrent sessions
+void session_table_init(struct session_table *t, int32_t capacity, int64_t idle_timeout_us);
+
+void session_table_destroy(struct session_table *t);
+
+// finds the session of the addr or creates a new one for the transfer xid,
+// marks it active, a session of another transfer is reset, returns NULL if
+// the table is full or the frame belongs to the replaced transfer
+struct session *session_get(struct session_table *t, struct sockaddr_in *addr, uint32_t xid, int64_t now);
+
+// forgets the transfer, the session expects frame 1 again
+void session_reset(struct session *s);
+
+void session_remove(struct session_table *t, struct session *s);
+
+// evicts sessions idle for longer than the idle timeout, returns the number of evicted ones
+int session_expire(struct session_table *t, int64_t now);
+
+#endif
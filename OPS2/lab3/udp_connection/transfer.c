@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "crc32c.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+// memcpy is used instead of casting the buf to (uint32_t *), so the
+// unaligned access is never performed
+
+void frame_pack(char *buf, uint32_t seq, uint16_t flags, uint16_t len, uint32_t xid)
+{
+	uint32_t nseq = htonl(seq);
+	uint16_t nflags = htons(flags);
+	uint16_t nlen = htons(len);
+	uint32_t nxid = htonl(xid);
+
+	memcpy(buf, &nseq, sizeof(uint32_t));
+	memcpy(buf + 4, &nflags, sizeof(uint16_t));
+	memcpy(buf + 6, &nlen, sizeof(uint16_t));
+	memcpy(buf + 8, &nxid, sizeof(uint32_t));
+}
+
+void frame_unpack(const char *buf, struct frame_header *hdr)
+{
+	uint32_t nseq, nxid;
+	uint16_t nflags, nlen;
+
+	memcpy(&nseq, buf, sizeof(uint32_t));
+	memcpy(&nflags, buf + 4, sizeof(uint16_t));
+	memcpy(&nlen, buf + 6, sizeof(uint16_t));
+	memcpy(&nxid, buf + 8, sizeof(uint32_t));
+
+	hdr->seq = ntohl(nseq);
+	hdr->flags = ntohs(nflags);
+	hdr->len = ntohs(nlen);
+	hdr->xid = ntohl(nxid);
+}
+
+void frame_seal(char *buf, size_t size)
+{
+	uint32_t ncrc = htonl(crc32c(0, buf, size - FRAME_TRAILER_SIZE));
+	memcpy(buf + size - FRAME_TRAILER_SIZE, &ncrc, sizeof(uint32_t));
+}
+
+int frame_verify(const char *buf, size_t size)
+{
+	uint32_t ncrc;
+
+	if (size < FRAME_HEADER_SIZE + FRAME_TRAILER_SIZE)
+		return -1;
+
+	memcpy(&ncrc, buf + size - FRAME_TRAILER_SIZE, sizeof(uint32_t));
+	return ntohl(ncrc) == crc32c(0, buf, size - FRAME_TRAILER_SIZE) ? 0 : -1;
+}
+
+size_t ack_pack(char *buf, struct ack_frame *ack)
+{
+	uint32_t ncum = htonl(ack->cum);
+	uint32_t nrwnd = htonl(ack->rwnd);
+	uint32_t nxid = htonl(ack->xid);
+	uint16_t nblocks = htons(ack->blocks);
+	uint16_t nflags = htons(ack->flags);
+
+	memcpy(buf, &ncum, sizeof(uint32_t));
+	memcpy(buf + 4, &nrwnd, sizeof(uint32_t));
+	memcpy(buf + 8, &nxid, sizeof(uint32_t));
+	memcpy(buf + 12, &nblocks, sizeof(uint16_t));
+	memcpy(buf + 14, &nflags, sizeof(uint16_t));
+
+	for (int i = 0; i < ack->blocks; i++) {
+		uint32_t nstart = htonl(ack->sack[i].start);
+		uint32_t nend = htonl(ack->sack[i].end);
+		memcpy(buf + ACK_HEADER_SIZE + 8 * i, &nstart, sizeof(uint32_t));
+		memcpy(buf + ACK_HEADER_SIZE + 8 * i + 4, &nend, sizeof(uint32_t));
+	}
+
+	size_t size = ACK_SIZE(ack->blocks);
+	frame_seal(buf, size);
+	return size;
+}
+
+int ack_unpack(const char *buf, size_t size, struct ack_frame *ack)
+{
+	uint32_t ncum, nrwnd, nxid;
+	uint16_t nblocks, nflags;
+
+	if (size < ACK_SIZE(0) || frame_verify(buf, size) < 0)
+		return -1;
+
+	memcpy(&ncum, buf, sizeof(uint32_t));
+	memcpy(&nrwnd, buf + 4, sizeof(uint32_t));
+	memcpy(&nxid, buf + 8, sizeof(uint32_t));
+	memcpy(&nblocks, buf + 12, sizeof(uint16_t));
+	memcpy(&nflags, buf + 14, sizeof(uint16_t));
+
+	ack->cum = ntohl(ncum);
+	ack->rwnd = ntohl(nrwnd);
+	ack->xid = ntohl(nxid);
+	ack->blocks = ntohs(nblocks);
+	ack->flags = ntohs(nflags);
+
+	if (ack->blocks > ACK_MAX_BLOCKS || size != ACK_SIZE(ack->blocks))
+		return -1;
+
+	for (int i = 0; i < ack->blocks; i++) {
+		uint32_t nstart, nend;
+		memcpy(&nstart, buf + ACK_HEADER_SIZE + 8 * i, sizeof(uint32_t));
+		memcpy(&nend, buf + ACK_HEADER_SIZE + 8 * i + 4, sizeof(uint32_t));
+		ack->sack[i].start = ntohl(nstart);
+		ack->sack[i].end = ntohl(nend);
+	}
+
+	return 0;
+}
+
+void cc_init(struct congestion *cc, int max_window)
+{
+	cc->cwnd = max_window < 2 ? max_window : 2;
+	cc->ssthresh = max_window;
+	cc->recover = 0;
+}
+
+void cc_on_ack(struct congestion *cc, int acked, int max_window)
+{
+	for (int i = 0; i < acked; i++) {
+		if (cc->cwnd < cc->ssthresh)
+			cc->cwnd += 1.0;
+		else
+			cc->cwnd += 1.0 / cc->cwnd;
+	}
+
+	// the window never has to be larger than the receiver can buffer
+	if (cc->cwnd > max_window)
+		cc->cwnd = max_window;
+}
+
+void cc_on_loss(struct congestion *cc, uint32_t seq, uint32_t next_seq, int timeout)
+{
+	// react only once per window of data
+	if (seq < cc->recover)
+		return;
+
+	cc->ssthresh = cc->cwnd / 2 < 2 ? 2 : cc->cwnd / 2;
+	cc->cwnd = timeout ? 1 : cc->ssthresh;
+	cc->recover = next_seq;
+}
+
+int cc_window(struct congestion *cc, int max_window)
+{
+	int window = (int)cc->cwnd;
+	if (window < 1)
+		window = 1;
+	return window > max_window ? max_window : window;
+}
+
+void stats_print(FILE *f, struct transfer_stats *st)
+{
+	double seconds = (st->end_us - st->start_us) / 1e6;
+	double goodput = seconds > 0 ? st->bytes / seconds : 0;
+
+	fprintf(f, "frames=%llu bytes=%llu time_s=%.6f goodput_Bps=%.0f retransmits=%llu timeouts=%llu "
+			"fast_retransmits=%llu repair_frames=%llu corrupted=%llu min_rtt_us=%lld srtt_us=%lld rttvar_us=%lld rto_us=%lld\n",
+			(unsigned long long)st->frames, (unsigned long long)st->bytes, seconds, goodput,
+			(unsigned long long)st->retransmits, (unsigned long long)st->timeouts,
+			(unsigned long long)st->fast_retransmits, (unsigned long long)st->repair_frames,
+			(unsigned long long)st->corrupted,
+			(long long)st->min_rtt_us,
+			(long long)st->srtt_us, (long long)st->rttvar_us, (long long)st->rto_us);
+}
@@ -0,0 +1,169 @@
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// size of the whole data datagram (header + payload)
+#define MAXBUF 576
+
+// data frame layout (network byte order):
+// [0..4)  seq   - sequence number of the frame, starting from 1
+// [4..6)  flags - FRAME_* bits
+// [6..8)  len   - number of valid payload bytes
+// [8..12) xid   - id of the transfer, chosen at random by the sender, so a
+//                 new transfer from the same port is told apart from the
+//                 retransmissions of the previous one
+// [12..MAXBUF-4) payload
+// [MAXBUF-4..MAXBUF) crc - CRC-32C of everything before it
+#define FRAME_HEADER_SIZE 12
+#define FRAME_TRAILER_SIZE 4
+#define FRAME_PAYLOAD_SIZE (MAXBUF - FRAME_HEADER_SIZE - FRAME_TRAILER_SIZE)
+
+// the frame carries the last part of the file
+#define FRAME_LAST 0x1
+// the frame is a repair frame of the forward error correction
+#define FRAME_REPAIR 0x2
+// the frame is protected by the forward error correction, the number of data
+// frames in the block is kept in the upper byte of flags
+#define FRAME_FEC 0x4
+#define FRAME_FEC_N(flags) ((flags) >> 8)
+
+// repair frame layout (network byte order, see fec.h):
+// [0..4)  seq   - the first frame of the protected block
+// [4..6)  flags - FRAME_REPAIR, the upper byte keeps n of full blocks
+// [6]     n     - number of data frames in this block
+// [7]     k, j  - number of repair frames in the block (upper 4 bits)
+//                 and the index of this one (lower 4 bits)
+// [8..12) xid   - id of the transfer
+// [12..)  the coded data frames (everything after their seq field,
+//         their crc included, so a recovered frame can be verified too)
+// [..+4)  crc
+#define FEC_SYMBOL_SIZE (MAXBUF - 4)
+#define REPAIR_SIZE (FRAME_HEADER_SIZE + FEC_SYMBOL_SIZE + FRAME_TRAILER_SIZE)
+
+// acknowledgement frame layout (network byte order):
+// [0..4)   cum    - every frame with seq <= cum has been delivered (cumulative ack)
+// [4..8)   rwnd   - number of frames after cum the receiver is able to accept,
+//                   its window less the frames waiting in its reassembly
+//                   buffer, 0 when the whole transfer has been delivered
+// [8..12)  xid    - id of the acknowledged transfer
+// [12..14) blocks - number of the selective ack blocks which follow
+// [14..16) flags  - reserved, 0
+// [16..16+8*blocks) selective ack blocks (start, end) - frames from start
+//                   to end - 1 have been received, the lowest blocks first,
+//                   frame cum + 1 is always missing
+// [..+4)   crc    - CRC-32C of everything before it
+#define ACK_HEADER_SIZE 16
+#define ACK_MAX_BLOCKS 16
+#define ACK_SIZE(blocks) ((size_t)(ACK_HEADER_SIZE + 8 * (blocks) + FRAME_TRAILER_SIZE))
+#define ACK_MAX_SIZE ACK_SIZE(ACK_MAX_BLOCKS)
+
+// the server acknowledges every ACK_EVERY frames received in order, or after
+// ACK_DELAY_US since the first unacknowledged one, out-of-order frames
+// and the last frame are acknowledged at once
+#define ACK_EVERY 16
+#define ACK_DELAY_US 1000
+
+// the window is the number of frames which may be in flight at the same time,
+// the sender and the receiver choose their own (the receiver keeps that many
+// slots for out-of-order frames) and the sender never has more in flight
+// than the receiver advertises, MAX_WINDOW frames are about 36 MB
+#define MAX_WINDOW 65536
+#define DEFAULT_WINDOW 16
+#define DEFAULT_RECV_WINDOW 1024
+
+// initial, minimal and maximal retransmission timeout, the timeout between
+// them is estimated from the measured round-trip times
+#define INITIAL_RTO_US 500000
+#define MIN_RTO_US 5000
+#define MAX_RTO_US 8000000
+
+// number of transmissions of a single frame before the transfer is abandoned
+#define MAX_ATTEMPTS 8
+
+// a frame is retransmitted without waiting for the timeout, if that many
+// frames sent after it have already been acknowledged
+#define DUPACK_THRESHOLD 3
+
+struct frame_header {
+	uint32_t seq;
+	uint16_t flags;
+	uint16_t len;
+	uint32_t xid;
+};
+
+// writes the header into the first FRAME_HEADER_SIZE bytes of the buf
+void frame_pack(char *buf, uint32_t seq, uint16_t flags, uint16_t len, uint32_t xid);
+
+// reads the header from the first FRAME_HEADER_SIZE bytes of the buf
+void frame_unpack(const char *buf, struct frame_header *hdr);
+
+// writes the crc of the first size - FRAME_TRAILER_SIZE bytes into the last ones,
+// has to be called when the whole frame is ready
+void frame_seal(char *buf, size_t size);
+
+// returns -1 if the frame of the size has been damaged on the way
+int frame_verify(const char *buf, size_t size);
+
+struct sack_block {
+	uint32_t start;
+	uint32_t end;
+};
+
+struct ack_frame {
+	uint32_t cum;
+	uint32_t rwnd;
+	uint32_t xid;
+	uint16_t flags;
+	uint16_t blocks;
+	struct sack_block sack[ACK_MAX_BLOCKS];
+};
+
+// writes ACK_SIZE(ack->blocks) bytes into the buf (crc included), returns their number
+size_t ack_pack(char *buf, struct ack_frame *ack);
+
+// returns -1 if the acknowledgement of the size has been damaged
+int ack_unpack(const char *buf, size_t size, struct ack_frame *ack);
+
+// AIMD congestion window, counted in frames
+struct congestion {
+	double cwnd;
+	double ssthresh;
+	// losses of frames sent before recover belong to an already handled event
+	uint32_t recover;
+};
+
+void cc_init(struct congestion *cc, int max_window);
+
+// slow start below ssthresh, additive increase above it
+void cc_on_ack(struct congestion *cc, int acked, int max_window);
+
+// multiplicative decrease, after a timeout the window starts from one frame
+void cc_on_loss(struct congestion *cc, uint32_t seq, uint32_t next_seq, int timeout);
+
+// number of frames which may be in flight now
+int cc_window(struct congestion *cc, int max_window);
+
+// per-transfer statistics
+struct transfer_stats {
+	int64_t start_us;
+	int64_t end_us;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t retransmits;
+	uint64_t timeouts;
+	uint64_t fast_retransmits;
+	uint64_t repair_frames;
+	// frames (or acknowledgements) dropped because of a wrong crc
+	uint64_t corrupted;
+	int64_t min_rtt_us;
+	int64_t srtt_us;
+	int64_t rttvar_us;
+	int64_t rto_us;
+};
+
+// prints one line of key=value pairs, so it can be easily parsed by scripts
+void stats_print(FILE *f, struct transfer_stats *st);
+
+#endif
@@ -1,160 +1,260 @@
-#define _GNU_SOURCE
-#include "../../mysocklib/mysocklib.h"
-#include <netinet/in.h>
-#include <semaphore.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-
-#define MAX_CLIENTS 10
-
-volatile sig_atomic_t do_work = 1;
-
-void usage(char *name)
-{
-    fprintf(stderr, "USAGE: %s  port\n", name);
-}
-
-void sigint_handler(int sigNo);
-void do_server(int server_fd);
-void *thread_work(void *arg);
-
-struct thread_args {
-    int server_fd;
-    int16_t time;
-    struct sockaddr_in client_addr;
-    sem_t *semaphore;
-};
-
-int main(int argc, char** argv)
-{
-    int server_fd;
-    if (argc != 2) {
-        usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    if (sethandler(SIG_IGN, SIGPIPE))
-        ERR("Setting PIPE failed");
-
-    if (sethandler(sigint_handler, SIGINT))
-        ERR("Setting SIGINT failed");
-
-    // blocking mode
-    server_fd = UDP_IPv4_bind_socket(atoi(argv[1]));
-
-    do_server(server_fd);
-
-    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
-        ERR("Cannot close server_fd");
-
-    fprintf(stderr, "[Server] Terminated\n");
-
-    return EXIT_SUCCESS;
-}
-
-void sigint_handler(int sigNo)
-{
-    do_work = 0;
-}
-
-void do_server(int server_fd)
-{
-    int16_t time_ordered;
-    struct sockaddr_in client_addr;
-
-    // this will be sent in the case there are too many clients
-    int16_t deny = -1;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-
-    // create unnamed semaphore
-    sem_t semaphore;
-    if (sem_init(&semaphore, 0, MAX_CLIENTS))
-        ERR("sem_init() failed");
-
-    fprintf(stderr, "[Server] Started\n");
-
-    while (do_work) {
-        while (recvfrom(server_fd, (char *) (&time_ordered),
-                                        sizeof (int16_t), 0, &client_addr, &addr_len) < 0)
-        {
-            if (errno == EINTR) {
-                if (!do_work) return;
-            } else
-            {
-                ERR("recvfrom() failed");
-            }
-        }
-
-        fprintf(stderr, "[Server] Received time order\n");
-
-        if (TEMP_FAILURE_RETRY(sem_trywait(&semaphore))) {
-            if (errno == EAGAIN) {
-                // semaphore is locked, meaning there is no place for another client
-                // send message to the client
-                fprintf(stderr, "[Server] Busy\n");
-
-                if (TEMP_FAILURE_RETRY(sendto(server_fd, (char *) (&deny),
-                                              sizeof(int16_t), 0, &client_addr,
-                                              sizeof(client_addr))) < 0) {
-                    // if it's not the case when the client is offline throw error
-                    if (errno != EPIPE)
-                        ERR("sendto() failed");
-                }
-                continue;
-            }
-            ERR("sem_trywait() failed");
-        }
-
-        // create detached pthread
-        pthread_t tid;
-        struct thread_args *args;
-        // this should be deallocated in thread_work func
-        if ((args = (struct thread_args*)malloc(sizeof(struct thread_args))) == NULL)
-            ERR("malloc() failed");
-
-        args->server_fd = server_fd;
-        args->semaphore = &semaphore;
-        args->client_addr = client_addr;
-        args->time = ntohs(time_ordered);
-
-        if (pthread_create(&tid, NULL, thread_work, (void*) args))
-            ERR("pthread_create() failed");
-
-        if (pthread_detach(tid))
-            ERR("pthread_detach() failed");
-    }
-}
-
-void *thread_work(void *arg)
-{
-    struct thread_args *args = (struct thread_args *) arg;
-    int is_client_offline = 0;
-
-    fprintf(stderr, "[Server] Thread will sleep for %d\n", args->time);
-    bulk_nanosleep(args->time, 0);
-
-    if (TEMP_FAILURE_RETRY(sendto(args->server_fd, (char *) (&args->time),
-                                  sizeof(int16_t), 0, &args->client_addr,
-                                  sizeof(args->client_addr))) < 0) {
-
-        // if it's not the case when the client is offline throw error
-        if (errno != EPIPE)
-            ERR("sendto() failed");
-
-        is_client_offline = 1;
-    }
-
-    if (is_client_offline)
-        fprintf(stderr, "[Server] Client is offline\n");
-    else
-        fprintf(stderr, "[Server] Notification sent\n");
-
-    if (TEMP_FAILURE_RETRY(sem_post(args->semaphore)))
-        ERR("sem_post() failed");
-
-    free(args);
-
-    return NULL;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include "../../mysocklib/mysocklib.h"
+#include "timer_wheel.h"
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// a single thread keeps every ordered notification in the timer wheel and
+// sleeps on the timerfd armed for the nearest one, so the number of waiting
+// clients is limited only by the memory, not by the number of threads
+#define MAX_PENDING (1 << 24)
+// resolution of the wheel
+#define TICK_NS 1000000LL
+// notifications due at the same time are sent with one sendmmsg
+#define BATCH 64
+#define RCVBUF_SIZE (8 << 20)
+// orders taken from the socket before due notifications are sent, a burst
+// filling the whole socket buffer would delay them by the time it takes
+#define DRAIN_LIMIT 1024
+
+volatile sig_atomic_t do_work = 1;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s  port\n", name);
+}
+
+void sigint_handler(int sigNo);
+void do_server(int server_fd);
+
+// payload of the timer
+struct notification {
+    struct sockaddr_in client_addr;
+    int16_t time;
+};
+
+struct server {
+    int server_fd;
+    int timer_fd;
+    struct timer_wheel wheel;
+
+    // expired notifications waiting to be sent
+    struct notification batch[BATCH];
+    int batch_count;
+
+    uint64_t received;
+    uint64_t denied;
+    uint64_t sent;
+    uint64_t offline;
+};
+
+int main(int argc, char** argv)
+{
+    int server_fd;
+    if (argc != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("Setting PIPE failed");
+
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Setting SIGINT failed");
+
+    server_fd = UDP_IPv4_bind_socket(atoi(argv[1]));
+
+    do_server(server_fd);
+
+    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
+        ERR("Cannot close server_fd");
+
+    fprintf(stderr, "[Server] Terminated\n");
+
+    return EXIT_SUCCESS;
+}
+
+void sigint_handler(int sigNo)
+{
+    do_work = 0;
+}
+
+uint64_t now_tick(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime() failed");
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) / TICK_NS;
+}
+
+// sends the expired notifications collected so far
+void flush_batch(struct server *srv)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    int done = 0;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * srv->batch_count);
+    for (int i = 0; i < srv->batch_count; i++) {
+        iov[i].iov_base = (char *)&srv->batch[i].time;
+        iov[i].iov_len = sizeof(int16_t);
+        msgs[i].msg_hdr.msg_name = &srv->batch[i].client_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (done < srv->batch_count) {
+        int sent = TEMP_FAILURE_RETRY(sendmmsg(srv->server_fd, msgs + done, srv->batch_count - done, 0));
+        if (sent < 0) {
+            // if it's not the case when the client is offline throw error,
+            // otherwise skip that client
+            if (errno != EPIPE && errno != ECONNREFUSED)
+                ERR("sendmmsg() failed");
+            srv->offline++;
+            done++;
+            continue;
+        }
+        srv->sent += sent;
+        done += sent;
+    }
+
+    srv->batch_count = 0;
+}
+
+void expire(void *payload, void *arg)
+{
+    struct server *srv = (struct server *)arg;
+
+    srv->batch[srv->batch_count++] = *(struct notification *)payload;
+    if (BATCH == srv->batch_count)
+        flush_batch(srv);
+}
+
+// arms the timerfd for the next tick the wheel has to be advanced at
+void arm_timer(struct server *srv)
+{
+    struct itimerspec its;
+    uint64_t next = tw_next(&srv->wheel);
+
+    memset(&its, 0, sizeof(struct itimerspec));
+    // zero it_value disarms the timer
+    if (next != UINT64_MAX) {
+        uint64_t ns = next * TICK_NS;
+        its.it_value.tv_sec = ns / 1000000000ULL;
+        its.it_value.tv_nsec = ns % 1000000000ULL;
+        // 0 would disarm, the tick 0 is long gone anyway
+        if (0 == ns)
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(srv->timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+        ERR("timerfd_settime() failed");
+}
+
+// reads up to DRAIN_LIMIT waiting orders and puts them into the wheel
+void receive_orders(struct server *srv)
+{
+    int16_t time_ordered;
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+
+    // this will be sent in the case there are too many clients
+    int16_t deny = -1;
+
+    for (int i = 0; i < DRAIN_LIMIT; i++) {
+        // the rest waits for the next round of the loop, the socket stays readable
+        if (recvfrom(srv->server_fd, (char *)(&time_ordered), sizeof(int16_t), MSG_DONTWAIT,
+                     &client_addr, &addr_len) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                ERR("recvfrom() failed");
+            return;
+        }
+
+        int16_t time = ntohs(time_ordered);
+        struct notification *n;
+
+        srv->received++;
+
+        // negative time is due at once
+        uint64_t expires = now_tick() + (time > 0 ? (uint64_t)time * (1000000000LL / TICK_NS) : 0);
+
+        if ((n = (struct notification *)tw_add(&srv->wheel, expires)) == NULL) {
+            // there is no place for another client
+            srv->denied++;
+            if (TEMP_FAILURE_RETRY(sendto(srv->server_fd, (char *)(&deny), sizeof(int16_t), 0,
+                                          &client_addr, sizeof(client_addr))) < 0) {
+                // if it's not the case when the client is offline throw error
+                if (errno != EPIPE && errno != ECONNREFUSED)
+                    ERR("sendto() failed");
+            }
+            continue;
+        }
+
+        n->client_addr = client_addr;
+        n->time = time;
+    }
+}
+
+void do_server(int server_fd)
+{
+    struct server server;
+    struct server *srv = &server;
+
+    memset(srv, 0, sizeof(struct server));
+    srv->server_fd = server_fd;
+
+    // orders come in bursts, a bigger socket buffer keeps them until the
+    // server drains it (the kernel limits it to net.core.rmem_max)
+    int rcvbuf = RCVBUF_SIZE;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+        ERR("setsockopt() failed");
+    if ((srv->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+        ERR("timerfd_create() failed");
+
+    tw_init(&srv->wheel, sizeof(struct notification), MAX_PENDING, now_tick());
+
+    fprintf(stderr, "[Server] Started\n");
+
+    struct pollfd fds[2];
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = srv->timer_fd;
+    fds[1].events = POLLIN;
+
+    while (do_work) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll() failed");
+        }
+
+        if (fds[0].revents & POLLIN)
+            receive_orders(srv);
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(srv->timer_fd, &expirations, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+                ERR("read() failed");
+        }
+
+        // whatever woke the server up, every notification due by now is sent
+        tw_advance(&srv->wheel, now_tick(), expire, srv);
+        flush_batch(srv);
+        arm_timer(srv);
+    }
+
+    fprintf(stderr, "[Server] Orders: %llu, denied: %llu, notifications sent: %llu, clients offline: %llu, pending: %d\n",
+            (unsigned long long)srv->received, (unsigned long long)srv->denied,
+            (unsigned long long)srv->sent, (unsigned long long)srv->offline, srv->wheel.count);
+
+    tw_destroy(&srv->wheel);
+
+    if (TEMP_FAILURE_RETRY(close(srv->timer_fd)) < 0)
+        ERR("Cannot close timer_fd");
+}
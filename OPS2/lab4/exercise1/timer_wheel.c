@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include "timer_wheel.h"
+#include "../../mysocklib/mysocklib.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+#define INITIAL_CAPACITY 1024
+
+struct entry_header {
+    uint64_t expires;
+    int32_t next;
+};
+
+static struct entry_header *entry(struct timer_wheel *w, int32_t id)
+{
+    return (struct entry_header *)(w->entries + (size_t)id * w->entry_size);
+}
+
+void tw_init(struct timer_wheel *w, size_t payload_size, int32_t max_timers, uint64_t now)
+{
+    memset(w, 0, sizeof(struct timer_wheel));
+    memset(w->slots, -1, sizeof(w->slots));
+
+    w->current = now;
+    w->payload_size = payload_size;
+    // the payload starts right after the header and keeps its alignment
+    w->entry_size = (sizeof(struct entry_header) + payload_size + 7) & ~(size_t)7;
+    w->max_capacity = max_timers;
+    w->free_head = -1;
+}
+
+void tw_destroy(struct timer_wheel *w)
+{
+    free(w->entries);
+    w->entries = NULL;
+}
+
+// the array doubles, so the cost of the growth is O(1) per timer
+static int grow(struct timer_wheel *w)
+{
+    int32_t capacity = w->capacity ? 2 * w->capacity : INITIAL_CAPACITY;
+    if (capacity > w->max_capacity)
+        capacity = w->max_capacity;
+    if (capacity <= w->capacity)
+        return -1;
+
+    char *entries;
+    if ((entries = (char *)realloc(w->entries, (size_t)capacity * w->entry_size)) == NULL)
+        ERR("realloc:");
+    w->entries = entries;
+
+    // new entries go to the free list, the lowest first
+    for (int32_t id = capacity - 1; id >= w->capacity; id--) {
+        entry(w, id)->next = w->free_head;
+        w->free_head = id;
+    }
+    w->capacity = capacity;
+
+    return 0;
+}
+
+// links the timer into the slot which will be processed (or cascaded) right before it expires
+static void place(struct timer_wheel *w, int32_t id)
+{
+    struct entry_header *e = entry(w, id);
+    uint64_t delta;
+    int level;
+
+    // a timer in the past expires at the nearest tick
+    if (e->expires < w->current)
+        e->expires = w->current;
+
+    delta = e->expires - w->current;
+    for (level = 0; level < TW_LEVELS - 1; level++)
+        if (delta < (1ULL << (TW_BITS * (level + 1))))
+            break;
+
+    // beyond the range of the wheel, it will be placed again when the last level cascades
+    if (delta >= (1ULL << (TW_BITS * TW_LEVELS)))
+        e->expires = w->current + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+
+    int32_t *slot = &w->slots[level][(e->expires >> (TW_BITS * level)) & TW_MASK];
+    e->next = *slot;
+    *slot = id;
+}
+
+void *tw_add(struct timer_wheel *w, uint64_t expires)
+{
+    if (-1 == w->free_head && grow(w) < 0)
+        return NULL;
+
+    int32_t id = w->free_head;
+    struct entry_header *e = entry(w, id);
+    w->free_head = e->next;
+    w->count++;
+
+    e->expires = expires;
+    place(w, id);
+
+    return (char *)e + sizeof(struct entry_header);
+}
+
+// spreads the timers of the slot over the lower levels
+static void cascade(struct timer_wheel *w, int level)
+{
+    int32_t *slot = &w->slots[level][(w->current >> (TW_BITS * level)) & TW_MASK];
+    int32_t id = *slot;
+
+    *slot = -1;
+    while (id != -1) {
+        int32_t next = entry(w, id)->next;
+        place(w, id);
+        id = next;
+    }
+}
+
+int tw_advance(struct timer_wheel *w, uint64_t now, void (*callback)(void *payload, void *arg), void *arg)
+{
+    int expired = 0;
+
+    while (w->current <= now) {
+        // nothing to wait for - jump straight to now
+        if (0 == w->count) {
+            w->current = now + 1;
+            break;
+        }
+
+        // at the start of every round of a level the next slot of the level above comes down
+        for (int level = 1; level < TW_LEVELS; level++) {
+            if (w->current & ((1ULL << (TW_BITS * level)) - 1))
+                break;
+            cascade(w, level);
+        }
+
+        // every timer left in the current slot of level 0 expires now, the
+        // list is detached and the tick is done before the callbacks, so
+        // a timer added by them is placed in one of the next ticks
+        int32_t *slot = &w->slots[0][w->current & TW_MASK];
+        int32_t id = *slot;
+        *slot = -1;
+        w->current++;
+
+        while (id != -1) {
+            struct entry_header *e = entry(w, id);
+            int32_t next = e->next;
+
+            callback((char *)e + sizeof(struct entry_header), arg);
+
+            // the callback may have grown the array
+            e = entry(w, id);
+            e->next = w->free_head;
+            w->free_head = id;
+            w->count--;
+            expired++;
+            id = next;
+        }
+    }
+
+    return expired;
+}
+
+uint64_t tw_next(struct timer_wheel *w)
+{
+    if (0 == w->count)
+        return UINT64_MAX;
+
+    // the nearest non-empty slot of level 0 before it wraps around
+    uint64_t tick = w->current;
+    do {
+        if (w->slots[0][tick & TW_MASK] != -1)
+            return tick;
+        tick++;
+    } while (tick & TW_MASK);
+
+    // otherwise the wheel has to be advanced to cascade the higher levels
+    return tick;
+}
@@ -0,0 +1,53 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timer wheel (Varghese & Lauck), time is counted in ticks
+//
+// level 0 has one slot per tick of the next TW_SLOTS ticks, every slot of
+// level l covers TW_SLOTS^l ticks, when level 0 wraps around the next slot
+// of level 1 is cascaded (its timers are spread over level 0) and so on,
+// so adding and expiring a timer is O(1) no matter how many are pending
+//
+// timers are kept in one growing array with a free list, the payload of
+// every timer (payload_size bytes) is stored in place, so there is no
+// allocation per timer
+#define TW_BITS 8
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+struct timer_wheel {
+    // every tick before it has been processed
+    uint64_t current;
+    // heads of the slot lists, -1 means empty slot
+    int32_t slots[TW_LEVELS][TW_SLOTS];
+
+    // timers: expiration tick, next one in the list, then the payload
+    char *entries;
+    size_t entry_size;
+    size_t payload_size;
+    int32_t capacity;
+    int32_t max_capacity;
+    int32_t count;
+    int32_t free_head;
+};
+
+// prepares the wheel for up to max_timers pending timers, starting at the tick now
+void tw_init(struct timer_wheel *w, size_t payload_size, int32_t max_timers, uint64_t now);
+
+void tw_destroy(struct timer_wheel *w);
+
+// adds a timer expiring at the tick expires, returns its payload to be filled
+// (valid until the next tw_add) or NULL if the wheel is full
+void *tw_add(struct timer_wheel *w, uint64_t expires);
+
+// processes every tick up to now (inclusive), calls the callback with the
+// payload of every expired timer, returns the number of expired timers
+int tw_advance(struct timer_wheel *w, uint64_t now, void (*callback)(void *payload, void *arg), void *arg);
+
+// returns the tick at which the wheel has to be advanced next,
+// UINT64_MAX if there is no timer
+uint64_t tw_next(struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "file_cache.h"
+#include "../../mysocklib/mysocklib.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// the memory the entry takes from the capacity
+static size_t entry_cost(struct fc_entry *e)
+{
+    return sizeof(struct fc_entry) + e->length + strlen(e->path) + 1;
+}
+
+static int same_file(struct fc_entry *e, struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void fc_init(struct file_cache *c, size_t capacity, size_t limit)
+{
+    memset(c, 0, sizeof(struct file_cache));
+    c->capacity = capacity / FC_SHARDS;
+    c->limit = limit;
+
+    for (int i = 0; i < FC_SHARDS; i++)
+        if (pthread_mutex_init(&c->shards[i].mutex, NULL))
+            ERR("pthread_mutex_init() failed");
+}
+
+void fc_release(struct fc_entry *e)
+{
+    if (__atomic_sub_fetch(&e->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        free(e);
+}
+
+// takes the entry out of the shard, the reference of the cache is dropped
+static void shard_remove(struct fc_shard *s, struct fc_entry *e)
+{
+    struct fc_entry **link = &s->buckets[e->hash % FC_BUCKETS];
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        s->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        s->lru_tail = e->lru_prev;
+
+    s->bytes -= entry_cost(e);
+    fc_release(e);
+}
+
+static void lru_push_front(struct fc_shard *s, struct fc_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head)
+        s->lru_head->lru_prev = e;
+    else
+        s->lru_tail = e;
+    s->lru_head = e;
+}
+
+static struct fc_entry *shard_find(struct fc_shard *s, const char *path, uint32_t hash)
+{
+    for (struct fc_entry *e = s->buckets[hash % FC_BUCKETS]; e; e = e->hash_next)
+        if (e->hash == hash && 0 == strcmp(e->path, path))
+            return e;
+    return NULL;
+}
+
+void fc_destroy(struct file_cache *c)
+{
+    for (int i = 0; i < FC_SHARDS; i++) {
+        struct fc_shard *s = &c->shards[i];
+        while (s->lru_head)
+            shard_remove(s, s->lru_head);
+        if (pthread_mutex_destroy(&s->mutex))
+            ERR("pthread_mutex_destroy() failed");
+    }
+}
+
+// reads the first limit bytes of the file into a new entry with one reference
+static struct fc_entry *load(struct file_cache *c, const char *path, uint32_t hash)
+{
+    struct fc_entry *e;
+    struct stat st;
+    size_t path_len = strlen(path);
+    int fd;
+
+    if ((fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY))) == -1)
+        return NULL;
+
+    // the identity comes from the opened file, not from the path,
+    // so the contents always belong to it
+    if (fstat(fd, &st))
+        ERR("fstat() failed");
+
+    if (!S_ISREG(st.st_mode)) {
+        if (TEMP_FAILURE_RETRY(close(fd)))
+            ERR("close() failed");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t length = (size_t)st.st_size < c->limit ? (size_t)st.st_size : c->limit;
+    if ((e = (struct fc_entry *)malloc(sizeof(struct fc_entry) + length + path_len + 1)) == NULL)
+        ERR("malloc() failed");
+
+    ssize_t got;
+    if ((got = bulk_read(fd, e->data, length)) == -1)
+        ERR("read() failed");
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close() failed");
+
+    // the path is stored right after the contents
+    e->path = e->data + length;
+    memcpy(e->path, path, path_len + 1);
+
+    e->refcount = 1;
+    e->hash = hash;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+    e->size = st.st_size;
+    // the file may have been truncated meanwhile, the next request reloads it
+    e->length = got;
+
+    return e;
+}
+
+struct fc_entry *fc_get(struct file_cache *c, const char *path)
+{
+    uint32_t hash = path_hash(path);
+    struct fc_shard *s = &c->shards[hash % FC_SHARDS];
+    struct fc_entry *e;
+    struct stat st;
+
+    // the check is done without the lock, the shard is locked only for the lookup
+    if (fstatat(AT_FDCWD, path, &st, 0))
+        return NULL;
+
+    if (pthread_mutex_lock(&s->mutex))
+        ERR("pthread_mutex_lock() failed");
+
+    if ((e = shard_find(s, path, hash)) != NULL) {
+        if (same_file(e, &st)) {
+            // move it to the front
+            if (e != s->lru_head) {
+                e->lru_prev->lru_next = e->lru_next;
+                if (e->lru_next)
+                    e->lru_next->lru_prev = e->lru_prev;
+                else
+                    s->lru_tail = e->lru_prev;
+                lru_push_front(s, e);
+            }
+            __atomic_fetch_add(&e->refcount, 1, __ATOMIC_RELAXED);
+            s->hits++;
+
+            if (pthread_mutex_unlock(&s->mutex))
+                ERR("pthread_mutex_unlock() failed");
+            return e;
+        }
+
+        // the file has changed, threads still sending the old entry keep it
+        shard_remove(s, e);
+        s->stale++;
+    }
+    s->misses++;
+
+    if (pthread_mutex_unlock(&s->mutex))
+        ERR("pthread_mutex_unlock() failed");
+
+    // the file is read without the lock
+    if ((e = load(c, path, hash)) == NULL)
+        return NULL;
+
+    size_t cost = entry_cost(e);
+    if (cost > c->capacity)
+        return e;
+
+    if (pthread_mutex_lock(&s->mutex))
+        ERR("pthread_mutex_lock() failed");
+
+    // another thread may have loaded it meanwhile, the newer read wins
+    struct fc_entry *old;
+    if ((old = shard_find(s, path, hash)) != NULL)
+        shard_remove(s, old);
+
+    while (s->bytes + cost > c->capacity) {
+        shard_remove(s, s->lru_tail);
+        s->evictions++;
+    }
+
+    // one reference for the cache, one for the caller
+    e->refcount = 2;
+    e->hash_next = s->buckets[hash % FC_BUCKETS];
+    s->buckets[hash % FC_BUCKETS] = e;
+    lru_push_front(s, e);
+    s->bytes += cost;
+
+    if (pthread_mutex_unlock(&s->mutex))
+        ERR("pthread_mutex_unlock() failed");
+
+    return e;
+}
+
+void fc_print_stats(FILE *f, struct file_cache *c)
+{
+    uint64_t hits = 0, misses = 0, stale = 0, evictions = 0;
+    size_t bytes = 0;
+
+    for (int i = 0; i < FC_SHARDS; i++) {
+        hits += c->shards[i].hits;
+        misses += c->shards[i].misses;
+        stale += c->shards[i].stale;
+        evictions += c->shards[i].evictions;
+        bytes += c->shards[i].bytes;
+    }
+
+    fprintf(f, "[Cache] hits: %llu, misses: %llu, stale: %llu, evictions: %llu, size: %zu of %zu bytes\n",
+            (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)stale,
+            (unsigned long long)evictions, bytes, c->capacity * FC_SHARDS);
+}
@@ -0,0 +1,76 @@
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+// size-bounded LRU cache of file contents keyed by path
+//
+// the cache is split into shards by the hash of the path, every shard has its
+// own lock, hash table and LRU list, so threads asking for different files
+// rarely meet, an entry is valid as long as the file has the same inode,
+// mtime and size (checked with fstatat, there is no open or read for a hit),
+// entries are refcounted, so an evicted or replaced entry lives until the
+// last thread sending it releases it
+#define FC_SHARDS 16
+#define FC_BUCKETS 256
+
+struct fc_entry {
+    // hash chain and LRU list of the shard
+    struct fc_entry *hash_next;
+    struct fc_entry *lru_prev;
+    struct fc_entry *lru_next;
+
+    uint32_t refcount;
+    uint32_t hash;
+    char *path;
+
+    // identity of the file the contents were read from
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    size_t length;
+    char data[];
+};
+
+struct fc_shard {
+    pthread_mutex_t mutex;
+    struct fc_entry *buckets[FC_BUCKETS];
+    // the most recently used first
+    struct fc_entry *lru_head;
+    struct fc_entry *lru_tail;
+    size_t bytes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+    uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct file_cache {
+    struct fc_shard shards[FC_SHARDS];
+    // per shard
+    size_t capacity;
+    // at most that much of every file is kept
+    size_t limit;
+};
+
+// the cache keeps up to capacity bytes, the first limit bytes of every file
+void fc_init(struct file_cache *c, size_t capacity, size_t limit);
+
+void fc_destroy(struct file_cache *c);
+
+// returns the contents of the file (relative to the working directory),
+// the caller has to release it with fc_release, NULL with errno set if
+// the file can't be read or isn't a regular file
+struct fc_entry *fc_get(struct file_cache *c, const char *path);
+
+void fc_release(struct fc_entry *e);
+
+void fc_print_stats(FILE *f, struct file_cache *c);
+
+#endif
@@ -1,253 +1,464 @@
-#define _GNU_SOURCE
-#include "../../mysocklib/mysocklib.h"
-#include <netinet/in.h>
-#include <semaphore.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <fcntl.h>
-
-#define BACKLOG 3
-#define CHUNK_SIZE 500
-#define NMMAX 30
-#define THREAD_COUNT 3
-#define ERRSTRING "No such file or directory\n"
-
-volatile sig_atomic_t do_work = 1;
-
-void usage(char *name)
-{
-    fprintf(stderr, "USAGE: %s port workdir\n", name);
-}
-
-typedef struct thread_args{
-    int id;
-    pthread_t tid;
-    int *cfd;
-    int *idlethreads;
-    int *condition;
-    pthread_mutex_t *mutex; // protects cfd and idlethreads values
-    pthread_cond_t *cond;
-} thread_args_t;
-
-void sigint_handler(int sigNo);
-void do_server(int server_fd, thread_args_t threads[THREAD_COUNT], int *idlethreads, int *cfd, int *condition, pthread_cond_t *cond, pthread_mutex_t *mutex);
-void *thread_work(void *arg);
-void cleanup(void *arg);
-void communicate(int client_fd);
-
-int main(int argc, char** argv)
-{
-    int server_fd;
-    if (argc != 3) {
-        usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    // change working directory to the given one
-    if (chdir(argv[2]) == -1)
-        ERR("chdir");
-
-    if (sethandler(SIG_IGN, SIGPIPE))
-        ERR("Setting PIPE failed");
-
-    if (sethandler(sigint_handler, SIGINT))
-        ERR("Setting SIGINT failed");
-
-    // non blocking mode tcp ipv4
-    server_fd = TCP_IPv4_bind_socket(atoi(argv[1]), BACKLOG);
-    int new_flags = fcntl(server_fd, F_GETFL) | O_NONBLOCK;
-    if (fcntl(server_fd, F_SETFL, new_flags) == -1)
-        ERR("fcntl");
-
-    // condition value and the mutex
-    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-
-    int idlethreads = 0;
-    int cfd = -1;
-    int condition = 0;
-
-    // init threads
-    thread_args_t threads[THREAD_COUNT];
-
-    for (int i = 0; i < THREAD_COUNT; ++i) {
-        threads[i].id = i + 1;
-        threads[i].cfd = &cfd;
-        threads[i].idlethreads = &idlethreads;
-        threads[i].condition = &condition;
-        threads[i].cond = &cond;
-        threads[i].mutex = &mutex;
-
-        if (pthread_create(&threads[i].tid, NULL, thread_work, (void*) &threads[i]))
-            ERR("pthread_create() failed");
-    }
-
-    // start working
-    do_server(server_fd, threads, &idlethreads, &cfd, &condition, &cond, &mutex);
-
-    // first variant
-//    condition = 1;
-//    if (pthread_cond_broadcast(&cond))
-//        ERR("pthread_cond_broadcast() failed");
-
-    // second variant (cond_wait is cancelation point)
-    for (int i = 0; i < THREAD_COUNT; ++i) {
-        if (pthread_cancel(threads[i].tid))
-            ERR("pthread_cancel() failed");
-    }
-
-
-    // join the working threads before leaving
-    for (int i = 0; i < THREAD_COUNT; ++i) {
-        if (pthread_join(threads[i].tid, NULL))
-            ERR("pthread_join() failed");
-    }
-
-    // close the server
-    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
-        ERR("Cannot close server_fd");
-
-    fprintf(stderr, "[Server] Terminated\n");
-
-    return EXIT_SUCCESS;
-}
-
-void sigint_handler(int sigNo)
-{
-    do_work = 0;
-}
-
-void do_server(int server_fd, thread_args_t threads[THREAD_COUNT], int *idlethreads, int *cfd, int *condition, pthread_cond_t *cond, pthread_mutex_t *mutex)
-{
-    int client_fd;
-    fd_set base_rfds, rfds;
-    FD_ZERO(&base_rfds);
-    FD_SET(server_fd, &base_rfds);
-
-    // ignore SIGINT if pselect is not running
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigprocmask(SIG_BLOCK, &mask, &oldmask);
-
-    fprintf(stderr, "[Server] Started\n");
-
-    while (do_work) {
-        rfds = base_rfds;
-        if (pselect(server_fd + 1, &rfds, NULL, NULL, NULL, &oldmask) != -1) {
-            // new client connection is pending
-            if ((client_fd = add_new_client(server_fd)) == -1)
-                continue;
-
-            if (pthread_mutex_lock(mutex))
-                ERR("pthread_mutex_lock() failed");
-
-            fprintf(stderr, "[Server] New client\n");
-
-            // if there are no resources, disconnect the client and unlock the mutex
-            if (*idlethreads == 0) {
-                if (TEMP_FAILURE_RETRY(close(client_fd)))
-                    ERR("close() failed");
-
-                fprintf(stderr, "[Server] Client expelled, no resources\n");
-
-                if (pthread_mutex_unlock(mutex) != 0)
-                    ERR("pthread_mutex_unlock() failed");
-            } else {
-                *cfd = client_fd;
-                if (pthread_mutex_unlock(mutex))
-                    ERR("phtread_mutex_unlock() failed");
-
-                *condition = 1;
-                fprintf(stderr, "[Server] The client gets theirs thread \n");
-
-                if (pthread_cond_signal(cond))
-                    ERR("pthread_cond_signal() failed");
-            }
-
-        } else if (errno != EINTR) {
-            ERR("pselect() failed");
-        }
-    }
-}
-
-void *thread_work(void *arg)
-{
-    int client_fd;
-    thread_args_t args;
-    memcpy(&args, arg, sizeof(thread_args_t));
-
-    while (1) {
-        pthread_cleanup_push(cleanup, (void *) args.mutex);
-        if (pthread_mutex_lock(args.mutex))
-            ERR("pthread_mutex_lock() failed");
-
-        (*args.idlethreads)++;
-
-        // block until the condition is not met
-        while (!(*args.condition) && do_work) {
-            // blocks and unlocks the mutex
-            if (pthread_cond_wait(args.cond, args.mutex) != 0)
-                ERR("pthread_cond_wait() failed");
-        }
-
-        if (!do_work) {
-            pthread_exit(NULL); // it also pops the cancelation cleanup routine
-        }
-
-        // should be after the if statement
-        *args.condition = 0;
-
-        (*args.idlethreads)--;
-
-        client_fd = *args.cfd;
-        // pop and invoke the cleanup which simply unlocks the mutex
-        pthread_cleanup_pop(1);
-        communicate(client_fd);
-    }
-
-    return NULL;
-}
-
-void cleanup(void *arg)
-{
-    pthread_mutex_unlock((pthread_mutex_t *)arg);
-}
-
-void communicate(int client_fd)
-{
-    fprintf(stderr, "[Server] Starting communication with the client \n");
-
-    ssize_t size;
-    char filepath[NMMAX + 1];
-    char buffer[CHUNK_SIZE];
-
-    // On  SOCK_STREAM  sockets  MSG_WAITALL requests that the function
-    // block until the full amount of data can be returned (man 3p recv).
-    if ((size = TEMP_FAILURE_RETRY(recv(client_fd, filepath, NMMAX + 1, MSG_WAITALL))) == -1)
-        ERR("recv() failed");
-
-    // at this point size is 0 (eof) or NMMAX + 1
-    if (size == NMMAX + 1) {
-        int fd;
-        // try to open the given file
-        if ((fd = TEMP_FAILURE_RETRY(open(filepath, O_RDONLY))) == -1) {
-            sprintf(buffer, ERRSTRING);
-        } else  {
-            memset(buffer, 0, CHUNK_SIZE);
-
-            // eof can be detected
-            if (bulk_read(fd, buffer, CHUNK_SIZE) == -1)
-                ERR("read() failed");
-        }
-
-        // send read data
-        if (TEMP_FAILURE_RETRY(send(client_fd, buffer, CHUNK_SIZE, 0)) == -1)
-            ERR("write()");
-    }
-
-    if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
-        ERR("close() failed");
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include "../../coro/coro.h"
+#include "../../mysocklib/mysocklib.h"
+#include "../../workpool/workpool.h"
+#include "file_cache.h"
+#include "work_queue.h"
+#include "worker_pool.h"
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <time.h>
+
+// a burst of clients waits in the listen queue until the acceptor takes them
+#define BACKLOG 64
+#define CHUNK_SIZE 500
+#define NMMAX 30
+// the pool grows under load and shrinks back when it's idle
+#define MIN_THREADS 3
+#define MAX_THREADS 64
+#define QUEUE_DEPTH 16
+// with ADMIT_BLOCK the acceptor waits for a free place in slices this long,
+// SIGINT is let in between them
+#define ADMIT_SLICE_MS 100
+// hot files are answered from the memory
+#define CACHE_SIZE (16 << 20)
+#define ERRSTRING "No such file or directory\n"
+#define BUSYSTRING "Server busy, try again later\n"
+
+volatile sig_atomic_t do_work = 1;
+
+// the other way of serving clients: every one is a task of the work-stealing
+// pool (max_threads workers, no autoscaling), the acceptor submits it and
+// the semaphore takes the place of the queue for the admission policies
+struct steal_executor {
+    struct workpool pool;
+    struct file_cache *cache;
+    // clients being served or waiting in the pool, up to workers + queue_depth
+    sem_t places;
+    uint64_t refused;
+    // the client every worker serves, -1 if none, steal_stop disconnects them
+    int *serving;
+    int stopping;
+};
+
+struct steal_task {
+    struct steal_executor *ex;
+    int client_fd;
+};
+
+// where the acceptor hands the clients over, one of them is set
+struct executor {
+    struct work_queue *queue;
+    struct steal_executor *steal;
+    // every client is a coroutine, there is nothing to wait in, so the
+    // admission policy doesn't apply
+    struct coro_runtime *coro;
+    struct file_cache *cache;
+};
+
+struct coro_task {
+    struct file_cache *cache;
+    int client_fd;
+};
+
+void usage(char *name)
+{
+    fprintf(stderr,
+            "USAGE: %s port workdir [queue_depth [block|shed|reject [min_threads max_threads [pool|steal|coro]]]]\n",
+            name);
+    fprintf(stderr, "pool - autoscaling threads taking clients from the queue (default)\n");
+    fprintf(stderr, "steal - max_threads workers of the work-stealing pool, a task per client\n");
+    fprintf(stderr, "coro - a coroutine per client on max_threads schedulers, no queue and no admission policy\n");
+}
+
+void sigint_handler(int sigNo);
+void steal_start(struct steal_executor *ex, int workers, int depth, struct file_cache *cache);
+int steal_admit(struct steal_executor *ex, int client_fd, enum admission_policy policy);
+void steal_stop(struct steal_executor *ex);
+void coro_serve(void *arg);
+int admit(struct executor *ex, int client_fd, enum admission_policy policy);
+void do_server(int server_fd, struct executor *ex, enum admission_policy policy);
+void serve_client(int client_fd, void *arg);
+void communicate(int client_fd, struct file_cache *cache);
+void reject(int client_fd);
+
+int main(int argc, char** argv)
+{
+    int server_fd;
+    int depth = QUEUE_DEPTH;
+    enum admission_policy policy = ADMIT_BLOCK;
+    int min_threads = MIN_THREADS, max_threads = MAX_THREADS;
+    const char *kind = "pool";
+
+    if (argc < 3 || argc > 8 || 6 == argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 3 && (depth = atoi(argv[3])) <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 4 && wq_parse_policy(argv[4], &policy)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 6) {
+        min_threads = atoi(argv[5]);
+        max_threads = atoi(argv[6]);
+        if (min_threads <= 0 || max_threads < min_threads || max_threads > POOL_SLOTS) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc > 7) {
+        kind = argv[7];
+        if (strcmp(kind, "pool") && strcmp(kind, "steal") && strcmp(kind, "coro")) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // change working directory to the given one
+    if (chdir(argv[2]) == -1)
+        ERR("chdir");
+
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("Setting PIPE failed");
+
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Setting SIGINT failed");
+
+    // non blocking mode tcp ipv4
+    server_fd = TCP_IPv4_bind_socket(atoi(argv[1]), BACKLOG);
+    int new_flags = fcntl(server_fd, F_GETFL) | O_NONBLOCK;
+    if (fcntl(server_fd, F_SETFL, new_flags) == -1)
+        ERR("fcntl");
+
+    // accepted clients wait here for a free thread
+    struct work_queue queue;
+    wq_init(&queue, depth);
+
+    // only the first chunk of a file is ever sent
+    struct file_cache cache;
+    fc_init(&cache, CACHE_SIZE, CHUNK_SIZE);
+
+    struct executor ex;
+    memset(&ex, 0, sizeof(struct executor));
+    ex.cache = &cache;
+
+    if (0 == strcmp(kind, "steal")) {
+        struct steal_executor steal;
+        steal_start(&steal, max_threads, depth, &cache);
+        ex.steal = &steal;
+        do_server(server_fd, &ex, policy);
+        // the clients being served are disconnected, the waiting ones are
+        // closed by their tasks
+        steal_stop(&steal);
+    } else if (0 == strcmp(kind, "coro")) {
+        struct coro_runtime rt;
+        coro_init(&rt, max_threads);
+        ex.coro = &rt;
+        do_server(server_fd, &ex, policy);
+        // the calls of the coroutines still talking to clients fail, so they finish
+        coro_destroy(&rt, 1);
+    } else {
+        // init threads
+        struct worker_pool pool;
+        pool_start(&pool, &queue, min_threads, max_threads, serve_client, &cache);
+
+        // start working
+        ex.queue = &queue;
+        do_server(server_fd, &ex, policy);
+
+        // the workers are cancelled, the clients being served are disconnected
+        pool_stop(&pool);
+        pool_print_stats(stderr, &pool);
+    }
+
+    // clients still in the queue are disconnected
+    struct work_item item;
+    while (wq_length(&queue) > 0) {
+        wq_pop(&queue, &item);
+        if (TEMP_FAILURE_RETRY(close(item.client_fd)) < 0)
+            ERR("close() failed");
+    }
+
+    if (ex.queue)
+        wq_print_stats(stderr, &queue);
+    wq_destroy(&queue);
+
+    fc_print_stats(stderr, &cache);
+    fc_destroy(&cache);
+
+    // close the server
+    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
+        ERR("Cannot close server_fd");
+
+    fprintf(stderr, "[Server] Terminated\n");
+
+    return EXIT_SUCCESS;
+}
+
+void sigint_handler(int sigNo)
+{
+    do_work = 0;
+}
+
+void steal_serve(void *arg)
+{
+    struct steal_task *task = (struct steal_task *)arg;
+    struct steal_executor *ex = task->ex;
+    int *serving = &ex->serving[wp_worker_id()];
+
+    // either steal_stop sees the client and disconnects it, or the task
+    // sees stopping and doesn't start serving it
+    __atomic_store_n(serving, task->client_fd, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ex->stopping, __ATOMIC_SEQ_CST)) {
+        if (TEMP_FAILURE_RETRY(close(task->client_fd)) < 0)
+            ERR("close() failed");
+    } else {
+        communicate(task->client_fd, ex->cache);
+    }
+    __atomic_store_n(serving, -1, __ATOMIC_SEQ_CST);
+
+    free(task);
+    if (sem_post(&ex->places))
+        ERR("sem_post() failed");
+}
+
+void steal_start(struct steal_executor *ex, int workers, int depth, struct file_cache *cache)
+{
+    memset(ex, 0, sizeof(struct steal_executor));
+    ex->cache = cache;
+    if (sem_init(&ex->places, 0, workers + depth))
+        ERR("sem_init() failed");
+    if ((ex->serving = (int *)malloc(workers * sizeof(int))) == NULL)
+        ERR("malloc() failed");
+    for (int i = 0; i < workers; i++)
+        ex->serving[i] = -1;
+    wp_init(&ex->pool, workers);
+}
+
+// submits the client if there is a place for it, with ADMIT_BLOCK waits
+// for one at most ADMIT_SLICE_MS, returns -1 if there is none
+int steal_admit(struct steal_executor *ex, int client_fd, enum admission_policy policy)
+{
+    struct steal_task *task;
+
+    if (ADMIT_BLOCK == policy) {
+        struct timespec deadline;
+        // sem_timedwait counts on the realtime clock
+        if (clock_gettime(CLOCK_REALTIME, &deadline))
+            ERR("clock_gettime() failed");
+        deadline.tv_nsec += ADMIT_SLICE_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (TEMP_FAILURE_RETRY(sem_timedwait(&ex->places, &deadline))) {
+            if (ETIMEDOUT != errno)
+                ERR("sem_timedwait() failed");
+            return -1;
+        }
+    } else if (TEMP_FAILURE_RETRY(sem_trywait(&ex->places))) {
+        if (EAGAIN != errno)
+            ERR("sem_trywait() failed");
+        ex->refused++;
+        return -1;
+    }
+
+    if ((task = (struct steal_task *)malloc(sizeof(struct steal_task))) == NULL)
+        ERR("malloc() failed");
+    task->ex = ex;
+    task->client_fd = client_fd;
+    wp_submit(&ex->pool, steal_serve, task);
+    return 0;
+}
+
+void steal_stop(struct steal_executor *ex)
+{
+    __atomic_store_n(&ex->stopping, 1, __ATOMIC_SEQ_CST);
+
+    // like pool_stop, a client which keeps the connection open would keep
+    // its worker (and wp_destroy) waiting
+    for (int i = 0; i < ex->pool.worker_count; i++) {
+        int client_fd = __atomic_load_n(&ex->serving[i], __ATOMIC_SEQ_CST);
+        if (client_fd >= 0 && shutdown(client_fd, SHUT_RDWR) && ENOTCONN != errno && ENOTSOCK != errno &&
+            EBADF != errno)
+            ERR("shutdown() failed");
+    }
+
+    wp_destroy(&ex->pool);
+    wp_print_stats(stderr, &ex->pool);
+    fprintf(stderr, "[Steal] refused: %llu\n", (unsigned long long)ex->refused);
+
+    if (sem_destroy(&ex->places))
+        ERR("sem_destroy() failed");
+    free(ex->serving);
+}
+
+void coro_serve(void *arg)
+{
+    struct coro_task *task = (struct coro_task *)arg;
+    communicate(task->client_fd, task->cache);
+    free(task);
+}
+
+// hands the client over to the workers, with ADMIT_BLOCK waits for a place
+// at most ADMIT_SLICE_MS, returns -1 if there is none
+int admit(struct executor *ex, int client_fd, enum admission_policy policy)
+{
+    if (ex->steal)
+        return steal_admit(ex->steal, client_fd, policy);
+
+    if (ex->coro) {
+        struct coro_task *task;
+        // the calls of a coroutine wait on epoll, not in the socket
+        if (fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK) == -1)
+            ERR("fcntl");
+        if ((task = (struct coro_task *)malloc(sizeof(struct coro_task))) == NULL)
+            ERR("malloc() failed");
+        task->cache = ex->cache;
+        task->client_fd = client_fd;
+        coro_spawn(ex->coro, coro_serve, task);
+        return 0;
+    }
+
+    struct work_item item;
+    item.client_fd = client_fd;
+    if (ADMIT_BLOCK == policy)
+        return wq_push_timed(ex->queue, &item, ADMIT_SLICE_MS);
+    return wq_push(ex->queue, &item, policy);
+}
+
+void do_server(int server_fd, struct executor *ex, enum admission_policy policy)
+{
+    int client_fd;
+    fd_set base_rfds, rfds;
+    FD_ZERO(&base_rfds);
+    FD_SET(server_fd, &base_rfds);
+
+    // ignore SIGINT if pselect is not running
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    fprintf(stderr, "[Server] Started\n");
+
+    // a zero timeout of pselect only delivers a pending SIGINT
+    struct timespec no_wait = {0, 0};
+
+    while (do_work) {
+        rfds = base_rfds;
+        if (pselect(server_fd + 1, &rfds, NULL, NULL, NULL, &oldmask) != -1) {
+            // take every pending connection, the socket is non blocking
+            while ((client_fd = add_new_client(server_fd)) != -1) {
+                // with ADMIT_BLOCK it waits until a thread takes a client,
+                // SIGINT is masked outside pselect, so it's checked between
+                // the slices of the wait, otherwise a worker stuck with a slow
+                // client would keep the server from stopping
+                if (ADMIT_BLOCK == policy) {
+                    while (do_work && admit(ex, client_fd, policy))
+                        pselect(0, NULL, NULL, NULL, &no_wait, &oldmask);
+                    if (do_work)
+                        continue;
+                    if (TEMP_FAILURE_RETRY(close(client_fd)))
+                        ERR("close() failed");
+                    break;
+                }
+
+                if (admit(ex, client_fd, policy) == 0)
+                    continue;
+
+                if (ADMIT_REJECT == policy) {
+                    reject(client_fd);
+                } else if (TEMP_FAILURE_RETRY(close(client_fd))) {
+                    ERR("close() failed");
+                }
+                fprintf(stderr, "[Server] Client expelled, the queue is full\n");
+            }
+        } else if (errno != EINTR) {
+            ERR("pselect() failed");
+        }
+    }
+}
+
+void serve_client(int client_fd, void *arg)
+{
+    communicate(client_fd, (struct file_cache *)arg);
+}
+
+// sends the busy reply in the place of the file and disconnects the client
+void reject(int client_fd)
+{
+    char buffer[CHUNK_SIZE];
+
+    memset(buffer, 0, CHUNK_SIZE);
+    sprintf(buffer, BUSYSTRING);
+
+    // the client may be gone already, so errors are not fatal, nor is waiting
+    // for a slow client, the reply fits in the socket buffer
+    if (TEMP_FAILURE_RETRY(send(client_fd, buffer, CHUNK_SIZE, MSG_DONTWAIT)) == -1 &&
+        errno != EPIPE && errno != ECONNRESET && errno != EAGAIN)
+        ERR("send() failed");
+
+    if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
+        ERR("close() failed");
+}
+
+void communicate(int client_fd, struct file_cache *cache)
+{
+    fprintf(stderr, "[Server] Starting communication with the client \n");
+
+    ssize_t size;
+    char filepath[NMMAX + 1];
+    char buffer[CHUNK_SIZE];
+
+    // On  SOCK_STREAM  sockets  MSG_WAITALL requests that the function
+    // block until the full amount of data can be returned (man 3p recv).
+    // a coroutine reads the same way, waiting on the epoll of its scheduler
+    // (and fails with ECANCELED when the server stops)
+    if (coro_running())
+        size = coro_bulk_read(client_fd, filepath, NMMAX + 1);
+    else
+        size = TEMP_FAILURE_RETRY(recv(client_fd, filepath, NMMAX + 1, MSG_WAITALL));
+    if (size == -1 && errno != ECONNRESET && errno != ECANCELED)
+        ERR("recv() failed");
+
+    // at this point size is 0 (eof) or NMMAX + 1
+    if (size == NMMAX + 1) {
+        struct fc_entry *file;
+
+        // the client may not have terminated the path
+        filepath[NMMAX] = '\0';
+        memset(buffer, 0, CHUNK_SIZE);
+
+        // the contents come from the cache, the file is read only
+        // if it isn't there or has changed
+        if ((file = fc_get(cache, filepath)) == NULL) {
+            sprintf(buffer, ERRSTRING);
+        } else {
+            memcpy(buffer, file->data, file->length);
+            fc_release(file);
+        }
+
+        // send read data, the client may be gone (or disconnected by the
+        // stopping server)
+        if (coro_running())
+            size = coro_bulk_write(client_fd, buffer, CHUNK_SIZE);
+        else
+            size = TEMP_FAILURE_RETRY(send(client_fd, buffer, CHUNK_SIZE, 0));
+        if (size == -1 && errno != EPIPE && errno != ECONNRESET && errno != ECANCELED)
+            ERR("write()");
+    }
+
+    if (TEMP_FAILURE_RETRY(close(client_fd)) < 0)
+        ERR("close() failed");
+}
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include "work_queue.h"
+#include "../../mysocklib/mysocklib.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void wq_init(struct work_queue *q, int depth)
+{
+    uint64_t capacity = 1;
+
+    memset(q, 0, sizeof(struct work_queue));
+
+    // the ring is a power of two, the semaphore keeps the exact depth
+    while (capacity < (uint64_t)depth)
+        capacity <<= 1;
+
+    if ((q->cells = (struct work_cell *)malloc(capacity * sizeof(struct work_cell))) == NULL)
+        ERR("malloc() failed");
+
+    for (uint64_t i = 0; i < capacity; i++)
+        q->cells[i].seq = i;
+
+    q->mask = capacity - 1;
+    q->depth = depth;
+
+    if (sem_init(&q->free_cells, 0, depth))
+        ERR("sem_init() failed");
+    if (sem_init(&q->full_cells, 0, 0))
+        ERR("sem_init() failed");
+}
+
+void wq_destroy(struct work_queue *q)
+{
+    if (sem_destroy(&q->free_cells) || sem_destroy(&q->full_cells))
+        ERR("sem_destroy() failed");
+    free(q->cells);
+}
+
+// the caller owns a free cell (the semaphore said so), it only has to find it
+static void ring_enqueue(struct work_queue *q, struct work_item *item)
+{
+    uint64_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        struct work_cell *cell = &q->cells[pos & q->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            // the cell is free in this round, try to reserve it
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = *item;
+                // publish the item
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+            // pos has been reloaded by the failed exchange
+        } else if (seq < pos) {
+            // the consumer of the previous round hasn't freed it yet
+            sched_yield();
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        } else {
+            // another producer took it
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// the caller owns a full cell, the one at its position may still be written
+// by a slower producer, so it may have to wait a moment
+static void ring_dequeue(struct work_queue *q, struct work_item *item)
+{
+    uint64_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        struct work_cell *cell = &q->cells[pos & q->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *item = cell->item;
+                // free the cell for the producer of the next round
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        } else if (seq < pos + 1) {
+            sched_yield();
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// sem_timedwait counts on the realtime clock
+static void deadline_after(int timeout_ms, struct timespec *deadline)
+{
+    if (clock_gettime(CLOCK_REALTIME, deadline))
+        ERR("clock_gettime() failed");
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// puts the item into the free cell the caller owns
+static void give(struct work_queue *q, struct work_item *item)
+{
+    item->enqueued_ns = monotonic_ns();
+    ring_enqueue(q, item);
+    __atomic_fetch_add(&q->pushed, 1, __ATOMIC_RELAXED);
+
+    if (sem_post(&q->full_cells))
+        ERR("sem_post() failed");
+}
+
+int wq_push(struct work_queue *q, struct work_item *item, enum admission_policy policy)
+{
+    if (ADMIT_BLOCK == policy) {
+        if (TEMP_FAILURE_RETRY(sem_wait(&q->free_cells)))
+            ERR("sem_wait() failed");
+    } else if (TEMP_FAILURE_RETRY(sem_trywait(&q->free_cells))) {
+        if (EAGAIN != errno)
+            ERR("sem_trywait() failed");
+        __atomic_fetch_add(&q->refused, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    give(q, item);
+    return 0;
+}
+
+int wq_push_timed(struct work_queue *q, struct work_item *item, int timeout_ms)
+{
+    struct timespec deadline;
+
+    deadline_after(timeout_ms, &deadline);
+    if (TEMP_FAILURE_RETRY(sem_timedwait(&q->free_cells, &deadline))) {
+        if (ETIMEDOUT != errno)
+            ERR("sem_timedwait() failed");
+        return -1;
+    }
+
+    give(q, item);
+    return 0;
+}
+
+// takes the item the caller owns a full cell for and updates the wait metrics
+static void take(struct work_queue *q, struct work_item *item)
+{
+    ring_dequeue(q, item);
+
+    if (sem_post(&q->free_cells))
+        ERR("sem_post() failed");
+
+    uint64_t wait_us = (uint64_t)(monotonic_ns() - item->enqueued_ns) / 1000;
+    int bucket = 0;
+    while (bucket < WAIT_BUCKETS - 1 && (wait_us >> (bucket + 1)))
+        bucket++;
+
+    __atomic_fetch_add(&q->popped, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&q->wait_total_us, wait_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&q->wait_histogram[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&q->wait_max_us, __ATOMIC_RELAXED);
+    while (wait_us > max &&
+           !__atomic_compare_exchange_n(&q->wait_max_us, &max, wait_us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void wq_pop(struct work_queue *q, struct work_item *item)
+{
+    if (TEMP_FAILURE_RETRY(sem_wait(&q->full_cells)))
+        ERR("sem_wait() failed");
+    take(q, item);
+}
+
+int wq_pop_timed(struct work_queue *q, struct work_item *item, int timeout_ms)
+{
+    struct timespec deadline;
+
+    deadline_after(timeout_ms, &deadline);
+    if (TEMP_FAILURE_RETRY(sem_timedwait(&q->full_cells, &deadline))) {
+        if (ETIMEDOUT != errno)
+            ERR("sem_timedwait() failed");
+        return -1;
+    }
+    take(q, item);
+
+    return 0;
+}
+
+int wq_length(struct work_queue *q)
+{
+    int value;
+    if (sem_getvalue(&q->full_cells, &value))
+        ERR("sem_getvalue() failed");
+    return value < 0 ? 0 : value;
+}
+
+int wq_parse_policy(const char *name, enum admission_policy *policy)
+{
+    if (0 == strcmp(name, "block"))
+        *policy = ADMIT_BLOCK;
+    else if (0 == strcmp(name, "shed"))
+        *policy = ADMIT_SHED;
+    else if (0 == strcmp(name, "reject"))
+        *policy = ADMIT_REJECT;
+    else
+        return -1;
+    return 0;
+}
+
+void wq_print_stats(FILE *f, struct work_queue *q)
+{
+    uint64_t popped = q->popped;
+
+    fprintf(f, "[Queue] depth: %d, queued: %llu, refused: %llu, served: %llu, wait avg: %llu us, max: %llu us\n",
+            q->depth, (unsigned long long)q->pushed, (unsigned long long)q->refused,
+            (unsigned long long)popped, (unsigned long long)(popped ? q->wait_total_us / popped : 0),
+            (unsigned long long)q->wait_max_us);
+
+    // only the non-empty part of the histogram
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        if (0 == q->wait_histogram[i])
+            continue;
+        fprintf(f, "[Queue]   wait < %llu us: %llu\n", 1ULL << (i + 1),
+                (unsigned long long)q->wait_histogram[i]);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// bounded multi-producer multi-consumer queue of accepted clients
+//
+// the ring itself is lock-free (D. Vyukov's bounded MPMC queue - every cell
+// has a sequence number telling whether it is free for the producer of the
+// given round or full for its consumer), two semaphores count free and
+// full cells, so consumers sleep while the queue is empty and producers
+// can wait for (or give up on) a free cell
+
+// what happens to a new client when the queue is full
+enum admission_policy {
+    // the acceptor waits for a free place, new clients wait in the listen backlog
+    ADMIT_BLOCK,
+    // the client is disconnected at once
+    ADMIT_SHED,
+    // the client gets the "busy" reply and is disconnected
+    ADMIT_REJECT
+};
+
+struct work_item {
+    int client_fd;
+    // when the item has been queued, for the wait metrics
+    int64_t enqueued_ns;
+};
+
+struct work_cell {
+    // cell i is free for the producer when seq == position,
+    // full for the consumer when seq == position + 1
+    uint64_t seq;
+    struct work_item item;
+};
+
+// log2 histogram of waiting times, bucket i counts waits in [2^i, 2^(i+1)) us
+#define WAIT_BUCKETS 32
+
+struct work_queue {
+    struct work_cell *cells;
+    uint64_t mask;
+    int depth;
+
+    // producers and consumers take positions from different cache lines
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+
+    sem_t free_cells;
+    sem_t full_cells;
+
+    // metrics, updated atomically
+    uint64_t pushed __attribute__((aligned(64)));
+    uint64_t refused;
+    uint64_t popped;
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+    uint64_t wait_histogram[WAIT_BUCKETS];
+};
+
+// the queue holds up to depth items
+void wq_init(struct work_queue *q, int depth);
+
+void wq_destroy(struct work_queue *q);
+
+// queues the item, with ADMIT_BLOCK waits for a free place, with the other
+// policies returns -1 if the queue is full
+int wq_push(struct work_queue *q, struct work_item *item, enum admission_policy policy);
+
+// like wq_push with ADMIT_BLOCK, but gives up after timeout_ms, returns -1 then
+int wq_push_timed(struct work_queue *q, struct work_item *item, int timeout_ms);
+
+// takes the oldest item, sleeps while the queue is empty (it's a cancellation point)
+void wq_pop(struct work_queue *q, struct work_item *item);
+
+// like wq_pop, but gives up after timeout_ms, returns -1 then
+int wq_pop_timed(struct work_queue *q, struct work_item *item, int timeout_ms);
+
+// returns the number of queued items (approximate if the queue is in use)
+int wq_length(struct work_queue *q);
+
+// parses "block", "shed" or "reject", returns -1 on error
+int wq_parse_policy(const char *name, enum admission_policy *policy);
+
+void wq_print_stats(FILE *f, struct work_queue *q);
+
+#endif
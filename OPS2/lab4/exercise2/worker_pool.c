@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "worker_pool.h"
+#include "../../mysocklib/mysocklib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// leaves the pool if it has more workers than the target
+static int retire(struct worker_pool *p)
+{
+    int live = __atomic_load_n(&p->live, __ATOMIC_RELAXED);
+    while (live > __atomic_load_n(&p->target, __ATOMIC_RELAXED)) {
+        if (__atomic_compare_exchange_n(&p->live, &live, live - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+static void *worker_work(void *arg)
+{
+    struct worker_slot *slot = (struct worker_slot *)arg;
+    struct worker_pool *p = slot->pool;
+    struct work_item item;
+
+    aff_pin_self(&p->affinity, (int)(slot - p->slots));
+
+    while (1) {
+        // waiting is a cancellation point, serving a client is not
+        if (wq_pop_timed(p->queue, &item, IDLE_TIMEOUT_MS)) {
+            if (retire(p))
+                break;
+            continue;
+        }
+
+        if (pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL))
+            ERR("pthread_setcancelstate() failed");
+
+        // either pool_stop sees the client and disconnects it, or the
+        // worker sees stopping and doesn't start serving it
+        __atomic_store_n(&slot->client_fd, item.client_fd, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+            if (TEMP_FAILURE_RETRY(close(item.client_fd)) < 0)
+                ERR("close() failed");
+        } else {
+            int64_t start = monotonic_ns();
+            p->handle(item.client_fd, p->arg);
+            __atomic_fetch_add(&p->busy_ns, monotonic_ns() - start, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&slot->client_fd, -1, __ATOMIC_SEQ_CST);
+
+        if (pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL))
+            ERR("pthread_setcancelstate() failed");
+    }
+
+    __atomic_store_n(&slot->state, SLOT_EXITED, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// starts workers until there are as many as the target (called by one thread at a time)
+static void spawn_workers(struct worker_pool *p)
+{
+    for (int i = 0; i < p->max_workers && __atomic_load_n(&p->live, __ATOMIC_RELAXED) < p->target; i++) {
+        struct worker_slot *slot = &p->slots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_FREE)
+            continue;
+
+        slot->state = SLOT_RUNNING;
+        slot->client_fd = -1;
+        __atomic_fetch_add(&p->live, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&slot->tid, NULL, worker_work, slot))
+            ERR("pthread_create() failed");
+    }
+
+    int live = __atomic_load_n(&p->live, __ATOMIC_RELAXED);
+    if (live > p->peak)
+        p->peak = live;
+}
+
+// joins the workers which have left
+static void reap_workers(struct worker_pool *p)
+{
+    for (int i = 0; i < p->max_workers; i++) {
+        struct worker_slot *slot = &p->slots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_EXITED)
+            continue;
+        if (pthread_join(slot->tid, NULL))
+            ERR("pthread_join() failed");
+        slot->state = SLOT_FREE;
+        p->reaped++;
+    }
+}
+
+static void *controller_work(void *arg)
+{
+    struct worker_pool *p = (struct worker_pool *)arg;
+    struct work_queue *q = p->queue;
+
+    uint64_t last_popped = q->popped;
+    uint64_t last_wait = q->wait_total_us;
+    uint64_t last_busy = p->busy_ns;
+    int64_t last_time = monotonic_ns();
+    int high_ticks = 0, low_ticks = 0;
+
+    while (!p->stopping) {
+        bulk_nanosleep(0, CONTROL_TICK_MS * 1000000);
+
+        reap_workers(p);
+
+        uint64_t popped = __atomic_load_n(&q->popped, __ATOMIC_RELAXED);
+        uint64_t wait = __atomic_load_n(&q->wait_total_us, __ATOMIC_RELAXED);
+        uint64_t busy = __atomic_load_n(&p->busy_ns, __ATOMIC_RELAXED);
+        int64_t time = monotonic_ns();
+        int live = __atomic_load_n(&p->live, __ATOMIC_RELAXED);
+        int queued = wq_length(q);
+
+        // busy_ns and the waits grow only when a client is finished or
+        // taken, so workers stuck with slow clients are counted as they are now
+        int serving = 0;
+        for (int i = 0; i < p->max_workers; i++)
+            if (__atomic_load_n(&p->slots[i].client_fd, __ATOMIC_RELAXED) >= 0)
+                serving++;
+
+        // average wait of the clients taken in this tick and the part of
+        // the tick the workers have been busy, at least the part of them
+        // serving a client right now
+        uint64_t avg_wait = popped > last_popped ? (wait - last_wait) / (popped - last_popped) : 0;
+        double utilization = live > 0 ? (double)(busy - last_busy) / ((double)(time - last_time) * live) : 1.0;
+        if (live > 0 && (double)serving / live > utilization)
+            utilization = (double)serving / live;
+
+        last_popped = popped;
+        last_wait = wait;
+        last_busy = busy;
+        last_time = time;
+
+        // clients waiting while nobody is free count as long waits, the
+        // workers may be stuck with slow clients and take nobody
+        int high = avg_wait > HIGH_WAIT_US || (queued > 0 && serving >= live);
+        int low = !high && 0 == queued && utilization < LOW_UTILIZATION;
+
+        high_ticks = high ? high_ticks + 1 : 0;
+        low_ticks = low ? low_ticks + 1 : 0;
+
+        int target = p->target;
+        if (high_ticks >= GROW_TICKS && target < p->max_workers) {
+            target += target / 2 > 1 ? target / 2 : 1;
+            if (target > p->max_workers)
+                target = p->max_workers;
+            p->grown++;
+            high_ticks = 0;
+        } else if (low_ticks >= SHRINK_TICKS && target > p->min_workers) {
+            target--;
+            p->shrunk++;
+            low_ticks = 0;
+        }
+
+        if (target != p->target) {
+            fprintf(stderr, "[Pool] %d -> %d workers (wait %llu us, utilization %d%%, queued %d)\n",
+                    p->target, target, (unsigned long long)avg_wait, (int)(utilization * 100), queued);
+            __atomic_store_n(&p->target, target, __ATOMIC_RELAXED);
+        }
+
+        spawn_workers(p);
+    }
+
+    return NULL;
+}
+
+void pool_start(struct worker_pool *p, struct work_queue *queue, int min_workers, int max_workers,
+                void (*handle)(int client_fd, void *arg), void *arg)
+{
+    memset(p, 0, sizeof(struct worker_pool));
+    p->queue = queue;
+    p->handle = handle;
+    p->arg = arg;
+    p->min_workers = min_workers;
+    p->max_workers = max_workers > POOL_SLOTS ? POOL_SLOTS : max_workers;
+    p->target = min_workers;
+    aff_plan_from_env(&p->affinity);
+
+    for (int i = 0; i < POOL_SLOTS; i++) {
+        p->slots[i].pool = p;
+        p->slots[i].state = SLOT_FREE;
+        p->slots[i].client_fd = -1;
+    }
+
+    spawn_workers(p);
+
+    if (pthread_create(&p->controller, NULL, controller_work, p))
+        ERR("pthread_create() failed");
+}
+
+void pool_stop(struct worker_pool *p)
+{
+    __atomic_store_n(&p->stopping, 1, __ATOMIC_SEQ_CST);
+    if (pthread_join(p->controller, NULL))
+        ERR("pthread_join() failed");
+
+    // a worker which has already left is still there to be joined
+    for (int i = 0; i < p->max_workers; i++) {
+        if (SLOT_FREE == p->slots[i].state)
+            continue;
+
+        // serving a client isn't a cancellation point, the worker would wait
+        // for the client as long as it keeps the connection open, after the
+        // shutdown its recv and send return at once, the worker closes the
+        // socket itself (the number may already be reused for a file, that
+        // shutdown fails harmlessly)
+        int client_fd = __atomic_load_n(&p->slots[i].client_fd, __ATOMIC_SEQ_CST);
+        if (client_fd >= 0 && shutdown(client_fd, SHUT_RDWR) && ENOTCONN != errno && ENOTSOCK != errno &&
+            EBADF != errno)
+            ERR("shutdown() failed");
+
+        // older glibc reports ESRCH for a thread which has terminated
+        int error = pthread_cancel(p->slots[i].tid);
+        if (error && ESRCH != error)
+            ERR("pthread_cancel() failed");
+    }
+    for (int i = 0; i < p->max_workers; i++) {
+        if (SLOT_FREE == p->slots[i].state)
+            continue;
+        if (pthread_join(p->slots[i].tid, NULL))
+            ERR("pthread_join() failed");
+        p->slots[i].state = SLOT_FREE;
+        p->slots[i].client_fd = -1;
+    }
+    aff_plan_destroy(&p->affinity);
+}
+
+void pool_print_stats(FILE *f, struct worker_pool *p)
+{
+    fprintf(f, "[Pool] workers: %d-%d, peak: %d, grown: %llu times, shrunk: %llu times, idle workers reaped: %llu\n",
+            p->min_workers, p->max_workers, p->peak, (unsigned long long)p->grown,
+            (unsigned long long)p->shrunk, (unsigned long long)p->reaped);
+    aff_print_plan(f, &p->affinity);
+}
@@ -0,0 +1,89 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+#include "../../affinity/affinity.h"
+#include "work_queue.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// workers taking clients from the queue, their number follows the load
+//
+// a controller thread looks at the queue every CONTROL_TICK_MS: if clients
+// wait longer than HIGH_WAIT_US (or the queue isn't empty while every worker
+// is serving a client, however long it takes) for GROW_TICKS ticks in a row, the target number of workers grows
+// by half, if the workers are busy less than LOW_UTILIZATION of the time and
+// nobody waits for SHRINK_TICKS ticks in a row, it goes down by one, the
+// different lengths of the two streaks are the hysteresis, a burst is
+// absorbed at once, the workers are given back slowly
+//
+// the pool never kills a busy worker, a worker with nothing to do for
+// IDLE_TIMEOUT_MS leaves if there are more workers than the target, the
+// controller joins it later
+//
+// a worker is pinned as AFFINITY says (see affinity.h) by its slot, so a
+// replacement of a worker which has left runs where it used to
+#define CONTROL_TICK_MS 100
+#define IDLE_TIMEOUT_MS 100
+#define HIGH_WAIT_US 2000
+#define LOW_UTILIZATION 0.3
+#define GROW_TICKS 2
+#define SHRINK_TICKS 30
+// the upper limit of max_workers
+#define POOL_SLOTS 256
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_RUNNING,
+    // the worker has left, it has to be joined
+    SLOT_EXITED
+};
+
+struct worker_pool;
+
+struct worker_slot {
+    struct worker_pool *pool;
+    pthread_t tid;
+    int state;
+    // the client being served, -1 if none, pool_stop disconnects it
+    int client_fd;
+};
+
+struct worker_pool {
+    struct work_queue *queue;
+    // serves one client and closes the connection
+    void (*handle)(int client_fd, void *arg);
+    void *arg;
+
+    int min_workers;
+    int max_workers;
+    int target;
+    // running workers, they decrement it when they leave
+    int live;
+
+    pthread_t controller;
+    volatile int stopping;
+    struct aff_plan affinity;
+
+    struct worker_slot slots[POOL_SLOTS];
+
+    // time the workers have spent serving clients
+    uint64_t busy_ns;
+
+    // decisions of the controller
+    uint64_t grown;
+    uint64_t shrunk;
+    uint64_t reaped;
+    int peak;
+};
+
+// starts min_workers workers and the controller
+void pool_start(struct worker_pool *p, struct work_queue *queue, int min_workers, int max_workers,
+                void (*handle)(int client_fd, void *arg), void *arg);
+
+// stops the controller and the workers, the clients being served are
+// disconnected, so a worker waiting for a slow client finishes at once
+void pool_stop(struct worker_pool *p);
+
+void pool_print_stats(FILE *f, struct worker_pool *p);
+
+#endif
@@ -1,362 +1,560 @@
-#define _GNU_SOURCE
-#include "../../mysocklib/mysocklib.h"
-#include <netinet/in.h>
-#include <semaphore.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <fcntl.h>
-
-#define BACKLOG 3
-#define MAX_CLIENTS 3
-
-volatile sig_atomic_t do_work = 1;
-
-void usage(char *name)
-{
-    fprintf(stderr, "USAGE: %s port\n", name);
-}
-
-typedef struct thread_args{
-    int id;
-    pthread_t *tids;
-    int client_fd;
-    pthread_barrier_t *barrier;
-    pthread_cond_t *cond_var;
-    pthread_mutex_t *cond_mtx;
-    int *last_id;
-    char *last_letter;
-    sem_t *sem;
-    int *thread_count;
-    pthread_mutex_t *thread_count_mtx;
-} thread_args_t;
-
-void sigint_handler(int sigNo);
-
-void do_server(int server_fd);
-
-// thread
-void *handle_client(void* arg);
-void first_stage(thread_args_t* args);
-void second_stage(thread_args_t* args);
-
-// cleanups
-void main_cleanup(void* arg);
-void mtx_cleanup(void* arg);
-void barrier_cleanup(void* arg);
-
-int main(int argc, char** argv)
-{
-    int server_fd;
-    if (argc != 2) {
-        usage(argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    if (sethandler(SIG_IGN, SIGPIPE))
-        ERR("Setting PIPE failed");
-
-    if (sethandler(sigint_handler, SIGINT))
-        ERR("Setting SIGINT failed");
-
-    // non blocking mode tcp ipv4
-    server_fd = TCP_IPv4_bind_socket(atoi(argv[1]), BACKLOG);
-    int new_flags = fcntl(server_fd, F_GETFL) | O_NONBLOCK;
-    if (fcntl(server_fd, F_SETFL, new_flags) == -1)
-        ERR("fcntl");
-
-    do_server(server_fd);
-
-    // close the server
-    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
-        ERR("Cannot close server_fd");
-
-    fprintf(stderr, "[Server] Terminated\n");
-
-    return EXIT_SUCCESS;
-}
-
-void sigint_handler(int sigNo)
-{
-    do_work = 0;
-}
-
-void do_server(int server_fd)
-{
-    pthread_t tids[MAX_CLIENTS];
-    for (int i = 0; i < MAX_CLIENTS; ++i)
-        tids[i] = -1;
-
-    pthread_mutex_t  thread_count_mtx = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_t cond_mtx = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
-
-    pthread_barrier_t barrier;
-    if (pthread_barrier_init(&barrier, NULL, MAX_CLIENTS))
-        ERR("pthread_barrier_init()");
-
-    int thread_count = 0;
-    int last_id = 0;
-    char last_letter = 'A';
-
-    // initialize unnamed semaphroe
-    sem_t thrds_sem;
-    if (sem_init(&thrds_sem,0,MAX_CLIENTS))
-        ERR("sem_init()");
-
-    // descriptors for pselect (pselect blocks in order to wait for incoming clients connections)
-    fd_set base_rfds, rfds;
-    FD_ZERO(&base_rfds);
-    FD_SET(server_fd, &base_rfds);
-
-    // SIGINT and SIGUSR1 will be ignoered if pselect is not running
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigprocmask(SIG_BLOCK, &mask, &oldmask);
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    fprintf(stderr, "[Server] Started\n");
-
-    while (do_work) {
-        rfds = base_rfds;
-        if (pselect(server_fd + 1, &rfds, NULL, NULL, NULL, &oldmask) != -1) {
-
-            // new client connection is pending
-            int client_fd;
-            if ((client_fd = add_new_client(server_fd)) == -1)
-                continue;
-
-            // order one thread for the client if it is possible
-            if (sem_trywait(&thrds_sem) == -1) {
-                if (errno == EAGAIN) {
-                    // the semaphore was already locked
-                    // send an information about full server to the client
-                    char buff = '0';
-                    if (TEMP_FAILURE_RETRY(send(client_fd, &buff, sizeof(char), 0))) {
-                        // ignore error caused by situation when the client is disconnected
-                        if (errno != EPIPE)
-                            ERR("send()");
-                    }
-                    continue;
-                } else {
-                    ERR("sem_trywait()");
-                }
-            }
-
-            // initialize arguments for the new thread handling a client
-            thread_args_t *args;
-            if ((args = (thread_args_t*)malloc(sizeof(thread_args_t))) == NULL)
-                ERR("malloc()");
-            args->client_fd = client_fd;
-            args->sem = &thrds_sem;
-            args->thread_count = &thread_count;
-            args->thread_count_mtx = &thread_count_mtx;
-            args->cond_mtx = &cond_mtx;
-            args->cond_var = &cond_var;
-            args->last_id = &last_id;
-            args->last_letter = &last_letter;
-            args->barrier = &barrier;
-            args->tids = tids;
-
-            // increment the thread count
-            if (pthread_mutex_lock(args->thread_count_mtx))
-                ERR("pthread_mutex_lock()");
-            args->id = ++thread_count;
-
-            if (pthread_mutex_unlock(args->thread_count_mtx))
-                ERR("pthread_mutex_unlock()");
-
-            // create a new thread for the client
-            pthread_t tid = -1;
-            if (pthread_create(&tid, NULL, handle_client, (void *)args))
-                ERR("pthread_create");
-            tids[args->id - 1] = tid;
-
-            // detach the thread
-            if (pthread_detach(tid))
-                ERR("pthread_detach");
-
-
-        } else if (errno != EINTR) {
-                ERR("pselect()");
-        }
-    }
-
-    if (sem_destroy(&thrds_sem))
-        ERR("sem_destroy()");
-
-    if (pthread_mutex_destroy(&thread_count_mtx))
-        ERR("pthread_mutex_destroy()");
-
-    if (pthread_mutex_destroy(&cond_mtx))
-        ERR("pthread_mutex_destroy()");
-
-    if (pthread_cond_destroy(&cond_var))
-        ERR("pthread_cond_destroy()");
-}
-
-void *handle_client(void* arg)
-{
-    thread_args_t *args = (thread_args_t*) arg;
-
-    // push the main cleanup
-    pthread_cleanup_push(main_cleanup, (void *) args);
-
-    /* FIRST STATE - WAITING FOR ALL THE CLIENTS */
-    first_stage(args);
-
-    pthread_cleanup_push(barrier_cleanup, (void *) args);
-
-    pthread_cleanup_push(mtx_cleanup, (void *) args);
-
-    /* SECOND STATE - ,,LITEROWANIE'' */
-    second_stage(args);
-
-    if (args->id == MAX_CLIENTS) {
-        // it is the last thread - reset values
-        // all the other threads are blocked at this point, so this access is valid
-        *args->last_id = 0;
-        *args->last_letter = 'A';
-    } else {
-        // wakeup the next thread
-        pthread_cond_broadcast(args->cond_var);
-    }
-
-    // unlock the mutex by poping mtx_cleanup
-    pthread_cleanup_pop(1);
-
-    // call the barrier
-    pthread_cleanup_pop(1);
-
-    // to main cleanup
-    pthread_cleanup_pop(1);
-
-    return NULL;
-}
-
-void first_stage(thread_args_t* args)
-{
-    // control message
-    char buff = '1';
-
-    while (1) {
-        // break the loop if there are MAX_CLIENTS clients
-        if (pthread_mutex_lock(args->thread_count_mtx))
-            ERR("pthread_mutex_lock()");
-        if (*args->thread_count >= MAX_CLIENTS) {
-            if (pthread_mutex_unlock(args->thread_count_mtx))
-                ERR("pthread_mutex_unlock()");
-            break;
-        }
-        if (pthread_mutex_unlock(args->thread_count_mtx))
-            ERR("pthread_mutex_unlock()");
-
-        // send control message to the client
-        if (TEMP_FAILURE_RETRY(send(args->client_fd, &buff, sizeof(char), 0)) == -1) {
-            // ignore error caused by situation when the client is disconnected
-            if (errno == EPIPE) {
-                // call the cleanup func and terminate the thread
-                pthread_exit(NULL);
-            } else {
-                ERR("send()");
-            }
-        }
-
-        // sleep 1 sec before the next notification
-        bulk_nanosleep(1, 0);
-    }
-}
-
-void second_stage(thread_args_t* args)
-{
-    if (pthread_mutex_lock(args->cond_mtx))
-        ERR("pthread_mutex_lock()");
-
-    while (*args->last_id + 1 != args->id) {
-        // The application shall ensure that pthread_cond_wait function is called
-        // with the mutex locked by the calling thread (manual)
-        pthread_cond_wait(args->cond_var, args->cond_mtx);
-    }
-
-    *args->last_id = args->id;
-
-    char letter = '0';
-    char waiting_for = (char)((*args->last_letter + 1) % 'A' + 'A');
-
-    fprintf(stderr, "[Server] Waiting for %c\n", waiting_for);
-
-    if (TEMP_FAILURE_RETRY(send(args->client_fd, args->last_letter, sizeof(char), 0)) == -1) {
-        // ignore error caused by situation when the client is disconnected (it will be checked in recv)
-        if (errno != EPIPE)
-            ERR("send()");
-    }
-
-    while (letter != waiting_for) {
-        ssize_t size;
-        if (TEMP_FAILURE_RETRY(size = (recv(args->client_fd, &letter, sizeof(char), 0))) == -1)
-            ERR("recv()");
-
-        if (size == 0) {
-            // eof detected => cancel threads
-            for (int i = 1; i <= MAX_CLIENTS; ++i) {
-                if (i == args->id) continue;
-                if (pthread_cancel(args->tids[i - 1]))
-                    ERR("pthread_cancel()");
-            }
-
-            pthread_exit(NULL);
-        }
-    }
-
-    *args->last_letter = letter;
-}
-
-void main_cleanup(void* arg)
-{
-    thread_args_t *args = (thread_args_t*) arg;
-
-    fprintf(stderr, "[Server] Cleanup %d\n", args->id);
-
-    // decrement the thread count
-    if (pthread_mutex_lock(args->thread_count_mtx))
-        ERR("pthread_mutex_lock()");
-    (*args->thread_count)--;
-    if (pthread_mutex_unlock(args->thread_count_mtx))
-        ERR("pthread_mutex_unlock()");
-
-    // resource (thread) should be available from now
-    sem_post(args->sem);
-
-    if (TEMP_FAILURE_RETRY(close(args->client_fd)))
-        ERR("close()");
-
-    free(args);
-
-    printf("[Server] Thread finished succesfuly");
-}
-
-void mtx_cleanup(void* arg)
-{
-    thread_args_t *args = (thread_args_t*) arg;
-    if (pthread_mutex_unlock(args->cond_mtx))
-        ERR("pthread_mutex_unlock()");
-}
-
-void barrier_cleanup(void* arg)
-{
-    thread_args_t *args = (thread_args_t*) arg;
-    fprintf(stderr, "[Server] On barrier - %d\n", args->id);
-    // wait for all threads to reach that point
-    int result;
-    if ((result = pthread_barrier_wait(args->barrier))) {
-        // the constant PTHREAD_BARRIER_SERIAL_THREAD shall be returned to
-        // one  unspecified  thread  and  zero  shall  be returned to each of the remaining
-        // threads (manual)
-        if (result != PTHREAD_BARRIER_SERIAL_THREAD)
-            ERR("pthread_barrier_wait()");
-    }
-
-    // NIE WIEM JAKIM CUDEM, ALE JAK NIE MA TEGO PRINTA TO NIE DZIALA
-    fprintf(stderr, "[Server] Barrier end - %d\n", args->id);
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include "../../mysocklib/mysocklib.h"
+#include "../../affinity/affinity.h"
+#include "../../mempool/mempool.h"
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// the main thread keeps the lobby: it accepts the players, sends them the
+// control message every second and as soon as MAX_CLIENTS of them wait,
+// it makes a game of them and hands it over to one of the event loops
+// (through a list and an eventfd), every loop runs the letter passing of
+// all its games, so any number of games is played at the same time on
+// LOOP_THREADS threads
+// the games come from a slab pool, the lobby allocates them from its cache,
+// the loops free them to theirs, so a game costs no malloc once the pool
+// has warmed up, the loops are pinned as AFFINITY says (see affinity.h)
+// a burst of players has to fit in the listen queue, otherwise the kernel
+// drops their handshakes and they retry after a second or more
+#define BACKLOG 1024
+// players in one game
+#define MAX_CLIENTS 3
+#define LOOP_THREADS 4
+// connected players in total, the next ones get '0'
+#define MAX_PLAYERS 65536
+#define MAX_EVENTS 64
+// the control message is sent to the players in the lobby that often
+#define HEARTBEAT_MS 1000
+// games allocated at once when the caches run dry
+#define GAME_SLAB 256
+
+volatile sig_atomic_t do_work = 1;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s port\n", name);
+}
+
+struct game;
+
+struct player {
+    int fd;
+    int index;
+    struct game *game;
+};
+
+struct game {
+    struct player players[MAX_CLIENTS];
+    // the player whose letter is awaited
+    int turn;
+    char last_letter;
+    // aborted or finished, freed after the current batch of events
+    int over;
+
+    // games of the loop (or the handover list, or the graveyard)
+    struct game *prev;
+    struct game *next;
+};
+
+struct loop {
+    pthread_t tid;
+    int id;
+    const struct aff_plan *affinity;
+    int epoll_fd;
+    int event_fd;
+
+    // games handed over by the lobby
+    pthread_mutex_t mutex;
+    struct game *incoming;
+    int stopping;
+
+    struct game *games;
+    struct game *graveyard;
+    struct mp_cache game_cache;
+
+    uint64_t started;
+    uint64_t finished;
+    uint64_t aborted;
+};
+
+// connected players, the lobby increments, the loops decrement
+int player_count = 0;
+
+void sigint_handler(int sigNo);
+void do_server(int server_fd);
+void *loop_work(void *arg);
+
+int main(int argc, char** argv)
+{
+    int server_fd;
+    if (argc != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("Setting PIPE failed");
+
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Setting SIGINT failed");
+
+    // non blocking mode tcp ipv4
+    server_fd = TCP_IPv4_bind_socket(atoi(argv[1]), BACKLOG);
+    int new_flags = fcntl(server_fd, F_GETFL) | O_NONBLOCK;
+    if (fcntl(server_fd, F_SETFL, new_flags) == -1)
+        ERR("fcntl");
+
+    do_server(server_fd);
+
+    // close the server
+    if (TEMP_FAILURE_RETRY(close(server_fd)) < 0)
+        ERR("Cannot close server_fd");
+
+    fprintf(stderr, "[Server] Terminated\n");
+
+    return EXIT_SUCCESS;
+}
+
+void sigint_handler(int sigNo)
+{
+    do_work = 0;
+}
+
+// sends one control byte or letter, the socket buffer is never full with
+// that little traffic, so EAGAIN means the player doesn't read at all
+int send_byte(int fd, char c)
+{
+    if (TEMP_FAILURE_RETRY(send(fd, &c, sizeof(char), MSG_DONTWAIT)) == -1) {
+        // ignore error caused by situation when the client is disconnected
+        if (errno != EPIPE && errno != ECONNRESET && errno != EAGAIN)
+            ERR("send()");
+        return -1;
+    }
+    return 0;
+}
+
+void close_player(int fd)
+{
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close()");
+    __atomic_fetch_sub(&player_count, 1, __ATOMIC_RELAXED);
+}
+
+/* LOOP - THE GAMES */
+
+// moves the game to the graveyard and disconnects its players (closing
+// removes them from the epoll)
+void end_game(struct loop *l, struct game *g, int aborted)
+{
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+        close_player(g->players[i].fd);
+
+    if (g->prev)
+        g->prev->next = g->next;
+    else
+        l->games = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+
+    g->over = 1;
+    g->next = l->graveyard;
+    l->graveyard = g;
+
+    if (aborted)
+        l->aborted++;
+    else
+        l->finished++;
+}
+
+// sends the last letter to the player whose turn it is and waits for its answer
+int give_turn(struct loop *l, struct game *g)
+{
+    struct player *p = &g->players[g->turn];
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = p;
+    if (epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, p->fd, &event))
+        ERR("epoll_ctl()");
+
+    return send_byte(p->fd, g->last_letter);
+}
+
+void start_game(struct loop *l, struct game *g)
+{
+    struct epoll_event event;
+
+    g->prev = NULL;
+    g->next = l->games;
+    if (l->games)
+        l->games->prev = g;
+    l->games = g;
+    l->started++;
+
+    // the players who wait for their turn are watched only for hanging up
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        event.events = EPOLLRDHUP;
+        event.data.ptr = &g->players[i];
+        if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, g->players[i].fd, &event))
+            ERR("epoll_ctl()");
+    }
+
+    if (give_turn(l, g))
+        end_game(l, g, 1);
+}
+
+void handle_player(struct loop *l, struct player *p)
+{
+    struct game *g = p->game;
+    char buffer[64];
+    ssize_t size;
+
+    // an earlier event of this batch has ended the game
+    if (g->over)
+        return;
+
+    // a player who hasn't played yet has left
+    if (p->index > g->turn) {
+        end_game(l, g, 1);
+        return;
+    }
+
+    if ((size = TEMP_FAILURE_RETRY(recv(p->fd, buffer, sizeof(buffer), MSG_DONTWAIT))) == -1) {
+        if (errno == EAGAIN)
+            return;
+        if (errno != ECONNRESET)
+            ERR("recv()");
+        size = 0;
+    }
+
+    if (size == 0) {
+        // eof detected => the game is over for everyone
+        end_game(l, g, 1);
+        return;
+    }
+
+    char waiting_for = (char)((g->last_letter + 1) % 'A' + 'A');
+    if (memchr(buffer, waiting_for, size) == NULL)
+        return;
+
+    g->last_letter = waiting_for;
+
+    // the player has played, it may leave now
+    if (epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, p->fd, NULL))
+        ERR("epoll_ctl()");
+
+    if (++g->turn == MAX_CLIENTS)
+        end_game(l, g, 0);
+    else if (give_turn(l, g))
+        end_game(l, g, 1);
+}
+
+// starts the games handed over by the lobby, returns 1 if the loop has to stop
+int take_incoming(struct loop *l)
+{
+    uint64_t value;
+    struct game *g;
+    int stopping;
+
+    if (read(l->event_fd, &value, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+        ERR("read()");
+
+    if (pthread_mutex_lock(&l->mutex))
+        ERR("pthread_mutex_lock()");
+    g = l->incoming;
+    l->incoming = NULL;
+    stopping = l->stopping;
+    if (pthread_mutex_unlock(&l->mutex))
+        ERR("pthread_mutex_unlock()");
+
+    while (g) {
+        struct game *next = g->next;
+        start_game(l, g);
+        g = next;
+    }
+
+    return stopping;
+}
+
+void *loop_work(void *arg)
+{
+    struct loop *l = (struct loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int stopping = 0;
+
+    aff_pin_self(l->affinity, l->id);
+
+    while (!stopping) {
+        int count;
+        if ((count = epoll_wait(l->epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait()");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (NULL == events[i].data.ptr)
+                stopping = take_incoming(l);
+            else
+                handle_player(l, (struct player *)events[i].data.ptr);
+        }
+
+        // no event of this batch refers to them any more
+        while (l->graveyard) {
+            struct game *next = l->graveyard->next;
+            mp_free(&l->game_cache, l->graveyard);
+            l->graveyard = next;
+        }
+    }
+
+    // the server is stopping, unfinished games are aborted
+    while (l->games)
+        end_game(l, l->games, 1);
+    while (l->graveyard) {
+        struct game *next = l->graveyard->next;
+        mp_free(&l->game_cache, l->graveyard);
+        l->graveyard = next;
+    }
+
+    return NULL;
+}
+
+void handover(struct loop *l, struct game *g, int stop)
+{
+    uint64_t one = 1;
+
+    if (pthread_mutex_lock(&l->mutex))
+        ERR("pthread_mutex_lock()");
+    if (g) {
+        g->next = l->incoming;
+        l->incoming = g;
+    }
+    if (stop)
+        l->stopping = 1;
+    if (pthread_mutex_unlock(&l->mutex))
+        ERR("pthread_mutex_unlock()");
+
+    if (write(l->event_fd, &one, sizeof(uint64_t)) < 0)
+        ERR("write()");
+}
+
+/* LOBBY - THE MAIN THREAD */
+
+struct lobby {
+    int epoll_fd;
+    int waiting[MAX_CLIENTS];
+    int count;
+    // the loop the next game goes to
+    int next_loop;
+    struct mp_cache game_cache;
+};
+
+void lobby_remove(struct lobby *lb, int i)
+{
+    if (epoll_ctl(lb->epoll_fd, EPOLL_CTL_DEL, lb->waiting[i], NULL))
+        ERR("epoll_ctl()");
+    lb->waiting[i] = lb->waiting[--lb->count];
+}
+
+void lobby_accept(struct lobby *lb, struct loop *loops, int server_fd)
+{
+    int client_fd;
+
+    while ((client_fd = add_new_client(server_fd)) != -1) {
+        // send an information about full server to the client
+        if (__atomic_load_n(&player_count, __ATOMIC_RELAXED) >= MAX_PLAYERS) {
+            send_byte(client_fd, '0');
+            if (TEMP_FAILURE_RETRY(close(client_fd)))
+                ERR("close()");
+            continue;
+        }
+        __atomic_fetch_add(&player_count, 1, __ATOMIC_RELAXED);
+
+        // control message, the player waits for the others
+        if (send_byte(client_fd, '1')) {
+            close_player(client_fd);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLRDHUP;
+        event.data.fd = client_fd;
+        if (epoll_ctl(lb->epoll_fd, EPOLL_CTL_ADD, client_fd, &event))
+            ERR("epoll_ctl()");
+        lb->waiting[lb->count++] = client_fd;
+
+        if (lb->count < MAX_CLIENTS)
+            continue;
+
+        // there are MAX_CLIENTS players - a new game
+        struct game *g = (struct game *)mp_alloc(&lb->game_cache);
+        memset(g, 0, sizeof(struct game));
+        g->last_letter = 'A';
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            g->players[i].fd = lb->waiting[i];
+            g->players[i].index = i;
+            g->players[i].game = g;
+            if (epoll_ctl(lb->epoll_fd, EPOLL_CTL_DEL, lb->waiting[i], NULL))
+                ERR("epoll_ctl()");
+        }
+        lb->count = 0;
+
+        handover(&loops[lb->next_loop], g, 0);
+        lb->next_loop = (lb->next_loop + 1) % LOOP_THREADS;
+    }
+}
+
+void lobby_heartbeat(struct lobby *lb)
+{
+    for (int i = 0; i < lb->count; ++i) {
+        if (send_byte(lb->waiting[i], '1') == 0)
+            continue;
+        int fd = lb->waiting[i];
+        lobby_remove(lb, i--);
+        close_player(fd);
+    }
+}
+
+int64_t now_ms(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime()");
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void do_server(int server_fd)
+{
+    struct loop loops[LOOP_THREADS];
+    struct lobby lobby;
+    struct lobby *lb = &lobby;
+    struct mp_pool game_pool;
+    struct aff_plan affinity;
+    struct epoll_event event;
+
+    // SIGINT will be blocked if epoll_pwait is not running, the loops inherit
+    // the mask, so it's always handled by the main thread
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    mp_pool_init(&game_pool, sizeof(struct game), GAME_SLAB);
+    aff_plan_from_env(&affinity);
+    aff_print_plan(stderr, &affinity);
+
+    memset(loops, 0, sizeof(loops));
+    for (int i = 0; i < LOOP_THREADS; ++i) {
+        struct loop *l = &loops[i];
+        l->id = i;
+        l->affinity = &affinity;
+        mp_cache_init(&l->game_cache, &game_pool);
+        if (pthread_mutex_init(&l->mutex, NULL))
+            ERR("pthread_mutex_init()");
+        if ((l->epoll_fd = epoll_create1(0)) < 0)
+            ERR("epoll_create1()");
+        if ((l->event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            ERR("eventfd()");
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, l->event_fd, &event))
+            ERR("epoll_ctl()");
+        if (pthread_create(&l->tid, NULL, loop_work, l))
+            ERR("pthread_create()");
+    }
+
+    memset(lb, 0, sizeof(struct lobby));
+    mp_cache_init(&lb->game_cache, &game_pool);
+    if ((lb->epoll_fd = epoll_create1(0)) < 0)
+        ERR("epoll_create1()");
+    event.events = EPOLLIN;
+    event.data.fd = server_fd;
+    if (epoll_ctl(lb->epoll_fd, EPOLL_CTL_ADD, server_fd, &event))
+        ERR("epoll_ctl()");
+
+    fprintf(stderr, "[Server] Started\n");
+
+    int64_t next_heartbeat = now_ms() + HEARTBEAT_MS;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (do_work) {
+        int64_t timeout = next_heartbeat - now_ms();
+        int count;
+
+        if (timeout <= 0) {
+            lobby_heartbeat(lb);
+            next_heartbeat += HEARTBEAT_MS;
+            continue;
+        }
+
+        if ((count = epoll_pwait(lb->epoll_fd, events, MAX_EVENTS, timeout, &oldmask)) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_pwait()");
+        }
+
+        // the hang-ups go first and the new players are accepted after them,
+        // so a descriptor closed here can't be reused by a new player while
+        // the rest of the batch still refers to it
+        int accepting = 0;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == server_fd) {
+                accepting = 1;
+                continue;
+            }
+
+            // a player left the lobby, a half-closed connection counts too,
+            // even with data still queued, EPOLLRDHUP is level-triggered and
+            // would be reported again by every wait
+            for (int j = 0; j < lb->count; ++j) {
+                if (lb->waiting[j] != events[i].data.fd)
+                    continue;
+                int fd = lb->waiting[j];
+                lobby_remove(lb, j);
+                close_player(fd);
+                break;
+            }
+        }
+        if (accepting)
+            lobby_accept(lb, loops, server_fd);
+    }
+
+    while (lb->count > 0) {
+        int fd = lb->waiting[0];
+        lobby_remove(lb, 0);
+        close_player(fd);
+    }
+
+    uint64_t started = 0, finished = 0, aborted = 0;
+    for (int i = 0; i < LOOP_THREADS; ++i) {
+        struct loop *l = &loops[i];
+        handover(l, NULL, 1);
+        if (pthread_join(l->tid, NULL))
+            ERR("pthread_join()");
+
+        started += l->started;
+        finished += l->finished;
+        aborted += l->aborted;
+
+        if (TEMP_FAILURE_RETRY(close(l->event_fd)) || TEMP_FAILURE_RETRY(close(l->epoll_fd)))
+            ERR("close()");
+        if (pthread_mutex_destroy(&l->mutex))
+            ERR("pthread_mutex_destroy()");
+    }
+
+    if (TEMP_FAILURE_RETRY(close(lb->epoll_fd)))
+        ERR("close()");
+
+    fprintf(stderr, "[Server] Games started: %llu, finished: %llu, aborted: %llu\n",
+            (unsigned long long)started, (unsigned long long)finished, (unsigned long long)aborted);
+    mp_pool_print_stats(stderr, "Games", &game_pool);
+    mp_pool_destroy(&game_pool);
+    aff_plan_destroy(&affinity);
+}
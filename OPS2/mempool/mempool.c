@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include "mempool.h"
+#include "../mysocklib/mysocklib.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+// the slabs are chained through their first MP_ALIGN bytes
+struct mp_slab {
+    struct mp_slab *next;
+};
+
+void mp_pool_init(struct mp_pool *p, size_t object_size, size_t slab_objects)
+{
+    memset(p, 0, sizeof(struct mp_pool));
+    if (object_size < sizeof(struct mp_batch))
+        object_size = sizeof(struct mp_batch);
+    p->object_size = ROUND_UP(object_size, MP_ALIGN);
+    p->slab_objects = slab_objects > 0 ? slab_objects : MP_BATCH;
+    if (pthread_mutex_init(&p->mutex, NULL))
+        ERR("pthread_mutex_init() failed");
+}
+
+void mp_pool_destroy(struct mp_pool *p)
+{
+    struct mp_slab *slab = (struct mp_slab *)p->slabs;
+    while (slab) {
+        struct mp_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+    p->depot = NULL;
+    if (pthread_mutex_destroy(&p->mutex))
+        ERR("pthread_mutex_destroy() failed");
+}
+
+void mp_cache_init(struct mp_cache *c, struct mp_pool *p)
+{
+    c->pool = p;
+    c->head = NULL;
+    c->count = 0;
+}
+
+// called with the mutex locked, the new objects go straight to the cache
+static void carve_slab(struct mp_cache *c)
+{
+    struct mp_pool *p = c->pool;
+    char *slab;
+
+    if ((slab = (char *)malloc(MP_ALIGN + p->slab_objects * p->object_size)) == NULL)
+        ERR("malloc() failed");
+    ((struct mp_slab *)slab)->next = (struct mp_slab *)p->slabs;
+    p->slabs = slab;
+    p->slab_count++;
+
+    // chained backwards, so the first object handed out is the first of the slab
+    for (size_t i = p->slab_objects; i-- > 0;) {
+        struct mp_batch *object = (struct mp_batch *)(slab + MP_ALIGN + i * p->object_size);
+        object->next = c->head;
+        c->head = object;
+    }
+    c->count = p->slab_objects;
+}
+
+static void refill(struct mp_cache *c)
+{
+    struct mp_pool *p = c->pool;
+
+    if (pthread_mutex_lock(&p->mutex))
+        ERR("pthread_mutex_lock() failed");
+    if (p->depot) {
+        c->head = p->depot;
+        c->count = p->depot->count;
+        p->depot = p->depot->next_batch;
+        p->depot_takes++;
+    } else {
+        carve_slab(c);
+    }
+    if (pthread_mutex_unlock(&p->mutex))
+        ERR("pthread_mutex_unlock() failed");
+}
+
+static void give_back(struct mp_pool *p, struct mp_batch *batch, size_t count)
+{
+    batch->count = count;
+
+    if (pthread_mutex_lock(&p->mutex))
+        ERR("pthread_mutex_lock() failed");
+    batch->next_batch = p->depot;
+    p->depot = batch;
+    p->depot_gives++;
+    if (pthread_mutex_unlock(&p->mutex))
+        ERR("pthread_mutex_unlock() failed");
+}
+
+void mp_cache_flush(struct mp_cache *c)
+{
+    if (c->head)
+        give_back(c->pool, c->head, c->count);
+    c->head = NULL;
+    c->count = 0;
+}
+
+void *mp_alloc(struct mp_cache *c)
+{
+    if (NULL == c->head)
+        refill(c);
+
+    struct mp_batch *object = c->head;
+    c->head = object->next;
+    c->count--;
+    return object;
+}
+
+void mp_free(struct mp_cache *c, void *object)
+{
+    struct mp_batch *b = (struct mp_batch *)object;
+    b->next = c->head;
+    c->head = b;
+
+    // the cache keeps up to two batches, so a thread which allocates and
+    // frees in turn doesn't bounce one batch to the depot and back
+    if (++c->count < 2 * MP_BATCH)
+        return;
+
+    struct mp_batch *last = c->head;
+    for (int i = 1; i < MP_BATCH; i++)
+        last = last->next;
+
+    struct mp_batch *batch = c->head;
+    c->head = last->next;
+    c->count -= MP_BATCH;
+    last->next = NULL;
+    give_back(c->pool, batch, MP_BATCH);
+}
+
+void mp_pool_print_stats(FILE *f, const char *name, struct mp_pool *p)
+{
+    fprintf(f, "[%s] object size: %zu, slabs: %llu (%zu bytes), depot takes: %llu, gives: %llu\n",
+            name, p->object_size, (unsigned long long)p->slab_count,
+            (size_t)p->slab_count * p->slab_objects * p->object_size,
+            (unsigned long long)p->depot_takes, (unsigned long long)p->depot_gives);
+}
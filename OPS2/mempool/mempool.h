@@ -0,0 +1,69 @@
+#ifndef MEMPOOL_H_
+#define MEMPOOL_H_
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// allocators for the hot paths of the servers
+//
+// mp_pool hands out objects of one size, they are cut from big slabs, so
+// there is no per-object malloc and no fragmentation, every thread keeps
+// its free objects in its own mp_cache and touches the shared depot (under
+// a mutex) only to take or give back a whole batch of MP_BATCH objects, so
+// an object allocated by one thread and freed by another is fine, the
+// objects just travel between the caches through the depot
+#define MP_BATCH 32
+#define MP_ALIGN 16
+
+// a chain of free objects, linked through their first bytes
+struct mp_batch {
+    struct mp_batch *next;
+    // only in the first object of a chain: the next chain in the depot and
+    // the length of this one
+    struct mp_batch *next_batch;
+    size_t count;
+};
+
+struct mp_pool {
+    size_t object_size;
+    size_t slab_objects;
+
+    pthread_mutex_t mutex;
+    // chains of free objects given back by the caches
+    struct mp_batch *depot;
+    // the slabs, freed by mp_pool_destroy
+    void *slabs;
+
+    uint64_t slab_count;
+    uint64_t depot_takes;
+    uint64_t depot_gives;
+};
+
+// free objects of one thread, only that thread may use it
+struct mp_cache {
+    struct mp_pool *pool;
+    struct mp_batch *head;
+    size_t count;
+};
+
+// objects of object_size bytes, slab_objects of them are allocated at once
+void mp_pool_init(struct mp_pool *p, size_t object_size, size_t slab_objects);
+
+// frees the slabs, every cache has to be flushed (or abandoned) before
+void mp_pool_destroy(struct mp_pool *p);
+
+void mp_cache_init(struct mp_cache *c, struct mp_pool *p);
+
+// gives the free objects of the cache back to the depot
+void mp_cache_flush(struct mp_cache *c);
+
+// the object isn't zeroed
+void *mp_alloc(struct mp_cache *c);
+
+// the object may come from any cache of the same pool
+void mp_free(struct mp_cache *c, void *object);
+
+void mp_pool_print_stats(FILE *f, const char *name, struct mp_pool *p);
+
+#endif
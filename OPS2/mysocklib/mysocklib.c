@@ -6,6 +6,19 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+
+// older headers don't know the UDP offload options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// set after the first refused UDP_SEGMENT send, so the fallback
+// doesn't pay for the failing syscall every time
+static int gso_unsupported = 0;
 
 int LOCAL_make_socket(char* name, int type, struct sockaddr_un *addr)
 {
@@ -368,3 +381,157 @@ void bulk_nanosleep(int sec, int nsec)
         req = rem;
     }
 }
+
+// sends count datagrams of the same size (the last one may be shorter) with one sendmsg
+static ssize_t send_gso(int fd, struct sockaddr_in *addr, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    memset(control, 0, sizeof(control));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    // the kernel cuts the buffer into datagrams of gso_size bytes
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = (uint16_t)iov[0].iov_len;
+    memcpy(CMSG_DATA(cm), &gso_size, sizeof(uint16_t));
+
+    return TEMP_FAILURE_RETRY(sendmsg(fd, &msg, 0));
+}
+
+int UDP_send_segments(int fd, struct sockaddr_in *addr, struct iovec *iov, int count)
+{
+    int sent = 0;
+
+    while (sent < count) {
+        // the group ends on a datagram of a different size, the shorter one
+        // is still the last one of the group
+        int group = 1;
+        size_t bytes = iov[sent].iov_len;
+        while (sent + group < count && group < UDP_MAX_SEGMENTS &&
+                iov[sent + group - 1].iov_len == iov[sent].iov_len &&
+                iov[sent + group].iov_len <= iov[sent].iov_len &&
+                bytes + iov[sent + group].iov_len <= UDP_MAX_GSO_BYTES) {
+            bytes += iov[sent + group].iov_len;
+            group++;
+        }
+
+        if (group > 1 && !gso_unsupported) {
+            if (send_gso(fd, addr, iov + sent, group) >= 0) {
+                sent += group;
+                continue;
+            }
+
+            // EINVAL or ENOPROTOOPT - the kernel doesn't know the option,
+            // EIO - the device can't segment, every other error is real
+            if (EINVAL != errno && ENOPROTOOPT != errno && EIO != errno)
+                return sent > 0 ? sent : -1;
+            gso_unsupported = 1;
+        }
+
+        // fallback, one datagram per syscall
+        for (int i = 0; i < group; i++) {
+            if (TEMP_FAILURE_RETRY(sendto(fd, iov[sent].iov_base, iov[sent].iov_len, 0,
+                            (struct sockaddr *)addr, sizeof(struct sockaddr_in))) < 0)
+                return sent > 0 ? sent : -1;
+            sent++;
+        }
+    }
+
+    return sent;
+}
+
+int UDP_enable_gro(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+}
+
+ssize_t UDP_recv_segments(int fd, char *buf, size_t len, int flags, struct sockaddr_in *addr, int *segment_size)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t received;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((received = recvmsg(fd, &msg, flags)) < 0)
+        return received;
+
+    // without the control message it is a single datagram
+    *segment_size = (int)received;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (SOL_UDP == cm->cmsg_level && UDP_GRO == cm->cmsg_type) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+            if (gso_size > 0)
+                *segment_size = gso_size;
+        }
+    }
+
+    return received;
+}
+
+void rto_init(struct rto_estimator *e, int64_t initial_rto, int64_t min_rto, int64_t max_rto)
+{
+    e->srtt = 0;
+    e->rttvar = 0;
+    e->rto = initial_rto;
+    e->min_rto = min_rto;
+    e->max_rto = max_rto;
+    e->has_sample = 0;
+}
+
+void rto_sample(struct rto_estimator *e, int64_t rtt)
+{
+    if (!e->has_sample) {
+        // the first measurement
+        e->srtt = rtt;
+        e->rttvar = rtt / 2;
+        e->has_sample = 1;
+    } else {
+        // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+        int64_t delta = e->srtt > rtt ? e->srtt - rtt : rtt - e->srtt;
+        e->rttvar = (3 * e->rttvar + delta) / 4;
+        e->srtt = (7 * e->srtt + rtt) / 8;
+    }
+
+    // a new measurement also cancels the backoff
+    e->rto = e->srtt + 4 * e->rttvar;
+    if (e->rto < e->min_rto)
+        e->rto = e->min_rto;
+    if (e->rto > e->max_rto)
+        e->rto = e->max_rto;
+}
+
+void rto_backoff(struct rto_estimator *e)
+{
+    e->rto *= 2;
+    if (e->rto > e->max_rto)
+        e->rto = e->max_rto;
+}
+
+int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -1,6 +1,7 @@
 #ifndef MYSOCKLIB_H_
 #define MYSOCKLIB_H_
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <stdint.h>
 #include <netdb.h>
@@ -62,4 +63,50 @@ int sethandler(void (*f)(int), int sig_no);
 
 void bulk_nanosleep(int sec, int nsec);
 
+// maximal number of datagrams passed to the kernel in one UDP_SEGMENT (GSO)
+// send and the maximal size of such a super-buffer
+#define UDP_MAX_SEGMENTS 64
+#define UDP_MAX_GSO_BYTES 65000
+
+// sends count datagrams (one per iov) to the addr with as few syscalls as
+// possible, consecutive datagrams of the same size (the last of them may be
+// shorter) go to the kernel as one UDP_SEGMENT (GSO) buffer, if the kernel
+// doesn't support it they are sent one by one, returns the number of sent
+// datagrams or -1 if none of them could be sent
+int UDP_send_segments(int fd, struct sockaddr_in *addr, struct iovec *iov, int count);
+
+// asks the kernel to coalesce datagrams of one sender (UDP_GRO), so
+// UDP_recv_segments can receive many of them at once, returns -1 if the
+// kernel doesn't support it
+int UDP_enable_gro(int fd);
+
+// receives a datagram or a group of coalesced datagrams, every one of them
+// (but the last) takes *segment_size bytes of the buf
+ssize_t UDP_recv_segments(int fd, char *buf, size_t len, int flags, struct sockaddr_in *addr, int *segment_size);
+
+// retransmission timeout estimator (RFC 6298), all times are in microseconds
+struct rto_estimator {
+    // smoothed round-trip time and its variation
+    int64_t srtt;
+    int64_t rttvar;
+    // current timeout (with the backoff applied)
+    int64_t rto;
+    int64_t min_rto;
+    int64_t max_rto;
+    int has_sample;
+};
+
+void rto_init(struct rto_estimator *e, int64_t initial_rto, int64_t min_rto, int64_t max_rto);
+
+// updates srtt and rttvar with the new measurement and recomputes the timeout,
+// according to Karn's rule only datagrams which weren't retransmitted
+// can be measured
+void rto_sample(struct rto_estimator *e, int64_t rtt);
+
+// doubles the timeout after the expiration (exponential backoff)
+void rto_backoff(struct rto_estimator *e);
+
+// monotonic time in microseconds
+int64_t monotonic_us(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include "impair.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+void rng_seed(struct rng *r, uint64_t seed)
+{
+	// the state must never be 0
+	r->state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+double rng_uniform(struct rng *r)
+{
+	r->state ^= r->state >> 12;
+	r->state ^= r->state << 25;
+	r->state ^= r->state >> 27;
+
+	// 53 upper bits fill the mantissa of the double
+	return ((r->state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double sample_delay(struct delay_model *d, struct rng *r)
+{
+	double u, v, x = 0;
+
+	switch (d->kind) {
+	case DELAY_CONST:
+		x = d->a;
+		break;
+	case DELAY_UNIFORM:
+		x = d->a + (d->b - d->a) * rng_uniform(r);
+		break;
+	case DELAY_NORMAL:
+		// Box-Muller, 1 - u is never 0
+		u = 1.0 - rng_uniform(r);
+		v = rng_uniform(r);
+		x = d->a + d->b * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+		break;
+	case DELAY_EXP:
+		x = -d->a * log(1.0 - rng_uniform(r));
+		break;
+	case DELAY_PARETO:
+		x = d->a / pow(1.0 - rng_uniform(r), 1.0 / d->b);
+		break;
+	}
+
+	return x < 0 ? 0 : x;
+}
+
+static int is_lost(struct link *l)
+{
+	struct loss_model *m = &l->cfg.loss;
+
+	switch (m->kind) {
+	case LOSS_NONE:
+		return 0;
+	case LOSS_BERNOULLI:
+		return rng_uniform(&l->rng) < m->p;
+	case LOSS_GILBERT_ELLIOTT:
+		// move the chain first, then lose with the probability of the new state
+		if (l->bad)
+			l->bad = !(rng_uniform(&l->rng) < m->r);
+		else
+			l->bad = rng_uniform(&l->rng) < m->p;
+		return rng_uniform(&l->rng) < (l->bad ? m->loss_bad : m->loss_good);
+	}
+
+	return 0;
+}
+
+void impairment_default(struct impairment *im)
+{
+	memset(im, 0, sizeof(struct impairment));
+	im->delay.kind = DELAY_CONST;
+	im->loss.kind = LOSS_NONE;
+	im->queue_bytes = 1 << 20;
+}
+
+static int is_probability(double p)
+{
+	return p >= 0 && p <= 1;
+}
+
+// parses "a[:b[:c[:d]]]" into values, returns the number of parsed ones or -1
+static int parse_numbers(const char *s, double *values, int max)
+{
+	int count = 0;
+	char *end;
+
+	while (count < max) {
+		values[count++] = strtod(s, &end);
+		if (end == s)
+			return -1;
+		if ('\0' == *end)
+			return count;
+		if (':' != *end)
+			return -1;
+		s = end + 1;
+	}
+
+	return -1;
+}
+
+static int set_delay(struct delay_model *d, const char *value)
+{
+	double v[2];
+	int n;
+	const char *colon = strchr(value, ':');
+
+	// a plain number is a constant delay
+	if (NULL == colon) {
+		if (parse_numbers(value, v, 1) != 1 || v[0] < 0)
+			return -1;
+		d->kind = DELAY_CONST;
+		d->a = v[0] * 1000;
+		return 0;
+	}
+
+	if ((n = parse_numbers(colon + 1, v, 2)) < 0 || v[0] < 0)
+		return -1;
+
+	size_t len = colon - value;
+	if (len == 5 && 0 == strncmp(value, "const", len) && 1 == n)
+		d->kind = DELAY_CONST;
+	else if (len == 7 && 0 == strncmp(value, "uniform", len) && 2 == n && v[1] >= v[0])
+		d->kind = DELAY_UNIFORM;
+	else if (len == 6 && 0 == strncmp(value, "normal", len) && 2 == n && v[1] >= 0)
+		d->kind = DELAY_NORMAL;
+	else if (len == 3 && 0 == strncmp(value, "exp", len) && 1 == n)
+		d->kind = DELAY_EXP;
+	else if (len == 6 && 0 == strncmp(value, "pareto", len) && 2 == n && v[1] > 0)
+		d->kind = DELAY_PARETO;
+	else
+		return -1;
+
+	// milliseconds on the command line, microseconds inside, the pareto shape has no unit
+	d->a = v[0] * 1000;
+	d->b = DELAY_PARETO == d->kind ? v[1] : (2 == n ? v[1] * 1000 : 0);
+	return 0;
+}
+
+static int set_loss(struct loss_model *m, const char *value)
+{
+	double v[4];
+	int n;
+
+	if (0 == strncmp(value, "ge:", 3)) {
+		if ((n = parse_numbers(value + 3, v, 4)) < 2)
+			return -1;
+		m->kind = LOSS_GILBERT_ELLIOTT;
+		m->p = v[0];
+		m->r = v[1];
+		m->loss_bad = n > 2 ? v[2] : 1.0;
+		m->loss_good = n > 3 ? v[3] : 0.0;
+		if (!is_probability(m->p) || !is_probability(m->r) || !is_probability(m->loss_bad) ||
+				!is_probability(m->loss_good))
+			return -1;
+		return 0;
+	}
+
+	if (parse_numbers(value, v, 1) != 1 || !is_probability(v[0]))
+		return -1;
+
+	m->kind = v[0] > 0 ? LOSS_BERNOULLI : LOSS_NONE;
+	m->p = v[0];
+	return 0;
+}
+
+int impairment_set(struct impairment *im, const char *setting)
+{
+	double v;
+	const char *value = strchr(setting, '=');
+
+	if (NULL == value)
+		return -1;
+
+	size_t len = value - setting;
+	value++;
+
+#define KEY(name) (len == strlen(name) && 0 == strncmp(setting, name, len))
+
+	if (KEY("delay"))
+		return set_delay(&im->delay, value);
+
+	if (KEY("loss"))
+		return set_loss(&im->loss, value);
+
+	if (parse_numbers(value, &v, 1) != 1)
+		return -1;
+
+	if (KEY("rate") && v >= 0)
+		im->rate_bps = v * 1000;
+	else if (KEY("queue") && v >= 0)
+		im->queue_bytes = (int64_t)v;
+	else if (KEY("reorder") && is_probability(v))
+		im->reorder = v;
+	else if (KEY("duplicate") && is_probability(v))
+		im->duplicate = v;
+	else if (KEY("corrupt") && is_probability(v))
+		im->corrupt = v;
+	else
+		return -1;
+
+#undef KEY
+
+	return 0;
+}
+
+void link_init(struct link *l, uint64_t seed)
+{
+	memset(l, 0, sizeof(struct link));
+	impairment_default(&l->cfg);
+	rng_seed(&l->rng, seed);
+}
+
+int link_admit(struct link *l, int64_t now, size_t size, int64_t release[2])
+{
+	struct impairment *im = &l->cfg;
+	int64_t sent = now;
+
+	l->stats.packets++;
+	l->stats.bytes += size;
+
+	// lost datagrams don't even reach the bottleneck
+	if (is_lost(l)) {
+		l->stats.lost++;
+		return 0;
+	}
+
+	// the bottleneck sends datagrams one after another, whatever waits for
+	// it longer than the queue allows is dropped (tail drop)
+	if (im->rate_bps > 0) {
+		int64_t start = l->busy_until_us > now ? l->busy_until_us : now;
+		if ((start - now) * im->rate_bps / 8e6 + size > im->queue_bytes) {
+			l->stats.queue_drops++;
+			return 0;
+		}
+		l->busy_until_us = start + (int64_t)(size * 8e6 / im->rate_bps);
+		sent = l->busy_until_us;
+	}
+
+	// the reordered datagram skips the propagation delay and arrives before
+	// the datagrams sent just before it
+	if (im->reorder > 0 && rng_uniform(&l->rng) < im->reorder) {
+		l->stats.reordered++;
+		release[0] = sent;
+	} else {
+		release[0] = sent + (int64_t)sample_delay(&im->delay, &l->rng);
+	}
+
+	// the copy has its own delay, just like a datagram sent twice
+	if (im->duplicate > 0 && rng_uniform(&l->rng) < im->duplicate) {
+		l->stats.duplicated++;
+		release[1] = sent + (int64_t)sample_delay(&im->delay, &l->rng);
+		return 2;
+	}
+
+	return 1;
+}
+
+void link_corrupt(struct link *l, char *data, size_t size)
+{
+	if (0 == size || l->cfg.corrupt <= 0 || rng_uniform(&l->rng) >= l->cfg.corrupt)
+		return;
+
+	size_t bit = (size_t)(rng_uniform(&l->rng) * size * 8);
+	data[bit / 8] ^= (char)(1 << (bit % 8));
+	l->stats.corrupted++;
+}
+
+void link_stats_print(FILE *f, const char *name, struct link *l)
+{
+	fprintf(f, "%s: packets=%llu bytes=%llu lost=%llu queue_drops=%llu reordered=%llu duplicated=%llu corrupted=%llu\n",
+			name, (unsigned long long)l->stats.packets, (unsigned long long)l->stats.bytes,
+			(unsigned long long)l->stats.lost, (unsigned long long)l->stats.queue_drops,
+			(unsigned long long)l->stats.reordered, (unsigned long long)l->stats.duplicated,
+			(unsigned long long)l->stats.corrupted);
+}
@@ -0,0 +1,121 @@
+#ifndef IMPAIR_H_
+#define IMPAIR_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// link impairments applied by the emulator to every datagram (or TCP chunk)
+// going in one direction, in this order:
+//   loss -> bottleneck queue and rate -> propagation delay -> duplication
+// and corruption of the delivered bytes
+
+// xorshift64* generator, every direction has its own one, so a run with
+// the same seed and the same traffic makes the same decisions
+struct rng {
+	uint64_t state;
+};
+
+void rng_seed(struct rng *r, uint64_t seed);
+
+// uniform in [0, 1)
+double rng_uniform(struct rng *r);
+
+enum delay_kind {
+	DELAY_CONST,
+	// uniform in [a, b]
+	DELAY_UNIFORM,
+	// normal with mean a and standard deviation b, cut at 0
+	DELAY_NORMAL,
+	// exponential with mean a
+	DELAY_EXP,
+	// pareto with minimum a and shape b (heavy tail for small b)
+	DELAY_PARETO
+};
+
+// times are in microseconds
+struct delay_model {
+	enum delay_kind kind;
+	double a;
+	double b;
+};
+
+enum loss_kind {
+	LOSS_NONE,
+	LOSS_BERNOULLI,
+	// two-state Markov chain (bursty losses)
+	LOSS_GILBERT_ELLIOTT
+};
+
+struct loss_model {
+	enum loss_kind kind;
+	// bernoulli: loss probability
+	// gilbert-elliott: probability of good -> bad transition
+	double p;
+	// gilbert-elliott: probability of bad -> good transition
+	// and loss probabilities in both states
+	double r;
+	double loss_bad;
+	double loss_good;
+};
+
+struct impairment {
+	struct delay_model delay;
+	struct loss_model loss;
+	// bottleneck rate in bits per second, 0 means unlimited
+	double rate_bps;
+	// bytes waiting for the bottleneck above which datagrams are dropped
+	int64_t queue_bytes;
+	// probability that a datagram skips the delay and overtakes earlier ones
+	double reorder;
+	// probability that a datagram is delivered twice
+	double duplicate;
+	// probability that a single bit of a datagram is flipped
+	double corrupt;
+};
+
+// statistics of one direction
+struct link_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t queue_drops;
+	uint64_t reordered;
+	uint64_t duplicated;
+	uint64_t corrupted;
+};
+
+// one direction of the emulated path
+struct link {
+	struct impairment cfg;
+	struct rng rng;
+	// state of the gilbert-elliott chain
+	int bad;
+	// the bottleneck is busy sending earlier datagrams until then
+	int64_t busy_until_us;
+	struct link_stats stats;
+};
+
+void impairment_default(struct impairment *im);
+
+// applies a single key=value setting, returns -1 if it is invalid
+//   delay=MS | const:MS | uniform:MIN:MAX | normal:MEAN:SD | exp:MEAN | pareto:MIN:SHAPE
+//   loss=P | ge:P:R[:LOSS_BAD[:LOSS_GOOD]]
+//   rate=KBIT (per second, 0 - unlimited)
+//   queue=BYTES
+//   reorder=P
+//   duplicate=P
+//   corrupt=P
+int impairment_set(struct impairment *im, const char *setting);
+
+void link_init(struct link *l, uint64_t seed);
+
+// decides the fate of a datagram of the size arriving at now, returns the number
+// of its copies to deliver (0 if it is lost) and their delivery times in release
+int link_admit(struct link *l, int64_t now, size_t size, int64_t release[2]);
+
+// flips a random bit of the datagram with the corrupt probability
+void link_corrupt(struct link *l, char *data, size_t size);
+
+void link_stats_print(FILE *f, const char *name, struct link *l);
+
+#endif
@@ -0,0 +1,801 @@
+#define _GNU_SOURCE
+#include "../mysocklib/mysocklib.h"
+#include "impair.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// network emulator - a proxy which forwards traffic between clients and
+// the target server through two emulated links (client -> server is "up",
+// server -> client is "down")
+//
+// UDP: every client (address, port) gets its own socket connected to the
+// target, so the replies can be routed back, every datagram is impaired
+// TCP: every accepted connection gets its own connection to the target,
+// the stream is forwarded in TCP_CHUNK pieces which are delayed and limited
+// by the rate, loss, reordering, duplication and corruption can't be applied
+// to a byte stream, so they are ignored, instead of dropping at the queue
+// limit the direction isn't read until its bytes drain below the limit, and
+// the released pieces are written without blocking as the receiver takes them
+
+#define BACKLOG 16
+#define MAX_FLOWS 1024
+#define MAX_DATAGRAM 65536
+// roughly one segment of ethernet, so the rate limit paces the stream smoothly
+#define TCP_CHUNK 1448
+// UDP flows without any datagram for that long are forgotten
+#define UDP_IDLE_US (60 * 1000000LL)
+#define MAX_STEPS 1024
+#define MAX_LINE 1024
+
+#define UP 0
+#define DOWN 1
+
+volatile sig_atomic_t do_work = 1;
+
+// datagram (or piece of the stream) waiting for its delivery time,
+// a TCP piece without data means the end of the stream
+struct packet {
+	int64_t release_us;
+	// packets released at the same time keep the order of arrival
+	uint64_t order;
+	int32_t flow;
+	int dir;
+	size_t len;
+	char *data;
+};
+
+// min-heap of packets ordered by (release_us, order)
+struct packet_queue {
+	struct packet *items;
+	int count;
+	int capacity;
+};
+
+// bytes waiting for the socket, data[start..end) is still to be written
+struct stream_buffer {
+	char *data;
+	size_t start;
+	size_t end;
+	size_t capacity;
+};
+
+struct flow {
+	int used;
+	// UDP: the client address, TCP: the accepted connection
+	struct sockaddr_in client;
+	int client_fd;
+	// socket connected to the target
+	int server_fd;
+	int64_t last_active_us;
+	// TCP: the direction has reached the end of the stream
+	int eof[2];
+	// TCP: the stream can't be reordered, the next piece is released after the previous one
+	int64_t last_release_us[2];
+	// packets of the flow in the queue, the sockets are closed when it drops to 0
+	int pending;
+	// TCP: bytes read from the direction and not written out yet
+	int64_t queued[2];
+	// TCP: released pieces the destination socket hasn't taken yet
+	struct stream_buffer out[2];
+	// TCP: 1 - the end of the stream has been released, 2 - it has been passed on
+	int shut[2];
+	// TCP: the other side has gone, nothing more is forwarded
+	int broken;
+};
+
+// one line of the scenario, settings are applied at the given time
+struct step {
+	int64_t at_us;
+	char *settings;
+};
+
+struct emulator {
+	int tcp;
+	int listen_fd;
+	struct sockaddr_in target;
+	struct link links[2];
+	struct flow flows[MAX_FLOWS];
+	struct packet_queue queue;
+	uint64_t order;
+
+	struct step steps[MAX_STEPS];
+	int step_count;
+	int next_step;
+	int64_t start_us;
+};
+
+void usage(char *name);
+void sigint_handler(int sig);
+int apply_setting(struct emulator *em, char *setting);
+int apply_settings(struct emulator *em, char *settings);
+void load_scenario(struct emulator *em, char *path);
+void run_scenario(struct emulator *em, int64_t now);
+void queue_push(struct packet_queue *q, struct packet *p);
+void queue_pop(struct packet_queue *q, struct packet *p);
+void enqueue(struct emulator *em, int32_t id, int dir, char *data, size_t len, int64_t now);
+void release_packet(struct emulator *em, struct packet *p);
+void stream_append(struct stream_buffer *b, char *data, size_t len);
+int32_t flow_open(struct emulator *em);
+void flow_close(struct emulator *em, int32_t id);
+int32_t udp_find_flow(struct emulator *em, struct sockaddr_in *addr);
+void udp_from_client(struct emulator *em, int64_t now);
+void udp_from_server(struct emulator *em, int32_t id, int64_t now);
+void tcp_accept(struct emulator *em, int64_t now);
+int tcp_can_read(struct emulator *em, struct flow *f, int dir);
+void tcp_read(struct emulator *em, int32_t id, int dir, int64_t now);
+void tcp_flush(struct emulator *em, int32_t id, int dir);
+void expire_flows(struct emulator *em, int64_t now);
+void do_emulator(struct emulator *em);
+
+int main(int argc, char **argv)
+{
+	int opt;
+	uint64_t seed = 1;
+	char *scenario = NULL;
+	struct emulator *em;
+
+	// the flow table is too big for the stack
+	if ((em = (struct emulator *)calloc(1, sizeof(struct emulator))) == NULL)
+		ERR("calloc:");
+
+	while ((opt = getopt(argc, argv, "ts:f:")) != -1) {
+		switch (opt) {
+		case 't':
+			em->tcp = 1;
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			scenario = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind < 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// both directions get different random streams of the same seed
+	link_init(&em->links[UP], seed * 2 + 1);
+	link_init(&em->links[DOWN], seed * 2 + 2);
+
+	for (int i = optind + 3; i < argc; i++) {
+		if (apply_setting(em, argv[i]) < 0) {
+			fprintf(stderr, "Invalid setting: %s\n", argv[i]);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (scenario)
+		load_scenario(em, scenario);
+
+	if (sethandler(SIG_IGN, SIGPIPE))
+		ERR("Seting SIGPIPE:");
+
+	if (sethandler(sigint_handler, SIGINT))
+		ERR("Seting SIGINT:");
+
+	em->target = IPv4_make_address(argv[optind + 1], argv[optind + 2]);
+	if (em->tcp)
+		em->listen_fd = TCP_IPv4_bind_socket(atoi(argv[optind]), BACKLOG);
+	else
+		em->listen_fd = UDP_IPv4_bind_socket(atoi(argv[optind]));
+
+	do_emulator(em);
+
+	link_stats_print(stderr, "up", &em->links[UP]);
+	link_stats_print(stderr, "down", &em->links[DOWN]);
+
+	if (TEMP_FAILURE_RETRY(close(em->listen_fd)) < 0)
+		ERR("close");
+
+	for (int i = 0; i < em->step_count; i++)
+		free(em->steps[i].settings);
+	free(em);
+
+	return EXIT_SUCCESS;
+}
+
+void sigint_handler(int sig)
+{
+	do_work = 0;
+}
+
+// applies key=value to both links, or to one of them with "up." or "down."
+// prefix, returns -1 if the setting is invalid
+int apply_setting(struct emulator *em, char *setting)
+{
+	if (0 == strncmp(setting, "up.", 3))
+		return impairment_set(&em->links[UP].cfg, setting + 3);
+
+	if (0 == strncmp(setting, "down.", 5))
+		return impairment_set(&em->links[DOWN].cfg, setting + 5);
+
+	if (impairment_set(&em->links[UP].cfg, setting) < 0)
+		return -1;
+	return impairment_set(&em->links[DOWN].cfg, setting);
+}
+
+// applies whitespace separated settings, "end" stops the emulator,
+// returns -1 if any of them is invalid
+int apply_settings(struct emulator *em, char *settings)
+{
+	char *copy, *token, *saveptr;
+	int result = 0;
+
+	if ((copy = strdup(settings)) == NULL)
+		ERR("strdup:");
+
+	for (token = strtok_r(copy, " \t\n", &saveptr); token; token = strtok_r(NULL, " \t\n", &saveptr)) {
+		if (0 == strcmp(token, "end"))
+			do_work = 0;
+		else if (apply_setting(em, token) < 0)
+			result = -1;
+	}
+
+	free(copy);
+	return result;
+}
+
+// scenario file, one step per line:
+//   TIME_MS setting setting ...
+// time is counted from the start of the emulator, lines starting with # are
+// comments, steps have to be sorted by time
+void load_scenario(struct emulator *em, char *path)
+{
+	FILE *f;
+	char line[MAX_LINE];
+	int number = 0;
+	int64_t previous = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		ERR("fopen:");
+
+	while (fgets(line, MAX_LINE, f)) {
+		char *rest;
+		number++;
+
+		if ('#' == line[0] || strspn(line, " \t\n") == strlen(line))
+			continue;
+
+		long long at_ms = strtoll(line, &rest, 10);
+		if (rest == line || at_ms * 1000 < previous || em->step_count == MAX_STEPS) {
+			fprintf(stderr, "%s:%d: invalid time\n", path, number);
+			exit(EXIT_FAILURE);
+		}
+
+		// every setting is checked now on a copy, so an error in the scenario
+		// doesn't show up in the middle of a benchmark
+		struct link saved[2] = { em->links[UP], em->links[DOWN] };
+		sig_atomic_t saved_work = do_work;
+		if (apply_settings(em, rest) < 0) {
+			fprintf(stderr, "%s:%d: invalid setting\n", path, number);
+			exit(EXIT_FAILURE);
+		}
+		em->links[UP] = saved[UP];
+		em->links[DOWN] = saved[DOWN];
+		do_work = saved_work;
+
+		struct step *s = &em->steps[em->step_count++];
+		s->at_us = previous = at_ms * 1000;
+		if ((s->settings = strdup(rest)) == NULL)
+			ERR("strdup:");
+	}
+
+	if (ferror(f))
+		ERR("fgets:");
+
+	if (fclose(f))
+		ERR("fclose:");
+}
+
+void run_scenario(struct emulator *em, int64_t now)
+{
+	while (em->next_step < em->step_count && em->steps[em->next_step].at_us <= now - em->start_us) {
+		struct step *s = &em->steps[em->next_step++];
+		apply_settings(em, s->settings);
+		fprintf(stderr, "[%lld ms]%s", (long long)(s->at_us / 1000), s->settings);
+	}
+}
+
+static int packet_before(struct packet *a, struct packet *b)
+{
+	if (a->release_us != b->release_us)
+		return a->release_us < b->release_us;
+	return a->order < b->order;
+}
+
+void queue_push(struct packet_queue *q, struct packet *p)
+{
+	if (q->count == q->capacity) {
+		q->capacity = q->capacity ? 2 * q->capacity : 1024;
+		if ((q->items = (struct packet *)realloc(q->items, q->capacity * sizeof(struct packet))) == NULL)
+			ERR("realloc:");
+	}
+
+	// sift up
+	int i = q->count++;
+	while (i > 0 && packet_before(p, &q->items[(i - 1) / 2])) {
+		q->items[i] = q->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	q->items[i] = *p;
+}
+
+void queue_pop(struct packet_queue *q, struct packet *p)
+{
+	*p = q->items[0];
+
+	// sift the last item down from the root
+	struct packet last = q->items[--q->count];
+	int i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= q->count)
+			break;
+		if (child + 1 < q->count && packet_before(&q->items[child + 1], &q->items[child]))
+			child++;
+		if (!packet_before(&q->items[child], &last))
+			break;
+		q->items[i] = q->items[child];
+		i = child;
+	}
+	q->items[i] = last;
+}
+
+// passes the packet through the link of the direction and queues its copies,
+// takes the ownership of data
+void enqueue(struct emulator *em, int32_t id, int dir, char *data, size_t len, int64_t now)
+{
+	struct flow *f = &em->flows[id];
+	int64_t release[2];
+	int copies;
+
+	if (em->tcp) {
+		// a byte stream is never lost, duplicated nor reordered, only delayed
+		struct link *l = &em->links[dir];
+		struct impairment saved = l->cfg;
+		l->cfg.loss.kind = LOSS_NONE;
+		l->cfg.reorder = 0;
+		l->cfg.duplicate = 0;
+		// the queue limit would drop a part of the stream, it stops reading instead
+		l->cfg.queue_bytes = INT64_MAX;
+		copies = link_admit(l, now, len, release);
+		l->cfg = saved;
+
+		if (release[0] < f->last_release_us[dir])
+			release[0] = f->last_release_us[dir];
+		f->last_release_us[dir] = release[0];
+		f->queued[dir] += len;
+	} else {
+		copies = link_admit(&em->links[dir], now, len, release);
+	}
+
+	for (int i = 0; i < copies; i++) {
+		struct packet p;
+		p.release_us = release[i];
+		p.order = em->order++;
+		p.flow = id;
+		p.dir = dir;
+		p.len = len;
+		p.data = data;
+
+		// the second copy needs its own buffer, the first one is freed on delivery
+		if (i > 0) {
+			if ((p.data = (char *)malloc(len)) == NULL)
+				ERR("malloc:");
+			memcpy(p.data, data, len);
+		}
+
+		// every copy is damaged (or not) on its own, a stream is never damaged
+		if (!em->tcp)
+			link_corrupt(&em->links[dir], p.data, len);
+
+		f->pending++;
+		queue_push(&em->queue, &p);
+	}
+
+	if (0 == copies)
+		free(data);
+}
+
+void release_packet(struct emulator *em, struct packet *p)
+{
+	struct flow *f = &em->flows[p->flow];
+	ssize_t sent = 0;
+
+	// the piece waits for the socket, the end of the stream after all of its data
+	if (em->tcp) {
+		if (NULL == p->data)
+			f->shut[p->dir] = 1;
+		else
+			stream_append(&f->out[p->dir], p->data, p->len);
+		free(p->data);
+		f->pending--;
+		tcp_flush(em, p->flow, p->dir);
+		return;
+	}
+
+	if (UP == p->dir) {
+		sent = TEMP_FAILURE_RETRY(send(f->server_fd, p->data, p->len, 0));
+	} else {
+		sent = TEMP_FAILURE_RETRY(sendto(em->listen_fd, p->data, p->len, 0, &f->client, sizeof(f->client)));
+	}
+
+	// the other side might have gone (or the target isn't running),
+	// it's the same as a loss on the real network
+	if (sent < 0 && EPIPE != errno && ECONNRESET != errno && ECONNREFUSED != errno)
+		ERR("send:");
+
+	free(p->data);
+	f->pending--;
+}
+
+void stream_append(struct stream_buffer *b, char *data, size_t len)
+{
+	if (b->end + len > b->capacity) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+
+	if (b->end + len > b->capacity) {
+		b->capacity = b->end + len > 2 * b->capacity ? b->end + len : 2 * b->capacity;
+		if ((b->data = (char *)realloc(b->data, b->capacity)) == NULL)
+			ERR("realloc:");
+	}
+
+	memcpy(b->data + b->end, data, len);
+	b->end += len;
+}
+
+int32_t flow_open(struct emulator *em)
+{
+	for (int32_t i = 0; i < MAX_FLOWS; i++) {
+		if (!em->flows[i].used) {
+			memset(&em->flows[i], 0, sizeof(struct flow));
+			em->flows[i].used = 1;
+			em->flows[i].client_fd = -1;
+			em->flows[i].server_fd = -1;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void flow_close(struct emulator *em, int32_t id)
+{
+	struct flow *f = &em->flows[id];
+
+	if (f->client_fd >= 0 && TEMP_FAILURE_RETRY(close(f->client_fd)) < 0)
+		ERR("close:");
+
+	if (f->server_fd >= 0 && TEMP_FAILURE_RETRY(close(f->server_fd)) < 0)
+		ERR("close:");
+
+	free(f->out[UP].data);
+	free(f->out[DOWN].data);
+	f->used = 0;
+}
+
+// returns the flow of the client, the new one is connected to the target,
+// -1 means there is no place for it
+int32_t udp_find_flow(struct emulator *em, struct sockaddr_in *addr)
+{
+	int32_t id;
+
+	for (id = 0; id < MAX_FLOWS; id++) {
+		struct flow *f = &em->flows[id];
+		if (f->used && f->client.sin_port == addr->sin_port && f->client.sin_addr.s_addr == addr->sin_addr.s_addr)
+			return id;
+	}
+
+	if ((id = flow_open(em)) < 0)
+		return -1;
+
+	struct flow *f = &em->flows[id];
+	f->client = *addr;
+	f->server_fd = UDP_IPv4_make_socket();
+	if (connect(f->server_fd, (struct sockaddr *)&em->target, sizeof(em->target)) < 0)
+		ERR("connect:");
+
+	return id;
+}
+
+void udp_from_client(struct emulator *em, int64_t now)
+{
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	char buf[MAX_DATAGRAM];
+	ssize_t len;
+
+	while ((len = recvfrom(em->listen_fd, buf, MAX_DATAGRAM, MSG_DONTWAIT, (struct sockaddr *)&addr, &size)) >= 0) {
+		int32_t id = udp_find_flow(em, &addr);
+		// too many clients, the datagram is dropped
+		if (id < 0)
+			continue;
+
+		em->flows[id].last_active_us = now;
+
+		char *data;
+		if ((data = (char *)malloc(len ? len : 1)) == NULL)
+			ERR("malloc:");
+		memcpy(data, buf, len);
+		enqueue(em, id, UP, data, len, now);
+	}
+
+	if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+		ERR("recvfrom:");
+}
+
+void udp_from_server(struct emulator *em, int32_t id, int64_t now)
+{
+	struct flow *f = &em->flows[id];
+	char buf[MAX_DATAGRAM];
+	ssize_t len;
+
+	while ((len = recv(f->server_fd, buf, MAX_DATAGRAM, MSG_DONTWAIT)) >= 0) {
+		f->last_active_us = now;
+
+		char *data;
+		if ((data = (char *)malloc(len ? len : 1)) == NULL)
+			ERR("malloc:");
+		memcpy(data, buf, len);
+		enqueue(em, id, DOWN, data, len, now);
+	}
+
+	// ICMP port unreachable of an earlier datagram, the target isn't running
+	if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno && ECONNREFUSED != errno)
+		ERR("recv:");
+}
+
+void tcp_accept(struct emulator *em, int64_t now)
+{
+	int client_fd, server_fd;
+	int32_t id;
+
+	if ((client_fd = add_new_client(em->listen_fd)) < 0)
+		return;
+
+	// the client is refused if there is no place for it or the target doesn't answer
+	server_fd = TCP_IPv4_make_socket();
+	if ((id = flow_open(em)) < 0 ||
+			TEMP_FAILURE_RETRY(connect(server_fd, (struct sockaddr *)&em->target, sizeof(em->target))) < 0) {
+		if (id >= 0)
+			em->flows[id].used = 0;
+		if (TEMP_FAILURE_RETRY(close(server_fd)) < 0 || TEMP_FAILURE_RETRY(close(client_fd)) < 0)
+			ERR("close:");
+		return;
+	}
+
+	em->flows[id].client_fd = client_fd;
+	em->flows[id].server_fd = server_fd;
+	em->flows[id].last_active_us = now;
+}
+
+// the direction is read only while its bytes in the link and in the
+// buffer stay below the queue limit of the link, so the sender is held back
+// by the flow control of TCP instead of the emulator buffering without end
+int tcp_can_read(struct emulator *em, struct flow *f, int dir)
+{
+	return !f->eof[dir] && !f->broken && f->queued[dir] < em->links[dir].cfg.queue_bytes;
+}
+
+void tcp_read(struct emulator *em, int32_t id, int dir, int64_t now)
+{
+	struct flow *f = &em->flows[id];
+	int fd = UP == dir ? f->client_fd : f->server_fd;
+	char *data;
+	ssize_t len;
+
+	if ((data = (char *)malloc(TCP_CHUNK)) == NULL)
+		ERR("malloc:");
+
+	if ((len = TEMP_FAILURE_RETRY(read(fd, data, TCP_CHUNK))) < 0 && ECONNRESET != errno)
+		ERR("read:");
+
+	f->last_active_us = now;
+
+	if (len > 0) {
+		enqueue(em, id, dir, data, len, now);
+		return;
+	}
+
+	// the end of the stream (or reset) travels through the link like data
+	free(data);
+	f->eof[dir] = 1;
+
+	struct packet p;
+	p.release_us = now > f->last_release_us[dir] ? now : f->last_release_us[dir];
+	p.order = em->order++;
+	p.flow = id;
+	p.dir = dir;
+	p.len = 0;
+	p.data = NULL;
+	f->pending++;
+	queue_push(&em->queue, &p);
+}
+
+// writes as much of the released data as the socket takes without blocking,
+// closes the flow once both streams have ended (or one side has gone)
+void tcp_flush(struct emulator *em, int32_t id, int dir)
+{
+	struct flow *f = &em->flows[id];
+	struct stream_buffer *b = &f->out[dir];
+	int fd = UP == dir ? f->server_fd : f->client_fd;
+
+	while (!f->broken && b->start < b->end) {
+		ssize_t sent = TEMP_FAILURE_RETRY(send(fd, b->data + b->start, b->end - b->start, MSG_DONTWAIT));
+		if (sent < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				break;
+			// the other side has gone, it's the same as a broken connection
+			// on the real network
+			if (EPIPE != errno && ECONNRESET != errno)
+				ERR("send:");
+			f->broken = 1;
+			break;
+		}
+		b->start += sent;
+		f->queued[dir] -= sent;
+	}
+
+	if (b->start == b->end && 1 == f->shut[dir]) {
+		shutdown(fd, SHUT_WR);
+		f->shut[dir] = 2;
+	}
+
+	if (0 == f->pending && (f->broken || (2 == f->shut[UP] && 2 == f->shut[DOWN])))
+		flow_close(em, id);
+}
+
+void expire_flows(struct emulator *em, int64_t now)
+{
+	for (int32_t i = 0; i < MAX_FLOWS; i++) {
+		struct flow *f = &em->flows[i];
+		if (f->used && 0 == f->pending && now - f->last_active_us > UDP_IDLE_US)
+			flow_close(em, i);
+	}
+}
+
+void do_emulator(struct emulator *em)
+{
+	struct pollfd fds[1 + 2 * MAX_FLOWS];
+	// which flow (and direction) every pollfd belongs to
+	int32_t owner[1 + 2 * MAX_FLOWS];
+	int owner_dir[1 + 2 * MAX_FLOWS];
+	int64_t last_expire = 0;
+
+	em->start_us = monotonic_us();
+
+	while (do_work) {
+		int64_t now = monotonic_us();
+		int count = 0;
+
+		run_scenario(em, now);
+
+		// deliver everything that is due
+		while (em->queue.count > 0 && em->queue.items[0].release_us <= now) {
+			struct packet p;
+			queue_pop(&em->queue, &p);
+			release_packet(em, &p);
+		}
+
+		if (!em->tcp && now - last_expire > 1000000) {
+			expire_flows(em, now);
+			last_expire = now;
+		}
+
+		fds[count].fd = em->listen_fd;
+		fds[count].events = POLLIN;
+		owner[count++] = -1;
+
+		for (int32_t i = 0; i < MAX_FLOWS; i++) {
+			struct flow *f = &em->flows[i];
+			if (!f->used)
+				continue;
+
+			if (!em->tcp) {
+				fds[count].fd = f->server_fd;
+				fds[count].events = POLLIN;
+				owner_dir[count] = DOWN;
+				owner[count++] = i;
+				continue;
+			}
+
+			// a TCP socket is read in its direction and written in the other one
+			for (int dir = UP; dir <= DOWN; dir++) {
+				short events = 0;
+				if (tcp_can_read(em, f, dir))
+					events |= POLLIN;
+				if (!f->broken && f->out[1 - dir].start < f->out[1 - dir].end)
+					events |= POLLOUT;
+				if (0 == events)
+					continue;
+
+				fds[count].fd = UP == dir ? f->client_fd : f->server_fd;
+				fds[count].events = events;
+				owner_dir[count] = dir;
+				owner[count++] = i;
+			}
+		}
+
+		// sleep until the next delivery or the next step of the scenario
+		int64_t timeout = 1000000;
+		if (em->queue.count > 0 && em->queue.items[0].release_us - now < timeout)
+			timeout = em->queue.items[0].release_us - now;
+		if (em->next_step < em->step_count &&
+				em->start_us + em->steps[em->next_step].at_us - now < timeout)
+			timeout = em->start_us + em->steps[em->next_step].at_us - now;
+
+		// poll counts in milliseconds, so it's rounded up, the delivery
+		// is at most 1 ms late, never early
+		int ready = poll(fds, count, timeout <= 0 ? 0 : (int)((timeout + 999) / 1000));
+		if (ready < 0 && EINTR != errno)
+			ERR("poll:");
+		if (ready <= 0)
+			continue;
+
+		now = monotonic_us();
+		for (int i = 0; i < count; i++) {
+			if (0 == fds[i].revents)
+				continue;
+
+			if (owner[i] < 0) {
+				if (em->tcp)
+					tcp_accept(em, now);
+				else
+					udp_from_client(em, now);
+			} else if (em->tcp) {
+				// the flow might have been closed by the other socket of it
+				if (!em->flows[owner[i]].used)
+					continue;
+				if (fds[i].revents & POLLOUT)
+					tcp_flush(em, owner[i], 1 - owner_dir[i]);
+				if (em->flows[owner[i]].used && (fds[i].events & POLLIN) && (fds[i].revents & ~POLLOUT))
+					tcp_read(em, owner[i], owner_dir[i], now);
+			} else {
+				udp_from_server(em, owner[i], now);
+			}
+		}
+	}
+
+	// packets still in the queue are lost
+	while (em->queue.count > 0) {
+		struct packet p;
+		queue_pop(&em->queue, &p);
+		free(p.data);
+	}
+	free(em->queue.items);
+
+	for (int32_t i = 0; i < MAX_FLOWS; i++)
+		if (em->flows[i].used)
+			flow_close(em, i);
+}
+
+void usage(char *name)
+{
+	fprintf(stderr, "USAGE: %s [-t] [-s seed] [-f scenario] port target_host target_port [setting ...]\n", name);
+	fprintf(stderr, "  -t           proxy TCP instead of UDP\n");
+	fprintf(stderr, "  -s seed      seed of the random decisions (default 1)\n");
+	fprintf(stderr, "  -f scenario  file with lines \"TIME_MS setting ...\" applied over time, \"end\" stops\n");
+	fprintf(stderr, "settings (prefix up. or down. applies to one direction only):\n");
+	fprintf(stderr, "  delay=MS | const:MS | uniform:MIN:MAX | normal:MEAN:SD | exp:MEAN | pareto:MIN:SHAPE\n");
+	fprintf(stderr, "  loss=P | ge:P_GOOD_BAD:P_BAD_GOOD[:LOSS_BAD[:LOSS_GOOD]]\n");
+	fprintf(stderr, "  rate=KBIT  queue=BYTES  reorder=P  duplicate=P  corrupt=P\n");
+}
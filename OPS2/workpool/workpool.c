@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include "workpool.h"
+#include "../mysocklib/mysocklib.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define INITIAL_DEQUE_SIZE 256
+// rounds of stealing (with sched_yield between them) before a worker parks
+#define SPIN_ROUNDS 16
+// tasks allocated at once when the caches run dry
+#define TASK_SLAB 1024
+
+struct wp_task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct wp_join *join;
+    // link in the injection queue
+    struct wp_task *next;
+};
+
+struct wp_deque_array {
+    int64_t size;
+    struct wp_deque_array *next;
+    struct wp_task *tasks[];
+};
+
+// the worker running the current thread
+static __thread struct wp_worker *current_worker;
+
+static long futex(uint32_t *addr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static struct wp_deque_array *array_new(int64_t size)
+{
+    struct wp_deque_array *a;
+    if ((a = (struct wp_deque_array *)malloc(sizeof(struct wp_deque_array) + size * sizeof(struct wp_task *))) == NULL)
+        ERR("malloc() failed");
+    a->size = size;
+    a->next = NULL;
+    return a;
+}
+
+static void deque_init(struct wp_deque *d)
+{
+    d->top = 0;
+    d->bottom = 0;
+    d->array = array_new(INITIAL_DEQUE_SIZE);
+    d->retired = NULL;
+}
+
+static void deque_destroy(struct wp_deque *d)
+{
+    while (d->retired) {
+        struct wp_deque_array *next = d->retired->next;
+        free(d->retired);
+        d->retired = next;
+    }
+    free(d->array);
+}
+
+// the deque follows "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Le, Pop, Cohen, Zappa Nardelli), only the owner pushes and takes
+static void deque_push(struct wp_deque *d, struct wp_task *t)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    struct wp_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (b - top > a->size - 1) {
+        // full, the tasks are copied to a twice bigger array, the old one
+        // is kept until the pool is destroyed as a thief may be reading it
+        struct wp_deque_array *bigger = array_new(2 * a->size);
+        for (int64_t i = top; i < b; i++)
+            bigger->tasks[i & (bigger->size - 1)] = __atomic_load_n(&a->tasks[i & (a->size - 1)], __ATOMIC_RELAXED);
+        a->next = d->retired;
+        d->retired = a;
+        __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+
+    __atomic_store_n(&a->tasks[b & (a->size - 1)], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// takes the newest task, NULL if the deque is empty
+static struct wp_task *deque_take(struct wp_deque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    struct wp_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    struct wp_task *t = NULL;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top <= b) {
+        t = __atomic_load_n(&a->tasks[b & (a->size - 1)], __ATOMIC_RELAXED);
+        if (top == b) {
+            // the last task, a thief may be taking it at the same time
+            if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                t = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return t;
+}
+
+// takes the oldest task, NULL if the deque is empty or another thread was faster
+static struct wp_task *deque_steal(struct wp_deque *d)
+{
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= b)
+        return NULL;
+
+    struct wp_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    struct wp_task *t = __atomic_load_n(&a->tasks[top & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return t;
+}
+
+static struct wp_task *inject_take(struct workpool *p)
+{
+    struct wp_task *t;
+
+    // cheap check without the lock, a worker comes back before it parks anyway
+    if (0 == __atomic_load_n(&p->inject_count, __ATOMIC_RELAXED))
+        return NULL;
+
+    if (pthread_mutex_lock(&p->inject_mutex))
+        ERR("pthread_mutex_lock() failed");
+    if ((t = p->inject_head) != NULL) {
+        p->inject_head = t->next;
+        if (NULL == p->inject_head)
+            p->inject_tail = NULL;
+        __atomic_fetch_sub(&p->inject_count, 1, __ATOMIC_RELAXED);
+    }
+    if (pthread_mutex_unlock(&p->inject_mutex))
+        ERR("pthread_mutex_unlock() failed");
+
+    return t;
+}
+
+// wakes one parked worker, if there is any
+static void wake_one(struct workpool *p)
+{
+    // pairs with the fence in park, either the worker sees the new task or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0 == __atomic_load_n(&p->sleepers, __ATOMIC_RELAXED))
+        return;
+    __atomic_fetch_add(&p->epoch, 1, __ATOMIC_RELEASE);
+    futex(&p->epoch, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void wake_all(struct workpool *p)
+{
+    __atomic_fetch_add(&p->epoch, 1, __ATOMIC_SEQ_CST);
+    futex(&p->epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+static void push_task(struct workpool *p, struct wp_task *t)
+{
+    __atomic_fetch_add(&p->pending, 1, __ATOMIC_RELAXED);
+
+    if (current_worker && current_worker->pool == p) {
+        deque_push(&current_worker->deque, t);
+    } else {
+        t->next = NULL;
+        if (pthread_mutex_lock(&p->inject_mutex))
+            ERR("pthread_mutex_lock() failed");
+        if (p->inject_tail)
+            p->inject_tail->next = t;
+        else
+            p->inject_head = t;
+        p->inject_tail = t;
+        __atomic_fetch_add(&p->inject_count, 1, __ATOMIC_RELAXED);
+        if (pthread_mutex_unlock(&p->inject_mutex))
+            ERR("pthread_mutex_unlock() failed");
+    }
+
+    wake_one(p);
+}
+
+static struct wp_task *task_new(struct workpool *p, void (*fn)(void *arg), void *arg, struct wp_join *join)
+{
+    struct wp_task *t;
+    if (current_worker && current_worker->pool == p) {
+        t = (struct wp_task *)mp_alloc(&current_worker->tasks);
+    } else {
+        if (pthread_mutex_lock(&p->inject_mutex))
+            ERR("pthread_mutex_lock() failed");
+        t = (struct wp_task *)mp_alloc(&p->inject_tasks);
+        if (pthread_mutex_unlock(&p->inject_mutex))
+            ERR("pthread_mutex_unlock() failed");
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->join = join;
+    return t;
+}
+
+void wp_submit(struct workpool *p, void (*fn)(void *arg), void *arg)
+{
+    push_task(p, task_new(p, fn, arg, NULL));
+}
+
+void wp_join_init(struct wp_join *j, void (*fn)(void *arg), void *arg)
+{
+    // the extra one is dropped by wp_join_seal
+    j->pending = 1;
+    j->fn = fn;
+    j->arg = arg;
+}
+
+void wp_submit_joined(struct workpool *p, struct wp_join *j, void (*fn)(void *arg), void *arg)
+{
+    __atomic_fetch_add(&j->pending, 1, __ATOMIC_RELAXED);
+    push_task(p, task_new(p, fn, arg, j));
+}
+
+static void join_release(struct workpool *p, struct wp_join *j)
+{
+    if (__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        wp_submit(p, j->fn, j->arg);
+}
+
+void wp_join_seal(struct workpool *p, struct wp_join *j)
+{
+    join_release(p, j);
+}
+
+static void run_task(struct wp_worker *w, struct wp_task *t)
+{
+    struct workpool *p = w->pool;
+
+    t->fn(t->arg);
+    w->executed++;
+
+    // the continuation is submitted before this task stops being pending,
+    // so wp_wait doesn't return in between
+    if (t->join)
+        join_release(p, t->join);
+    mp_free(&w->tasks, t);
+
+    if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        futex(&p->pending, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// the injection queue first, so external tasks aren't starved, then a
+// random victim and all others after it
+static struct wp_task *find_task(struct wp_worker *w)
+{
+    struct workpool *p = w->pool;
+    struct wp_task *t;
+
+    if ((t = inject_take(p)) != NULL) {
+        w->injected++;
+        return t;
+    }
+
+    int start = xorshift(&w->seed) % p->worker_count;
+    for (int i = 0; i < p->worker_count; i++) {
+        struct wp_worker *victim = &p->workers[(start + i) % p->worker_count];
+        if (victim == w)
+            continue;
+        if ((t = deque_steal(&victim->deque)) != NULL) {
+            w->stolen++;
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static int pool_done(struct workpool *p)
+{
+    return __atomic_load_n(&p->stopping, __ATOMIC_ACQUIRE) && 0 == __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE);
+}
+
+static void *worker_work(void *arg)
+{
+    struct wp_worker *w = (struct wp_worker *)arg;
+    struct workpool *p = w->pool;
+    struct wp_task *t;
+
+    current_worker = w;
+    aff_pin_self(&p->affinity, w->id);
+    deque_init(&w->deque);
+    mp_cache_init(&w->tasks, &p->tasks);
+
+    // nobody steals before every deque is there
+    int error = pthread_barrier_wait(&p->ready);
+    if (error && error != PTHREAD_BARRIER_SERIAL_THREAD)
+        ERR("pthread_barrier_wait() failed");
+
+    while (1) {
+        // own tasks first, the newest is the warmest in the cache
+        while ((t = deque_take(&w->deque)) != NULL)
+            run_task(w, t);
+
+        int rounds;
+        for (rounds = 0; rounds < SPIN_ROUNDS; rounds++) {
+            if ((t = find_task(w)) != NULL)
+                break;
+            if (pool_done(p))
+                return NULL;
+            sched_yield();
+        }
+        if (t) {
+            run_task(w, t);
+            continue;
+        }
+
+        // park, the epoch is read before the last look for work, so a task
+        // submitted after it changes the epoch and the futex doesn't sleep
+        uint32_t epoch = __atomic_load_n(&p->epoch, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if ((t = find_task(w)) == NULL && !pool_done(p)) {
+            w->parked++;
+            futex(&p->epoch, FUTEX_WAIT_PRIVATE, epoch);
+        }
+        __atomic_fetch_sub(&p->sleepers, 1, __ATOMIC_RELAXED);
+
+        if (t)
+            run_task(w, t);
+        else if (pool_done(p))
+            return NULL;
+    }
+
+    return NULL;
+}
+
+void wp_init(struct workpool *p, int worker_count)
+{
+    memset(p, 0, sizeof(struct workpool));
+
+    if (pthread_mutex_init(&p->inject_mutex, NULL))
+        ERR("pthread_mutex_init() failed");
+    mp_pool_init(&p->tasks, sizeof(struct wp_task), TASK_SLAB);
+    mp_cache_init(&p->inject_tasks, &p->tasks);
+    aff_plan_from_env(&p->affinity);
+    if (pthread_barrier_init(&p->ready, NULL, worker_count + 1))
+        ERR("pthread_barrier_init() failed");
+
+    if ((p->workers = (struct wp_worker *)aligned_alloc(64, worker_count * sizeof(struct wp_worker))) == NULL)
+        ERR("aligned_alloc() failed");
+    memset(p->workers, 0, worker_count * sizeof(struct wp_worker));
+    p->worker_count = worker_count;
+
+    for (int i = 0; i < worker_count; i++) {
+        struct wp_worker *w = &p->workers[i];
+        w->pool = p;
+        w->id = i;
+        w->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+    }
+
+    for (int i = 0; i < worker_count; i++)
+        if (pthread_create(&p->workers[i].tid, NULL, worker_work, &p->workers[i]))
+            ERR("pthread_create() failed");
+
+    // the deques are ready before anything is submitted
+    int error = pthread_barrier_wait(&p->ready);
+    if (error && error != PTHREAD_BARRIER_SERIAL_THREAD)
+        ERR("pthread_barrier_wait() failed");
+    if (pthread_barrier_destroy(&p->ready))
+        ERR("pthread_barrier_destroy() failed");
+}
+
+void wp_wait(struct workpool *p)
+{
+    uint32_t pending;
+    while ((pending = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+        futex(&p->pending, FUTEX_WAIT_PRIVATE, pending);
+}
+
+void wp_destroy(struct workpool *p)
+{
+    wp_wait(p);
+
+    __atomic_store_n(&p->stopping, 1, __ATOMIC_RELEASE);
+    wake_all(p);
+
+    for (int i = 0; i < p->worker_count; i++)
+        if (pthread_join(p->workers[i].tid, NULL))
+            ERR("pthread_join() failed");
+
+    for (int i = 0; i < p->worker_count; i++)
+        deque_destroy(&p->workers[i].deque);
+    free(p->workers);
+
+    // the caches go with the slabs
+    mp_pool_destroy(&p->tasks);
+    aff_plan_destroy(&p->affinity);
+    if (pthread_mutex_destroy(&p->inject_mutex))
+        ERR("pthread_mutex_destroy() failed");
+}
+
+int wp_worker_id(void)
+{
+    return current_worker ? current_worker->id : -1;
+}
+
+void wp_print_stats(FILE *f, struct workpool *p)
+{
+    for (int i = 0; i < p->worker_count; i++) {
+        struct wp_worker *w = &p->workers[i];
+        fprintf(f, "[Pool] worker %d: executed %llu, stolen %llu, injected %llu, parked %llu\n", w->id,
+                (unsigned long long)w->executed, (unsigned long long)w->stolen,
+                (unsigned long long)w->injected, (unsigned long long)w->parked);
+    }
+    mp_pool_print_stats(f, "Pool tasks", &p->tasks);
+    aff_print_plan(f, &p->affinity);
+}
@@ -0,0 +1,114 @@
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+#include "../affinity/affinity.h"
+#include "../mempool/mempool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// work-stealing thread pool
+//
+// every worker has its own Chase-Lev deque: it pushes and pops tasks at the
+// bottom without any lock, idle workers steal the oldest tasks from the top
+// of the others, tasks submitted from outside the pool go to a global
+// injection queue, workers with nothing to do park on a futex, so a busy pool
+// touches shared state only when the load is unbalanced
+//
+// the workers are pinned as AFFINITY says (see affinity.h), every one of
+// them allocates its deque after pinning, so it comes from its numa node
+//
+// tasks come from a slab pool, every worker allocates from (and frees to)
+// its own cache, tasks submitted from outside use a shared cache under the
+// injection mutex
+//
+// a task may be a part of a join: the continuation of the join is submitted
+// when every task of it has finished
+
+struct wp_task;
+struct wp_deque_array;
+
+struct wp_deque {
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    struct wp_deque_array *array;
+    // arrays replaced by the growth, a thief may still read them
+    struct wp_deque_array *retired;
+};
+
+struct wp_worker {
+    struct workpool *pool;
+    pthread_t tid;
+    int id;
+    uint64_t seed;
+    struct wp_deque deque;
+    struct mp_cache tasks;
+
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t injected;
+    uint64_t parked;
+} __attribute__((aligned(64)));
+
+struct workpool {
+    struct wp_worker *workers;
+    int worker_count;
+
+    // tasks submitted from outside the pool
+    pthread_mutex_t inject_mutex;
+    struct wp_task *inject_head;
+    struct wp_task *inject_tail;
+    uint32_t inject_count;
+    struct mp_cache inject_tasks;
+
+    struct mp_pool tasks;
+
+    struct aff_plan affinity;
+    // the workers have set up their deques
+    pthread_barrier_t ready;
+
+    // futex the idle workers park on, bumped by every wakeup
+    uint32_t epoch __attribute__((aligned(64)));
+    uint32_t sleepers;
+
+    // tasks submitted and not finished yet, wp_wait waits on it
+    uint32_t pending __attribute__((aligned(64)));
+    int stopping;
+};
+
+// a group of tasks with a continuation, lives as long as its tasks
+struct wp_join {
+    uint32_t pending;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+// starts worker_count workers
+void wp_init(struct workpool *p, int worker_count);
+
+// waits for every submitted task (and the tasks they submit), then stops the workers
+void wp_destroy(struct workpool *p);
+
+// runs fn(arg) on one of the workers, called by a task it goes to the deque
+// of its worker, otherwise to the injection queue
+void wp_submit(struct workpool *p, void (*fn)(void *arg), void *arg);
+
+// prepares a join, fn(arg) will be submitted when it's sealed and every task
+// of it has finished
+void wp_join_init(struct wp_join *j, void (*fn)(void *arg), void *arg);
+
+// submits a task of the join, the join must not be sealed yet
+void wp_submit_joined(struct workpool *p, struct wp_join *j, void (*fn)(void *arg), void *arg);
+
+// no more tasks will be added to the join, it may be released as soon as
+// the continuation starts
+void wp_join_seal(struct workpool *p, struct wp_join *j);
+
+// waits until there is no pending task, must not be called by a task
+void wp_wait(struct workpool *p);
+
+// returns the id of the worker running the caller, -1 outside the pool
+int wp_worker_id(void);
+
+void wp_print_stats(FILE *f, struct workpool *p);
+
+#endif